@@ -0,0 +1,119 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdlib.h>
+#include "cprowl.h"
+
+/*
+ * Queued requests are allocated by bumping a pointer through large chunks
+ * instead of one malloc each.  Every chunk counts its live allocations;
+ * once the allocator has moved on to a newer chunk, the old one is freed
+ * when its last allocation is released.  Queues release roughly in the
+ * order they allocate, so chunks drain from the oldest end.  An empty
+ * current chunk is simply rewound.
+ */
+
+#define ARENA_ALIGN 8
+
+typedef struct cprowl_arena_chunk {
+    size_t size;
+    size_t used;
+    size_t live;
+    int retired;
+} arena_chunk_t;
+
+/* each allocation is preceded by a pointer to its chunk */
+typedef union {
+    arena_chunk_t *chunk;
+    char pad[ARENA_ALIGN];
+} arena_header_t;
+
+#define ARENA_CHUNK_HEADER ((sizeof(arena_chunk_t) + ARENA_ALIGN - 1) & \
+                            ~(size_t) (ARENA_ALIGN - 1))
+#define ARENA_DATA(c) ((char *) (c) + ARENA_CHUNK_HEADER)
+
+void
+cprowl_arena_init(cprowl_arena_t *arena, size_t chunk_size)
+{
+    arena->current = NULL;
+    arena->chunk_size = chunk_size;
+}
+
+static void
+arena_retire(arena_chunk_t *chunk)
+{
+    if (chunk->live == 0) {
+        free(chunk);
+    } else {
+        chunk->retired = TRUE;
+    }
+}
+
+void*
+cprowl_arena_alloc(cprowl_arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk = arena->current;
+    arena_header_t *hdr;
+
+    size = (sizeof(arena_header_t) + size + ARENA_ALIGN - 1) &
+           ~(size_t) (ARENA_ALIGN - 1);
+
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+
+        if ((chunk = malloc(ARENA_CHUNK_HEADER + chunk_size)) == NULL) {
+            return NULL;
+        }
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        chunk->live = 0;
+        chunk->retired = FALSE;
+        if (arena->current) {
+            arena_retire(arena->current);
+        }
+        arena->current = chunk;
+    }
+
+    hdr = (arena_header_t *) (ARENA_DATA(chunk) + chunk->used);
+    hdr->chunk = chunk;
+    chunk->used += size;
+    chunk->live++;
+    return hdr + 1;
+}
+
+void
+cprowl_arena_release(void *ptr)
+{
+    arena_chunk_t *chunk = ((arena_header_t *) ptr - 1)->chunk;
+
+    if (--chunk->live > 0) {
+        return;
+    }
+    if (chunk->retired) {
+        free(chunk);
+    } else {
+        chunk->used = 0;
+    }
+}
+
+/* allocations still live keep their chunk until they are released */
+void
+cprowl_arena_cleanup(cprowl_arena_t *arena)
+{
+    if (arena->current) {
+        arena_retire(arena->current);
+        arena->current = NULL;
+    }
+}
@@ -0,0 +1,321 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include "cprowl.h"
+
+/*
+ * Webhook backends.  Every request that goes to Prowl can also be posted
+ * to any number of HTTP endpoints, each with a body rendered from a
+ * template.  In the template {app}, {event}, {description} and {priority}
+ * are replaced by the request's fields, escaped for the body's format
+ * (JSON strings, urlencoded form values or plain text, picked from the
+ * content type); any other brace is copied as is.
+ *
+ * Backends are added with --webhook url, which posts a JSON object, or
+ * read from a file of sections:
+ *
+ *   [chat]
+ *   url = https://chat.example.com/hooks/ops
+ *   body = {"text": "{app}: {event}\n{description}"}
+ *   content-type = application/json
+ *   header = Authorization: Bearer secret
+ *   concurrency = 2
+ *   rate = 1
+ *
+ * Values run to the end of the line; the body is used exactly as written,
+ * so a JSON body spells a newline as \n.  Each backend is sent through an
+ * engine of its own (see engine.c).
+ */
+
+#define BACKEND_DEFAULT_BODY \
+    "{\"app\": \"{app}\", \"event\": \"{event}\", " \
+    "\"description\": \"{description}\", \"priority\": {priority}}"
+#define BACKEND_DEFAULT_CONCURRENCY 4
+#define BACKEND_MAX_LINE 8192
+
+static const char *backend_fields[CPROWL_NFIELDS] = {
+    "app", "event", "description", "priority"
+};
+
+static cprowl_backend_t*
+backend_new(cprowl_options_t *opts, const char *name)
+{
+    cprowl_backend_t *b;
+
+    b = realloc(opts->backends, (opts->nbackends + 1) * sizeof(*b));
+    if (b == NULL) {
+        return NULL;
+    }
+    opts->backends = b;
+    b = &opts->backends[opts->nbackends++];
+    memset(b, 0, sizeof(*b));
+    b->name = strdup(name);
+    b->concurrency = BACKEND_DEFAULT_CONCURRENCY;
+    b->format = CPROWL_FORMAT_JSON;
+    return b;
+}
+
+static int
+backend_set_type(cprowl_backend_t *b, const char *type)
+{
+    char header[256];
+
+    if (strstr(type, "json")) {
+        b->format = CPROWL_FORMAT_JSON;
+    } else if (strstr(type, "x-www-form-urlencoded")) {
+        b->format = CPROWL_FORMAT_FORM;
+    } else {
+        b->format = CPROWL_FORMAT_TEXT;
+    }
+    snprintf(header, sizeof(header), "Content-Type: %s", type);
+    b->headers = curl_slist_append(b->headers, header);
+    return b->headers != NULL;
+}
+
+/* a backend without a body or content type gets the defaults */
+static int
+backend_finish(cprowl_backend_t *b)
+{
+    struct curl_slist *h;
+    int typed = FALSE;
+
+    if (b->url == NULL) {
+        fprintf(stderr, "backend %s: no url\n", b->name);
+        return FALSE;
+    }
+    for (h = b->headers; h; h = h->next) {
+        if (strncasecmp(h->data, "Content-Type:", 13) == 0) {
+            typed = TRUE;
+        }
+    }
+    if (!typed && !backend_set_type(b, "application/json")) {
+        return FALSE;
+    }
+    if (b->body == NULL && (b->body = strdup(BACKEND_DEFAULT_BODY)) == NULL) {
+        return FALSE;
+    }
+    /* bodies are small; skip the 100-continue round trip */
+    b->headers = curl_slist_append(b->headers, "Expect:");
+    return b->headers != NULL;
+}
+
+int
+cprowl_backend_add_webhook(cprowl_options_t *opts, const char *url)
+{
+    char name[32];
+    cprowl_backend_t *b;
+
+    snprintf(name, sizeof(name), "webhook%zu", opts->nbackends + 1);
+    if ((b = backend_new(opts, name)) == NULL ||
+        (b->url = strdup(url)) == NULL) {
+        return FALSE;
+    }
+    return backend_finish(b);
+}
+
+static char*
+backend_trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char) *s)) {
+        s++;
+    }
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char) end[-1])) {
+        *--end = '\0';
+    }
+    return s;
+}
+
+int
+cprowl_backend_load(cprowl_options_t *opts, const char *path)
+{
+    char line[BACKEND_MAX_LINE];
+    cprowl_backend_t *b = NULL;
+    unsigned long lineno = 0;
+    FILE *fp;
+    int rc = FALSE;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        perror(path);
+        return FALSE;
+    }
+
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = backend_trim(line), *key, *value;
+
+        lineno++;
+        if (*p == '\0' || *p == '#' || *p == ';') {
+            continue;
+        }
+        if (*p == '[') {
+            char *end = strchr(p, ']');
+            if (end == NULL) {
+                goto invalid;
+            }
+            *end = '\0';
+            if (b && !backend_finish(b)) {
+                goto done;
+            }
+            if ((b = backend_new(opts, backend_trim(p + 1))) == NULL) {
+                goto done;
+            }
+            continue;
+        }
+        if (b == NULL || (value = strchr(p, '=')) == NULL) {
+            goto invalid;
+        }
+        *value++ = '\0';
+        key = backend_trim(p);
+        value = backend_trim(value);
+
+        if (strcmp(key, "url") == 0) {
+            free(b->url);
+            b->url = strdup(value);
+        } else if (strcmp(key, "body") == 0) {
+            free(b->body);
+            b->body = strdup(value);
+        } else if (strcmp(key, "content-type") == 0) {
+            if (!backend_set_type(b, value)) {
+                goto done;
+            }
+        } else if (strcmp(key, "header") == 0) {
+            b->headers = curl_slist_append(b->headers, value);
+        } else if (strcmp(key, "concurrency") == 0) {
+            if ((b->concurrency = atoi(value)) < 1) {
+                goto invalid;
+            }
+        } else if (strcmp(key, "rate") == 0) {
+            b->rate = atof(value);
+        } else {
+            goto invalid;
+        }
+    }
+    rc = b ? backend_finish(b) : TRUE;
+    goto done;
+
+invalid:
+    fprintf(stderr, "%s:%lu: invalid line\n", path, lineno);
+done:
+    fclose(fp);
+    return rc;
+}
+
+/* append value to body, escaped for the format */
+static int
+backend_append(cprowl_buf_t *body, int format, const char *value)
+{
+    const unsigned char *p = (const unsigned char *) value;
+    size_t len = strlen(value);
+
+    if (format == CPROWL_FORMAT_TEXT) {
+        return cprowl_buf_append(body, value, len);
+    }
+    if (!cprowl_buf_reserve(body, CPROWL_WIRE_ESCAPE_SIZE(len))) {
+        return FALSE;
+    }
+    if (format == CPROWL_FORMAT_FORM) {
+        body->len = cprowl_wire_escape(body->data + body->len, value,
+                                       len) -
+                    body->data;
+    } else {
+        char *out = body->data + body->len;
+
+        for (; *p; p++) {
+            if (*p == '"' || *p == '\\') {
+                *out++ = '\\';
+                *out++ = *p;
+            } else if (*p == '\n') {
+                *out++ = '\\';
+                *out++ = 'n';
+            } else if (*p < 0x20) {
+                out += sprintf(out, "\\u%04x", *p);
+            } else {
+                *out++ = *p;
+            }
+        }
+        body->len = out - body->data;
+    }
+    body->data[body->len] = '\0';
+    return TRUE;
+}
+
+static int
+backend_render(const cprowl_backend_t *b, cprowl_buf_t *body,
+               cprowl_add_request_t *req)
+{
+    const char *p = b->body, *open;
+
+    cprowl_buf_reset(body);
+    while ((open = strchr(p, '{')) != NULL) {
+        const char *close = strchr(open, '}');
+        int field = -1, i;
+
+        for (i = 0; close && i < CPROWL_NFIELDS; i++) {
+            if ((size_t) (close - open - 1) == strlen(backend_fields[i]) &&
+                strncmp(open + 1, backend_fields[i], close - open - 1) == 0) {
+                field = i;
+            }
+        }
+        if (field < 0) {
+            if (!cprowl_buf_append(body, p, open + 1 - p)) {
+                return FALSE;
+            }
+            p = open + 1;
+            continue;
+        }
+        if (!cprowl_buf_append(body, p, open - p) ||
+            !backend_append(body, b->format, cprowl_request_get(req, field))) {
+            return FALSE;
+        }
+        p = close + 1;
+    }
+    return cprowl_buf_append(body, p, strlen(p));
+}
+
+int
+cprowl_backend_prepare(const cprowl_backend_t *backend, cprowl_buf_t *body,
+                       CURL *curl, cprowl_add_request_t *req)
+{
+    if (!backend_render(backend, body, req)) {
+        return FALSE;
+    }
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, backend->headers);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body->len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->data);
+    return TRUE;
+}
+
+void
+cprowl_backend_free_all(cprowl_options_t *opts)
+{
+    size_t i;
+
+    for (i = 0; i < opts->nbackends; i++) {
+        free(opts->backends[i].name);
+        free(opts->backends[i].url);
+        free(opts->backends[i].body);
+        curl_slist_free_all(opts->backends[i].headers);
+    }
+    free(opts->backends);
+    opts->backends = NULL;
+    opts->nbackends = 0;
+}
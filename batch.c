@@ -0,0 +1,270 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * Batch mode reads newline delimited JSON records (see ndjson.c) and sends
+ * them through the engine, opts->concurrency at a time.  Input is consumed
+ * through a fixed size buffer and records wait in a fixed window of slots,
+ * so memory use does not depend on the size of the input.  One status line
+ * "<line> <result>" is written per record, in input order, even though
+ * sends may complete out of order.
+ */
+
+#define BATCH_MAX_LINE (128 * 1024)
+
+enum { SLOT_FREE, SLOT_BUSY, SLOT_DONE };
+
+typedef struct {
+    cprowl_add_request_t req;
+    cprowl_job_t job;
+    unsigned long lineno;
+    int state;
+    char result[128];
+} batch_slot_t;
+
+typedef struct {
+    cprowl_engine_t engine;
+    cprowl_add_request_t *defaults;
+    batch_slot_t *slots;
+    size_t nslots;
+    size_t head;      /* oldest record not yet reported */
+    size_t count;     /* records in the window */
+    cprowl_coalesce_t coalesce;
+    int coalescing;
+} batch_t;
+
+static void
+batch_emit(cprowl_add_request_t *req, void *arg)
+{
+    batch_t *batch = arg;
+    cprowl_engine_submit_copy(&batch->engine, req);
+}
+
+static void
+batch_job_done(cprowl_job_t *job)
+{
+    batch_slot_t *slot = job->arg;
+    const char *result;
+
+    result = cprowl_result_string(job->res, job->http_error_code,
+                                  slot->result, sizeof(slot->result));
+    if (result != slot->result) {
+        snprintf(slot->result, sizeof(slot->result), "%s", result);
+    }
+    cprowl_request_free(&slot->req);
+    slot->state = SLOT_DONE;
+}
+
+/* report finished records from the head of the window, in order */
+static void
+batch_flush(batch_t *batch)
+{
+    while (batch->count > 0) {
+        batch_slot_t *slot = &batch->slots[batch->head];
+        if (slot->state != SLOT_DONE) {
+            break;
+        }
+        fprintf(stdout, "%lu %s\n", slot->lineno, slot->result);
+        slot->state = SLOT_FREE;
+        batch->head = (batch->head + 1) % batch->nslots;
+        batch->count--;
+    }
+    fflush(stdout);
+}
+
+static batch_slot_t*
+batch_slot(batch_t *batch, unsigned long lineno)
+{
+    batch_slot_t *slot;
+
+    /* wait for the oldest record when the window is full */
+    batch_flush(batch);
+    while (batch->count == batch->nslots) {
+        cprowl_engine_perform(&batch->engine, 1000);
+        batch_flush(batch);
+    }
+
+    slot = &batch->slots[(batch->head + batch->count) % batch->nslots];
+    batch->count++;
+    slot->lineno = lineno;
+    slot->state = SLOT_DONE;
+    return slot;
+}
+
+static void
+batch_record(batch_t *batch, unsigned long lineno, char *line, size_t len)
+{
+    batch_slot_t *slot;
+
+    /* skip blank lines */
+    while (len > 0 && (line[len - 1] == '\r' || line[len - 1] == ' ')) {
+        len--;
+    }
+    if (len == 0) {
+        return;
+    }
+
+    slot = batch_slot(batch, lineno);
+
+    if (!cprowl_request_copy(&slot->req, batch->defaults)) {
+        strcpy(slot->result, "out of memory");
+        return;
+    }
+
+    /* without webhooks there is nowhere to send a keyless record */
+    if (!cprowl_ndjson_decode(&slot->req, line, len) ||
+        (slot->req.nkeys == 0 && batch->engine.npeers == 0)) {
+        strcpy(slot->result, "invalid record");
+        cprowl_request_free(&slot->req);
+        return;
+    }
+
+    if (batch->coalescing) {
+        if (!cprowl_coalesce_check(&batch->coalesce, &slot->req,
+                                   cprowl_now_ms())) {
+            strcpy(slot->result, "coalesced");
+            cprowl_request_free(&slot->req);
+            return;
+        }
+    }
+
+    slot->state = SLOT_BUSY;
+    slot->job.req = &slot->req;
+    slot->job.cb = batch_job_done;
+    slot->job.arg = slot;
+    cprowl_engine_submit(&batch->engine, &slot->job);
+    cprowl_engine_perform(&batch->engine, 0);
+}
+
+static void
+batch_report_too_long(batch_t *batch, unsigned long lineno)
+{
+    batch_slot_t *slot = batch_slot(batch, lineno);
+    strcpy(slot->result, "record too long");
+}
+
+int
+cprowl_batch_run(const char *path, cprowl_add_request_t *defaults,
+                 const cprowl_options_t *opts)
+{
+    batch_t batch;
+    unsigned long lineno = 0;
+    char *line = NULL;
+    size_t used = 0;
+    int skipping = FALSE;
+    int fd;
+    int rc = FALSE;
+
+    if (strcmp(path, "-") == 0) {
+        fd = STDIN_FILENO;
+    } else if ((fd = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        return FALSE;
+    }
+
+    memset(&batch, 0, sizeof(batch));
+    batch.defaults = defaults;
+    batch.nslots = opts->concurrency * 2;
+
+    if ((line = malloc(BATCH_MAX_LINE)) == NULL ||
+        (batch.slots = calloc(batch.nslots, sizeof(batch_slot_t))) == NULL) {
+        goto done;
+    }
+
+    if (opts->coalesce_ms > 0) {
+        if (!cprowl_coalesce_init(&batch.coalesce, CPROWL_COALESCE_SLOTS,
+                                  opts->coalesce_ms, batch_emit, &batch)) {
+            goto done;
+        }
+        batch.coalescing = TRUE;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (!cprowl_engine_init(&batch.engine, opts)) {
+        fprintf(stderr, "unable to initialize curl\n");
+        goto done;
+    }
+
+    for (;;) {
+        ssize_t n = read(fd, line + used, BATCH_MAX_LINE - used);
+        char *p, *nl;
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror(path);
+            break;
+        }
+        if (n == 0) {
+            /* last record without a trailing newline */
+            if (used > 0 && !skipping) {
+                batch_record(&batch, ++lineno, line, used);
+            }
+            rc = TRUE;
+            break;
+        }
+        used += n;
+
+        p = line;
+        while ((nl = memchr(p, '\n', used - (p - line))) != NULL) {
+            lineno++;
+            if (skipping) {
+                skipping = FALSE;
+            } else {
+                batch_record(&batch, lineno, p, nl - p);
+            }
+            p = nl + 1;
+        }
+        used -= p - line;
+        memmove(line, p, used);
+
+        /* a record larger than the buffer is reported and discarded */
+        if (used == BATCH_MAX_LINE) {
+            if (!skipping) {
+                batch_report_too_long(&batch, lineno + 1);
+            }
+            skipping = TRUE;
+            used = 0;
+        }
+    }
+
+    /* the input is over, so every open window closes now */
+    if (batch.coalescing) {
+        cprowl_coalesce_expire(&batch.coalesce, cprowl_now_ms(), TRUE);
+    }
+
+    /* drain everything still in flight */
+    cprowl_engine_run(&batch.engine);
+    batch_flush(&batch);
+
+    cprowl_engine_cleanup(&batch.engine);
+    curl_global_cleanup();
+
+done:
+    cprowl_coalesce_cleanup(&batch.coalesce);
+    free(batch.slots);
+    free(line);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return rc;
+}
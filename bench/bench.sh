@@ -0,0 +1,39 @@
+#!/bin/sh
+#
+# Send path benchmark against the local mock endpoint: one-shot, batch and
+# daemon modes, each reporting throughput, p50/p99/p999 latency and the
+# peak RSS of cprowl.  One-shot and batch latency ("send") runs until the
+# result is known.  The daemon acks on queueing, so its "ack" latency is not
+# comparable; the "daemon delivery" line the mock prints after the runs is.
+#
+#   bench/bench.sh [requests] [latency_ms] [error_percent] [quota]
+#
+# ONESHOT sets how many one-shot runs to time (default 200), JOBS the
+# concurrency of batch and daemon mode (default 8).
+#
+# Expects cprowl, mock and driver in ./build (./waf configure --with-bench; ./waf).
+
+REQUESTS=${1:-5000}
+LATENCY=${2:-20}
+ERRORS=${3:-0}
+QUOTA=${4:-0}
+ONESHOT=${ONESHOT:-200}
+JOBS=${JOBS:-8}
+PORT=${PORT:-18080}
+BUILD=${BUILD:-./build/default}
+URL=http://127.0.0.1:$PORT/publicapi/add
+LOG=$(mktemp)
+
+$BUILD/mock -p $PORT -l $LATENCY -e $ERRORS -r $QUOTA -t 2> $LOG &
+MOCK=$!
+sleep 0.2
+
+echo "latency=${LATENCY}ms errors=${ERRORS}% quota=${QUOTA}"
+$BUILD/driver -c $BUILD/cprowl -u $URL -m oneshot -n $ONESHOT -j 1
+$BUILD/driver -c $BUILD/cprowl -u $URL -m batch -n $REQUESTS -j $JOBS
+$BUILD/driver -c $BUILD/cprowl -u $URL -m daemon -n $REQUESTS -j $JOBS
+
+kill $MOCK
+sleep 0.1
+sed 's/^priority  0:/daemon delivery:/' $LOG
+rm -f $LOG
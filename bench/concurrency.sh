@@ -0,0 +1,38 @@
+#!/bin/sh
+#
+# Throughput of --batch against the local mock endpoint at increasing
+# concurrency levels.
+#
+#   bench/concurrency.sh [records] [latency_ms]
+#
+# Expects cprowl and mock in ./build (./waf configure --with-bench; ./waf).
+
+RECORDS=${1:-2000}
+LATENCY=${2:-20}
+PORT=${PORT:-18080}
+BUILD=${BUILD:-./build/default}
+KEY=0123456789012345678901234567890123456789
+
+INPUT=$(mktemp)
+i=0
+while [ $i -lt $RECORDS ]; do
+    echo "{\"event\":\"bench $i\",\"description\":\"benchmark record $i\"}"
+    i=$((i + 1))
+done > $INPUT
+
+$BUILD/mock -p $PORT -l $LATENCY 2>/dev/null &
+MOCK=$!
+sleep 0.2
+
+echo "records=$RECORDS latency=${LATENCY}ms"
+for j in 1 2 4 8 16 32 64; do
+    start=$(date +%s.%N)
+    $BUILD/cprowl -u http://127.0.0.1:$PORT/publicapi/add -a $KEY \
+        -j $j --batch $INPUT > /dev/null
+    end=$(date +%s.%N)
+    echo "$start $end" | awk -v j=$j -v n=$RECORDS \
+        '{ t = $2 - $1; printf "concurrency=%-3d %8.3fs %10.1f req/s\n", j, t, n / t }'
+done
+
+kill $MOCK
+rm -f $INPUT
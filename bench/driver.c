@@ -0,0 +1,438 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+/*
+ * driver : runs cprowl against an endpoint (normally bench/mock) in one of
+ * its send modes and reports throughput, latency percentiles and the peak
+ * RSS of the cprowl process.
+ *
+ *   driver -m oneshot|batch|daemon|lanes [-n requests] [-j concurrency]
+ *          [-c path/to/cprowl] [-u url] [-S socket] [-b backlog]
+ *
+ * oneshot  runs cprowl once per request; latency is the whole run
+ * batch    feeds --batch on stdin; latency is from writing a record to
+ *          reading its result
+ * daemon   submits binary frames on one connection; latency is the time
+ *          to the ack, and throughput counts until the daemon has sent
+ *          everything and exited.  Each description is its submit time,
+ *          so a mock run with -t reports the delivery latency
+ * lanes    queues a backlog of priority -2 sends in the daemon, then sends
+ *          one emergency (priority 2) request every 20ms; run the mock
+ *          with -t to see the delivery latency of each priority
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+#define DRIVER_KEY "0123456789012345678901234567890123456789"
+
+static const char *cprowl_path = "./build/default/cprowl";
+static const char *url = "http://127.0.0.1:18080/publicapi/add";
+static const char *socket_path = "/tmp/cprowl-bench.sock";
+static int requests = 1000;
+static int concurrency = 8;
+static int backlog = 0;
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static pid_t
+spawn(char *const argv[], int *in, int *out)
+{
+    int pin[2], pout[2];
+    pid_t pid;
+
+    if ((in && pipe(pin) < 0) || (out && pipe(pout) < 0)) {
+        perror("pipe");
+        exit(1);
+    }
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_RDWR);
+
+        dup2(in ? pin[0] : devnull, 0);
+        dup2(out ? pout[1] : devnull, 1);
+        if (in) {
+            close(pin[0]);
+            close(pin[1]);
+        }
+        if (out) {
+            close(pout[0]);
+            close(pout[1]);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (in) {
+        close(pin[0]);
+        *in = pin[1];
+    }
+    if (out) {
+        close(pout[1]);
+        *out = pout[0];
+    }
+    return pid;
+}
+
+/* wait for pid, returning its peak RSS in KB */
+static long
+reap(pid_t pid, int *status)
+{
+    struct rusage ru;
+
+    while (wait4(pid, status, 0, &ru) < 0) {
+        if (errno != EINTR) {
+            perror("wait4");
+            return 0;
+        }
+    }
+    return ru.ru_maxrss;
+}
+
+static int
+run_oneshot(double *lat, long *rss)
+{
+    char *argv[] = { (char *) cprowl_path, "-u", (char *) url, "-a", DRIVER_KEY,
+                     "-e", "bench", "-d", "oneshot benchmark", NULL };
+    int i, errors = 0;
+
+    for (i = 0; i < requests; i++) {
+        double t0 = now_sec();
+        int status;
+        long r = reap(spawn(argv, NULL, NULL), &status);
+
+        lat[i] = now_sec() - t0;
+        if (r > *rss) {
+            *rss = r;
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            errors++;
+        }
+    }
+    return errors;
+}
+
+static int
+run_batch(double *lat, long *rss)
+{
+    char jobs[16];
+    char *argv[] = { (char *) cprowl_path, "-u", (char *) url, "-a", DRIVER_KEY,
+                     "-j", jobs, "--batch", "-", NULL };
+    double *sent = calloc(requests, sizeof(double));
+    char line[256], out[4096];
+    size_t line_len = 0, line_off = 0, used = 0;
+    int in, rd, written = 0, done = 0, errors = 0, status;
+    pid_t pid;
+
+    snprintf(jobs, sizeof(jobs), "%d", concurrency);
+    pid = spawn(argv, &in, &rd);
+    fcntl(in, F_SETFL, O_NONBLOCK);
+
+    while (done < requests) {
+        struct pollfd pfd[2] = { { rd, POLLIN, 0 }, { in, POLLOUT, 0 } };
+        int n = in >= 0 ? 2 : 1;
+
+        if (poll(pfd, n, -1) < 0 && errno != EINTR) {
+            break;
+        }
+
+        /* write records while the pipe takes them */
+        while (in >= 0 && (pfd[1].revents & POLLOUT)) {
+            ssize_t w;
+
+            if (line_off == line_len) {
+                if (written == requests) {
+                    close(in);
+                    in = -1;
+                    break;
+                }
+                line_len = snprintf(line, sizeof(line),
+                                    "{\"event\":\"bench %d\",\"description\":"
+                                    "\"batch benchmark record %d\"}\n",
+                                    written, written);
+                line_off = 0;
+                sent[written++] = now_sec();
+            }
+            if ((w = write(in, line + line_off, line_len - line_off)) <= 0) {
+                break;
+            }
+            line_off += w;
+        }
+
+        if (pfd[0].revents & (POLLIN | POLLHUP)) {
+            ssize_t r = read(rd, out + used, sizeof(out) - used);
+            char *p, *nl;
+            double now = now_sec();
+
+            if (r <= 0) {
+                break;
+            }
+            used += r;
+            for (p = out; (nl = memchr(p, '\n', used - (p - out))); p = nl + 1) {
+                char *result;
+                long lineno = strtol(p, &result, 10);
+
+                if (lineno >= 1 && lineno <= requests) {
+                    lat[lineno - 1] = now - sent[lineno - 1];
+                }
+                if (strncmp(result, " ok", 3) != 0) {
+                    errors++;
+                }
+                done++;
+            }
+            used -= p - out;
+            memmove(out, p, used);
+        }
+    }
+
+    if (in >= 0) {
+        close(in);
+    }
+    close(rd);
+    *rss = reap(pid, &status);
+    free(sent);
+    return errors + (requests - done);
+}
+
+/* start a daemon and connect to it; -1 when it does not come up */
+static int
+daemon_start(pid_t *pidp)
+{
+    char jobs[16];
+    char *argv[] = { (char *) cprowl_path, "-D", "-S", (char *) socket_path,
+                     "-u", (char *) url, "-j", jobs, NULL };
+    struct sockaddr_un addr;
+    int fd = -1, i, status;
+    pid_t pid;
+
+    snprintf(jobs, sizeof(jobs), "%d", concurrency);
+    unlink(socket_path);
+    *pidp = pid = spawn(argv, NULL, NULL);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path) - 1);
+    for (i = 0; i < 500; i++) {
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+        usleep(10000);
+    }
+    if (fd < 0) {
+        fprintf(stderr, "daemon did not come up on %s\n", socket_path);
+        kill(pid, SIGKILL);
+        reap(pid, &status);
+    }
+    return fd;
+}
+
+/* queue one request stamped with the current time; TRUE once acked */
+static int
+daemon_send(int fd, cprowl_add_request_t *req, cprowl_buf_t *frame)
+{
+    struct timespec ts;
+    unsigned char ack = 0xff;
+    char stamp[32];
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    snprintf(stamp, sizeof(stamp), "%lld",
+             (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+    cprowl_request_set(req, CPROWL_FIELD_DESCRIPTION, stamp, strlen(stamp));
+    frame->len = 0;
+    cprowl_wire_encode_frame(frame, req);
+
+    return write(fd, frame->data, frame->len) == (ssize_t) frame->len &&
+           read(fd, &ack, 1) == 1 && ack == CPROWL_ACK_QUEUED;
+}
+
+static int
+run_daemon(double *lat, long *rss)
+{
+    cprowl_add_request_t req;
+    cprowl_buf_t frame;
+    int fd, i, errors = 0, status;
+    pid_t pid;
+
+    if ((fd = daemon_start(&pid)) < 0) {
+        return requests;
+    }
+
+    cprowl_request_add_init(&req);
+    cprowl_request_add_apikey(&req, DRIVER_KEY);
+    cprowl_request_set(&req, CPROWL_FIELD_EVENT, "bench", 5);
+    cprowl_buf_init(&frame);
+
+    for (i = 0; i < requests; i++) {
+        double t0 = now_sec();
+
+        if (!daemon_send(fd, &req, &frame)) {
+            errors++;
+        }
+        lat[i] = now_sec() - t0;
+    }
+    close(fd);
+
+    /* the daemon sends everything queued before it exits */
+    kill(pid, SIGTERM);
+    *rss = reap(pid, &status);
+
+    cprowl_buf_free(&frame);
+    cprowl_request_free(&req);
+    return errors;
+}
+
+static int
+run_lanes(double *lat, long *rss)
+{
+    cprowl_add_request_t low, page;
+    cprowl_buf_t frame;
+    int fd, i, errors = 0, status;
+    pid_t pid;
+
+    if ((fd = daemon_start(&pid)) < 0) {
+        return requests;
+    }
+
+    cprowl_request_add_init(&low);
+    cprowl_request_add_apikey(&low, DRIVER_KEY);
+    cprowl_request_set(&low, CPROWL_FIELD_EVENT, "chatter", 7);
+    cprowl_request_set(&low, CPROWL_FIELD_PRIORITY, "-2", 2);
+    cprowl_request_add_init(&page);
+    cprowl_request_add_apikey(&page, DRIVER_KEY);
+    cprowl_request_set(&page, CPROWL_FIELD_EVENT, "page", 4);
+    cprowl_request_set(&page, CPROWL_FIELD_PRIORITY, "2", 1);
+    cprowl_buf_init(&frame);
+
+    for (i = 0; i < backlog; i++) {
+        if (!daemon_send(fd, &low, &frame)) {
+            errors++;
+        }
+    }
+    for (i = 0; i < requests; i++) {
+        double t0 = now_sec();
+
+        if (!daemon_send(fd, &page, &frame)) {
+            errors++;
+        }
+        lat[i] = now_sec() - t0;
+        usleep(20000);
+    }
+    close(fd);
+
+    /* give the last page time to arrive; the backlog is not waited for */
+    usleep(500000);
+    kill(pid, SIGKILL);
+    *rss = reap(pid, &status);
+
+    cprowl_buf_free(&frame);
+    cprowl_request_free(&low);
+    cprowl_request_free(&page);
+    return errors;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double
+percentile(double *sorted, int n, double p)
+{
+    int i = (int) (p * n + 0.999999) - 1;
+    return sorted[i < 0 ? 0 : i >= n ? n - 1 : i] * 1000;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *mode = "batch";
+    double *lat, t0, elapsed;
+    long rss = 0;
+    int ch, errors;
+
+    while ((ch = getopt(argc, argv, "m:n:j:c:u:S:b:")) != -1) {
+        switch (ch) {
+        case 'm': mode = optarg; break;
+        case 'n': requests = atoi(optarg); break;
+        case 'j': concurrency = atoi(optarg); break;
+        case 'c': cprowl_path = optarg; break;
+        case 'u': url = optarg; break;
+        case 'S': socket_path = optarg; break;
+        case 'b': backlog = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: driver -m oneshot|batch|daemon|lanes "
+                    "[-n requests] [-j concurrency] [-c cprowl] [-u url] "
+                    "[-S socket] [-b backlog]\n");
+            return 1;
+        }
+    }
+    if (requests < 1) {
+        requests = 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    lat = calloc(requests, sizeof(double));
+
+    t0 = now_sec();
+    if (strcmp(mode, "oneshot") == 0) {
+        errors = run_oneshot(lat, &rss);
+    } else if (strcmp(mode, "batch") == 0) {
+        errors = run_batch(lat, &rss);
+    } else if (strcmp(mode, "daemon") == 0) {
+        errors = run_daemon(lat, &rss);
+    } else if (strcmp(mode, "lanes") == 0) {
+        errors = run_lanes(lat, &rss);
+    } else {
+        fprintf(stderr, "unknown mode (%s)\n", mode);
+        return 1;
+    }
+    elapsed = now_sec() - t0;
+
+    /* the daemon modes only see the ack; the mock sees the delivery */
+    qsort(lat, requests, sizeof(double), cmp_double);
+    printf("%-8s n=%-6d j=%-3d %9.1f req/s  %-4s p50 %8.3fms  p99 %8.3fms  "
+           "p999 %8.3fms  rss %6ldKB  errors %d\n",
+           mode, requests, concurrency, requests / elapsed,
+           mode[0] == 'd' || mode[0] == 'l' ? "ack" : "send",
+           percentile(lat, requests, 0.50), percentile(lat, requests, 0.99),
+           percentile(lat, requests, 0.999), rss, errors);
+
+    free(lat);
+    return errors > 0;
+}
@@ -0,0 +1,200 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+/*
+ * escape : urlencoding throughput of each escape kernel over a few kinds
+ * of description text, after checking every kernel's output against the
+ * scalar one on random input, valid and invalid UTF-8 alike.
+ *
+ *   escape [iterations]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cprowl.h"
+
+#define TEXT_LEN CPROWL_MAX_LENGTH_DESC
+
+static const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+escape(const char *kernel, char *out, const char *in, size_t len)
+{
+    cprowl_wire_escape_select(kernel);
+    return cprowl_wire_escape(out, in, len) - out;
+}
+
+/* random bytes drawn mostly from a mix that hits every branch */
+static size_t
+make_random(char *buf, size_t len, unsigned *seed)
+{
+    static const char *pieces[] = {
+        "a", "Z", "0", " ", "-", "~", ",", "\n", "%", "+", "&",
+        "\xc3\xa9", "\xe2\x82\xac", "\xf0\x9f\x98\x80", "\xed\x9f\xbf",
+        "\xc0\xaf", "\xe0\x80\xaf", "\xed\xa0\x80", "\xf4\x90\x80\x80",
+        "\x80", "\xff", "\xe2\x82", "\xf0\x9f\x98"
+    };
+    size_t n = 0;
+
+    while (n < len) {
+        const char *p = pieces[rand_r(seed) % (sizeof(pieces) /
+                                               sizeof(pieces[0]))];
+        size_t l = strlen(p);
+
+        if (rand_r(seed) % 4 == 0) {
+            /* runs long enough for whole vector blocks */
+            while (n < len && rand_r(seed) % 40) {
+                buf[n++] = "abc XYZ 123._"[rand_r(seed) % 13];
+            }
+            continue;
+        }
+        if (n + l > len) {
+            l = len - n;
+        }
+        memcpy(buf + n, p, l);
+        n += l;
+    }
+    return n;
+}
+
+static int
+check(const char *kernel)
+{
+    static char in[600], want[CPROWL_WIRE_ESCAPE_SIZE(600)],
+                got[CPROWL_WIRE_ESCAPE_SIZE(600)];
+    unsigned seed = 1;
+    int i;
+
+    for (i = 0; i < 200000; i++) {
+        size_t len = rand_r(&seed) % 300, off = rand_r(&seed) % 32;
+        size_t nw, ng;
+
+        len = make_random(in + off, len, &seed);
+        nw = escape("scalar", want, in + off, len);
+        ng = escape(kernel, got, in + off, len);
+        if (nw != ng || memcmp(want, got, nw) != 0) {
+            fprintf(stderr, "%s: mismatch on input %d (%zu bytes)\n",
+                    kernel, i, len);
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static const struct {
+    const char *in, *out;
+} vectors[] = {
+    { "a b-c.d_e~f", "a+b-c.d_e~f" },
+    { "x,y\n%&=+", "x%2Cy%0A%25%26%3D%2B" },
+    { "\xc3\xa9\xe2\x82\xac\xf0\x9f\x98\x80", "%C3%A9%E2%82%AC%F0%9F%98%80" },
+    { "\xc0\xaf", "%EF%BF%BD%EF%BF%BD" },
+    { "\xed\xa0\x80", "%EF%BF%BD%EF%BF%BD%EF%BF%BD" },
+    { "\xe2\x82x", "%EF%BF%BD%EF%BF%BDx" },
+    { "\xf4\x90\x80\x80", "%EF%BF%BD%EF%BF%BD%EF%BF%BD%EF%BF%BD" }
+};
+
+int main(int argc, char *argv[])
+{
+    static const char *words[] = { "the", "build", "of", "nightly",
+                                   "failed", "on", "host", "web-03", "after",
+                                   "12m" };
+    static const char *cjk = "\xe6\x9e\x84\xe5\xbb\xba\xe5\xa4\xb1"
+                             "\xe8\xb4\xa5\xef\xbc\x8c";
+    int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+    char *texts[3], *out;
+    const char *names[] = { "prose", "log", "cjk" };
+    size_t lens[3], i, k;
+    unsigned long n;
+    unsigned seed = 7;
+
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        char buf[128];
+        size_t len = escape("scalar", buf, vectors[i].in,
+                            strlen(vectors[i].in));
+        if (len != strlen(vectors[i].out) ||
+            memcmp(buf, vectors[i].out, len) != 0) {
+            fprintf(stderr, "scalar: wrong output for vector %zu\n", i);
+            return 1;
+        }
+    }
+
+    out = malloc(CPROWL_WIRE_ESCAPE_SIZE(TEXT_LEN));
+    for (i = 0; i < 3; i++) {
+        texts[i] = malloc(TEXT_LEN + 64);
+        lens[i] = 0;
+    }
+    while (lens[0] + 16 < TEXT_LEN) {
+        lens[0] += sprintf(texts[0] + lens[0], "%s ",
+                           words[rand_r(&seed) % 10]);
+    }
+    while (lens[1] + 128 < TEXT_LEN) {
+        lens[1] += sprintf(texts[1] + lens[1],
+                           "2024-03-01T12:00:%02u.%03uZ web-03 api: status=%u "
+                           "took=%ums path=/api/v1/items\n",
+                           rand_r(&seed) % 60, rand_r(&seed) % 1000,
+                           rand_r(&seed) % 2 ? 200 : 503, rand_r(&seed) % 300);
+    }
+    while (lens[2] + strlen(cjk) < TEXT_LEN) {
+        memcpy(texts[2] + lens[2], cjk, strlen(cjk));
+        lens[2] += strlen(cjk);
+    }
+
+    printf("%-8s", "");
+    for (i = 0; i < 3; i++) {
+        printf(" %10s", names[i]);
+    }
+    printf("   GB/s of input, %d bytes\n", TEXT_LEN);
+
+    for (k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (!cprowl_wire_escape_select(kernels[k])) {
+            printf("%-8s not supported\n", kernels[k]);
+            continue;
+        }
+        if (k > 0 && !check(kernels[k])) {
+            return 1;
+        }
+        printf("%-8s", kernels[k]);
+        for (i = 0; i < 3; i++) {
+            double t0;
+            size_t total = 0;
+
+            cprowl_wire_escape_select(kernels[k]);
+            t0 = now_sec();
+            for (n = 0; n < (unsigned long) iterations; n++) {
+                total += cprowl_wire_escape(out, texts[i], lens[i]) - out;
+            }
+            printf(" %10.2f", (double) lens[i] * iterations /
+                              (now_sec() - t0) / 1e9);
+            if (total == 0) {
+                return 1;
+            }
+        }
+        printf("\n");
+    }
+    for (i = 0; i < 3; i++) {
+        free(texts[i]);
+    }
+    free(out);
+    return 0;
+}
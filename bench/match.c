@@ -0,0 +1,119 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+/*
+ * match : log scanning throughput of the --watch matcher against running
+ * memmem() once per pattern (what one grep per pattern amounts to), over a
+ * synthetic log with a few matching lines.
+ *
+ *   match [megabytes] [pattern...]
+ */
+#define _GNU_SOURCE     /* memmem */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cprowl.h"
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+make_log(char *buf, size_t size)
+{
+    static const char *levels[] = { "INFO", "DEBUG", "INFO", "WARN" };
+    size_t len = 0;
+    unsigned long i = 0;
+
+    while (len + 256 < size) {
+        len += sprintf(buf + len,
+                       "2024-03-01T12:%02lu:%02lu.%03luZ web-%02lu api[%lu]: %s "
+                       "request id=%08lx method=GET path=/api/v1/items/%lu "
+                       "status=200 took=%lums\n",
+                       i / 60 % 60, i % 60, i % 1000, i % 16, 1000 + i % 97,
+                       i % 10007 == 0 ? "ERROR" : levels[i % 4],
+                       i * 2654435761ul, i % 5000, i % 300);
+        i++;
+    }
+    return len;
+}
+
+int main(int argc, char *argv[])
+{
+    static char *defaults[] = { "ERROR", "panic:", "Traceback", "segfault" };
+    size_t mb = argc > 1 ? (size_t) atoi(argv[1]) : 256;
+    char **patterns = argc > 2 ? argv + 2 : defaults;
+    size_t npatterns = argc > 2 ? (size_t) argc - 2 : 4;
+    cprowl_matcher_t m;
+    unsigned long hits = 0, naive_hits = 0;
+    size_t len, pos, i;
+    double t0, t_ac, t_naive;
+    char *buf;
+    unsigned which;
+    long r;
+
+    if ((buf = malloc(mb << 20)) == NULL) {
+        return 1;
+    }
+    len = make_log(buf, mb << 20);
+    if (!cprowl_matcher_init(&m, patterns, npatterns)) {
+        return 1;
+    }
+
+    /* one pass, resuming after the matching line, as watch.c does */
+    t0 = now_sec();
+    for (pos = 0; pos < len; ) {
+        char *nl;
+        if ((r = cprowl_matcher_find(&m, buf + pos, len - pos, &which)) < 0) {
+            break;
+        }
+        hits++;
+        nl = memchr(buf + pos + r, '\n', len - pos - r);
+        pos = nl ? (size_t) (nl - buf) + 1 : len;
+    }
+    t_ac = now_sec() - t0;
+
+    t0 = now_sec();
+    for (i = 0; i < npatterns; i++) {
+        size_t plen = strlen(patterns[i]);
+        char *p = buf, *end = buf + len;
+        while ((p = memmem(p, end - p, patterns[i], plen)) != NULL) {
+            naive_hits++;
+            p += plen;
+        }
+    }
+    t_naive = now_sec() - t0;
+
+    printf("%zu MB of log, %zu patterns, %u states, prefilter %s\n",
+           len >> 20, npatterns, m.nstates,
+#ifdef __SSE2__
+           m.npairs <= 8 ? "sse2" : "scalar"
+#else
+           "scalar"
+#endif
+           );
+    printf("%-10s %8s %10s\n", "", "matches", "GB/s");
+    printf("%-10s %8lu %10.2f\n", "automaton", hits, len / t_ac / 1e9);
+    printf("%-10s %8lu %10.2f\n", "memmem", naive_hits, len / t_naive / 1e9);
+
+    cprowl_matcher_cleanup(&m);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,492 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+/*
+ * mock : a local stand-in for the Prowl add endpoint.
+ *
+ * Speaks plain HTTP/1.1 with keep-alive and answers every POST with the
+ * documents the real API returns.  Each response can be held for a fixed
+ * latency to model a remote server, a share of them can fail with a 500,
+ * and an hourly style quota answers 406 once it is used up.
+ *
+ * With -t the description of every request is taken as its submit time
+ * (microseconds since the epoch, as bench/driver -m lanes sends it) and
+ * delivery latency is reported per priority on exit.
+ *
+ * With -s cert.pem:key.pem it speaks HTTPS instead, handing out session
+ * tickets so clients can resume; the number of full and resumed
+ * handshakes is reported on exit.
+ *
+ *   mock [-p port] [-l latency_ms] [-e error_percent]
+ *        [-r quota] [-w quota_window_s] [-t] [-s cert.pem:key.pem]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl_config.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#define MOCK_MAX_CONN 1024
+#define MOCK_BUF_SIZE (64 * 1024)
+#define MOCK_TRACK_MAX 100000     /* samples kept per priority */
+
+typedef struct {
+    int fd;
+#ifdef HAVE_OPENSSL
+    SSL *ssl;
+#endif
+    char *buf;
+    size_t used;
+    size_t need;        /* bytes of the current request, 0 = unknown */
+    long long due;      /* when to answer, 0 = not waiting */
+} mock_conn_t;
+
+static mock_conn_t conns[MOCK_MAX_CONN];
+static struct pollfd pfds[MOCK_MAX_CONN + 1];
+static int nconns = 0;
+static int latency_ms = 0;
+static int error_percent = 0;
+static long quota = 0;          /* calls per window, 0 = unlimited */
+static long quota_window = 3600;
+static long remaining = 0;
+static time_t reset_at = 0;
+static unsigned long served = 0;
+static unsigned long failed = 0;
+static unsigned long limited = 0;
+static int track = 0;
+static double *samples[5];
+static size_t nsamples[5];
+#ifdef HAVE_OPENSSL
+static SSL_CTX *tls = NULL;
+static unsigned long handshakes = 0;
+static unsigned long resumed = 0;
+#endif
+
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+mock_close(int i)
+{
+#ifdef HAVE_OPENSSL
+    if (conns[i].ssl) {
+        SSL_free(conns[i].ssl);
+    }
+#endif
+    close(conns[i].fd);
+    free(conns[i].buf);
+    conns[i] = conns[--nconns];
+}
+
+static ssize_t
+mock_read(mock_conn_t *c, char *buf, size_t len)
+{
+#ifdef HAVE_OPENSSL
+    if (c->ssl) {
+        return SSL_read(c->ssl, buf, len);
+    }
+#endif
+    return read(c->fd, buf, len);
+}
+
+/* TRUE when bytes are buffered where poll() cannot see them */
+static int
+mock_pending(mock_conn_t *c)
+{
+#ifdef HAVE_OPENSSL
+    return c->ssl && SSL_pending(c->ssl) > 0;
+#else
+    return 0;
+#endif
+}
+
+static int
+mock_write(mock_conn_t *c, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n;
+#ifdef HAVE_OPENSSL
+        if (c->ssl) {
+            n = SSL_write(c->ssl, data, len);
+            if (n <= 0) {
+                return -1;
+            }
+        } else
+#endif
+        n = write(c->fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* work out the full request size once the headers are in */
+static void
+mock_parse(mock_conn_t *c)
+{
+    char *end, *p;
+    size_t clen = 0;
+
+    c->buf[c->used] = '\0';
+    if ((end = strstr(c->buf, "\r\n\r\n")) == NULL) {
+        return;
+    }
+    for (p = c->buf; p && p < end; p = strstr(p, "\r\n")) {
+        p += (p[0] == '\r') ? 2 : 0;
+        if (strncasecmp(p, "Content-Length:", 15) == 0) {
+            clen = strtoul(p + 15, NULL, 10);
+        } else if (strncasecmp(p, "Expect:", 7) == 0) {
+            mock_write(c, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+        }
+    }
+    c->need = (end + 4 - c->buf) + clen;
+}
+
+/* delivery latency of a request whose description is its submit time */
+static void
+mock_track(mock_conn_t *c)
+{
+    struct timespec ts;
+    char *body, *p;
+    long long sent;
+    int prio = 0;
+
+    if (!track || (body = strstr(c->buf, "\r\n\r\n")) == NULL) {
+        return;
+    }
+    body += 4;
+    if ((p = strstr(body, "priority=")) != NULL) {
+        prio = atoi(p + 9);
+    }
+    if ((p = strstr(body, "description=")) == NULL ||
+        (sent = atoll(p + 12)) <= 0 || prio < -2 || prio > 2) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (nsamples[prio + 2] < MOCK_TRACK_MAX) {
+        samples[prio + 2][nsamples[prio + 2]++] =
+            ((long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - sent) / 1000.0;
+    }
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void
+mock_report(void)
+{
+    int i;
+
+    for (i = 4; track && i >= 0; i--) {
+        size_t n = nsamples[i];
+        double *v = samples[i];
+
+        if (n == 0) {
+            continue;
+        }
+        qsort(v, n, sizeof(double), cmp_double);
+        fprintf(stderr, "priority %2d: n=%-6zu p50 %8.1fms  p99 %8.1fms  "
+                "max %8.1fms\n", i - 2, n, v[n / 2], v[(n * 99) / 100],
+                v[n - 1]);
+    }
+}
+
+static int
+mock_respond(mock_conn_t *c)
+{
+    char body[256], head[256];
+    int blen, hlen, code = 200;
+    time_t now = time(NULL);
+
+    if (now >= reset_at) {
+        remaining = quota ? quota : 1000000;
+        reset_at = now + quota_window;
+    }
+
+    if (quota && remaining == 0) {
+        code = 406;
+        limited++;
+        blen = snprintf(body, sizeof(body),
+                        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                        "<prowl><error code=\"406\">Not acceptable, your IP "
+                        "address has exceeded the API limit.</error></prowl>\n");
+    } else if (error_percent && rand() % 100 < error_percent) {
+        code = 500;
+        failed++;
+        blen = snprintf(body, sizeof(body),
+                        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                        "<prowl><error code=\"500\">Internal server error"
+                        "</error></prowl>\n");
+    } else {
+        if (quota) {
+            remaining--;
+        }
+        blen = snprintf(body, sizeof(body),
+                        "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                        "<prowl><success code=\"200\" remaining=\"%ld\" "
+                        "resetdate=\"%ld\" /></prowl>\n",
+                        remaining, (long) reset_at);
+    }
+    hlen = snprintf(head, sizeof(head),
+                    "HTTP/1.1 %d %s\r\n"
+                    "Content-Type: text/xml; charset=utf-8\r\n"
+                    "Content-Length: %d\r\n\r\n", code,
+                    code == 200 ? "OK" : code == 406 ? "Not Acceptable" :
+                    "Internal Server Error", blen);
+
+    if (mock_write(c, head, hlen) < 0 || mock_write(c, body, blen) < 0) {
+        return -1;
+    }
+
+    served++;
+    c->used -= c->need;
+    memmove(c->buf, c->buf + c->need, c->used);
+    c->need = 0;
+    c->due = 0;
+    return 0;
+}
+
+/* -s cert.pem:key.pem */
+static int
+mock_tls(const char *arg)
+{
+#ifdef HAVE_OPENSSL
+    char cert[1024];
+    const char *key = strchr(arg, ':');
+
+    if (key == NULL || key - arg >= (int) sizeof(cert)) {
+        fprintf(stderr, "mock: -s takes cert.pem:key.pem\n");
+        return -1;
+    }
+    memcpy(cert, arg, key - arg);
+    cert[key - arg] = '\0';
+    key++;
+
+    tls = SSL_CTX_new(TLS_server_method());
+    if (tls == NULL ||
+        SSL_CTX_use_certificate_chain_file(tls, cert) != 1 ||
+        SSL_CTX_use_PrivateKey_file(tls, key, SSL_FILETYPE_PEM) != 1) {
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    return 0;
+#else
+    fprintf(stderr, "mock: built without OpenSSL, -s is not available\n");
+    return -1;
+#endif
+}
+
+/* the handshake runs blocking; a bench client does not stall it */
+static int
+mock_accept(mock_conn_t *c)
+{
+#ifdef HAVE_OPENSSL
+    if (tls == NULL) {
+        return 0;
+    }
+    c->ssl = SSL_new(tls);
+    SSL_set_fd(c->ssl, c->fd);
+    if (SSL_accept(c->ssl) != 1) {
+        SSL_free(c->ssl);
+        c->ssl = NULL;
+        return -1;
+    }
+    handshakes++;
+    resumed += SSL_session_reused(c->ssl);
+#endif
+    return 0;
+}
+
+static void
+mock_sigint(int sig)
+{
+    fprintf(stderr, "served %lu requests (%lu failed, %lu rate limited)\n",
+            served, failed, limited);
+#ifdef HAVE_OPENSSL
+    if (tls) {
+        fprintf(stderr, "tls handshakes: %lu full, %lu resumed\n",
+                handshakes - resumed, resumed);
+    }
+#endif
+    mock_report();
+    exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    struct sockaddr_in addr;
+    int port = 8080;
+    int lfd, ch, i, one = 1;
+
+    while ((ch = getopt(argc, argv, "p:l:e:r:w:ts:")) != -1) {
+        switch (ch) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'l':
+            latency_ms = atoi(optarg);
+            break;
+        case 'e':
+            error_percent = atoi(optarg);
+            break;
+        case 'r':
+            quota = atol(optarg);
+            break;
+        case 'w':
+            quota_window = atol(optarg);
+            break;
+        case 't':
+            track = 1;
+            for (i = 0; i < 5; i++) {
+                samples[i] = malloc(MOCK_TRACK_MAX * sizeof(double));
+            }
+            break;
+        case 's':
+            if (mock_tls(optarg) < 0) {
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: mock [-p port] [-l latency_ms] "
+                    "[-e error_percent] [-r quota] [-w quota_window_s] [-t] "
+                    "[-s cert.pem:key.pem]\n");
+            return 1;
+        }
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, mock_sigint);
+    signal(SIGTERM, mock_sigint);
+
+    lfd = socket(AF_INET, SOCK_STREAM, 0);
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(lfd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(lfd, SOMAXCONN) < 0) {
+        perror("bind");
+        return 1;
+    }
+
+    for (;;) {
+        long long now = now_ms(), next = -1;
+        int i, timeout;
+
+        pfds[0].fd = lfd;
+        pfds[0].events = POLLIN;
+        for (i = 0; i < nconns; i++) {
+            pfds[i + 1].fd = conns[i].fd;
+            pfds[i + 1].events = conns[i].due ? 0 : POLLIN;
+            if (conns[i].due && (next < 0 || conns[i].due < next)) {
+                next = conns[i].due;
+            }
+        }
+        timeout = next < 0 ? -1 : (next > now ? (int) (next - now) : 0);
+
+        if (poll(pfds, nconns + 1, timeout) < 0 && errno != EINTR) {
+            perror("poll");
+            return 1;
+        }
+
+        now = now_ms();
+        for (i = nconns - 1; i >= 0; i--) {
+            mock_conn_t *c = &conns[i];
+
+            if (!c->due && ((pfds[i + 1].revents & (POLLIN | POLLHUP | POLLERR)) ||
+                            mock_pending(c))) {
+                ssize_t n = mock_read(c, c->buf + c->used,
+                                      MOCK_BUF_SIZE - 1 - c->used);
+                if (n <= 0) {
+                    mock_close(i);
+                    continue;
+                }
+                c->used += n;
+                if (!c->need) {
+                    mock_parse(c);
+                }
+                if (c->need && c->used >= c->need) {
+                    mock_track(c);
+                    c->due = now + latency_ms;
+                } else if (c->used == MOCK_BUF_SIZE - 1) {
+                    mock_close(i);
+                    continue;
+                }
+            }
+
+            if (c->due && c->due <= now) {
+                if (mock_respond(c) < 0) {
+                    mock_close(i);
+                    continue;
+                }
+                /* a pipelined request may already be buffered */
+                if (c->used > 0) {
+                    mock_parse(c);
+                    if (c->need && c->used >= c->need) {
+                        mock_track(c);
+                        c->due = now + latency_ms;
+                    }
+                }
+            }
+        }
+
+        if (pfds[0].revents & POLLIN) {
+            int fd = accept(lfd, NULL, NULL);
+            if (fd >= 0 && nconns < MOCK_MAX_CONN) {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                memset(&conns[nconns], 0, sizeof(mock_conn_t));
+                conns[nconns].fd = fd;
+                conns[nconns].buf = malloc(MOCK_BUF_SIZE);
+                if (mock_accept(&conns[nconns]) < 0) {
+                    close(fd);
+                    free(conns[nconns].buf);
+                    continue;
+                }
+                nconns++;
+            } else if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,33 @@
+#!/bin/sh
+#
+# Emergency delivery latency with the low priority lanes idle and then
+# saturated: the daemon is handed a backlog of priority -2 sends (far more
+# than it can send in the run) before emergency pages start arriving every
+# 20ms.  The mock reports delivery latency per priority.
+#
+#   bench/priority.sh [pages] [backlog] [latency_ms]
+#
+# Expects cprowl, mock and driver in ./build (./waf configure --with-bench; ./waf).
+
+PAGES=${1:-100}
+BACKLOG=${2:-20000}
+LATENCY=${3:-20}
+JOBS=${JOBS:-8}
+PORT=${PORT:-18080}
+BUILD=${BUILD:-./build/default}
+URL=http://127.0.0.1:$PORT/publicapi/add
+LOG=$(mktemp)
+
+for b in 0 $BACKLOG; do
+    $BUILD/mock -p $PORT -l $LATENCY -t 2> $LOG &
+    MOCK=$!
+    sleep 0.2
+
+    echo "backlog=$b pages=$PAGES latency=${LATENCY}ms j=$JOBS"
+    $BUILD/driver -c $BUILD/cprowl -u $URL -m lanes -n $PAGES -b $b -j $JOBS > /dev/null
+
+    kill $MOCK
+    sleep 0.1
+    grep priority $LOG
+done
+rm -f $LOG
@@ -0,0 +1,343 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+/*
+ * ring : the lock-free submission ring (ring.c) under contention.
+ *
+ * First a stress test: producers push numbered records through a small
+ * ring to one consumer, which checks that every producer's records come
+ * out in order, none twice and, when producers wait for room, none lost.
+ * With overwriting, producers take the oldest record themselves when the
+ * ring is full, and records taken plus records consumed must add up.
+ * Last, a libcprowl client with a tiny ring whose callbacks, on its I/O
+ * thread, submit more than the ring holds: every request must come back,
+ * and the callbacks must not wait for room only they could make.
+ *
+ * Then submissions per second at 1 to 64 producer threads, for the ring
+ * and for what libcprowl did before it: a malloc'd node appended to a
+ * list under a mutex, with a condition variable to wake the consumer.
+ *
+ *   ring [records]            (per thread count, spread over the producers)
+ */
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+#define STRESS_PRODUCERS 8
+#define STRESS_RECORDS 200000
+#define STRESS_SLOTS 64
+#define BENCH_SLOTS 1024
+#define BENCH_TOTAL 2000000
+#define PAYLOAD 200             /* about a short notification */
+#define CLIENT_SUBMITS 64
+#define CLIENT_SLOTS 4
+#define CLIENT_RESUBMITS (CLIENT_SLOTS + 1)    /* more than fit */
+#define CLIENT_CALLS (CLIENT_SUBMITS * (1 + CLIENT_RESUBMITS))
+#define CLIENT_URL "http://127.0.0.1:1/publicapi/add"   /* refused at once */
+
+typedef struct {
+    unsigned producer;
+    unsigned long seq;
+    char payload[PAYLOAD];
+} record_t;
+
+typedef struct node {
+    TAILQ_ENTRY(node) entries;
+    record_t rec;
+} node_t;
+
+static cprowl_ring_t ring;
+static TAILQ_HEAD(, node) list = TAILQ_HEAD_INITIALIZER(list);
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t list_cond = PTHREAD_COND_INITIALIZER;
+static int list_waiting;
+
+static unsigned nproducers;
+static unsigned long per_producer;
+static int overwrite;
+static unsigned long taken[64];         /* overwritten, per producer */
+static volatile int go;
+
+static cprowl_client_t *client;
+static unsigned long client_calls;
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+wait_go(void)
+{
+    while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE)) {
+        sched_yield();
+    }
+}
+
+static void*
+ring_producer(void *arg)
+{
+    unsigned id = (unsigned) (long) arg;
+    unsigned long i;
+    record_t *r, *old;
+
+    wait_go();
+    for (i = 0; i < per_producer; i++) {
+        while ((r = cprowl_ring_claim(&ring)) == NULL) {
+            if (overwrite && (old = cprowl_ring_take(&ring)) != NULL) {
+                __atomic_fetch_add(&taken[old->producer], 1, __ATOMIC_RELAXED);
+                cprowl_ring_release(&ring, old);
+            } else {
+                sched_yield();
+            }
+        }
+        r->producer = id;
+        r->seq = i;
+        memset(r->payload, (int) i, sizeof(r->payload));
+        cprowl_ring_publish(&ring, r);
+    }
+    return NULL;
+}
+
+static void*
+list_producer(void *arg)
+{
+    unsigned id = (unsigned) (long) arg;
+    unsigned long i;
+    node_t *n;
+
+    wait_go();
+    for (i = 0; i < per_producer; i++) {
+        if ((n = malloc(sizeof(*n))) == NULL) {
+            abort();
+        }
+        n->rec.producer = id;
+        n->rec.seq = i;
+        memset(n->rec.payload, (int) i, sizeof(n->rec.payload));
+        pthread_mutex_lock(&list_lock);
+        TAILQ_INSERT_TAIL(&list, n, entries);
+        if (list_waiting) {
+            pthread_cond_signal(&list_cond);
+        }
+        pthread_mutex_unlock(&list_lock);
+    }
+    return NULL;
+}
+
+/* consume everything, checking order per producer; returns the number
+ * of records seen, or 0 on a fault */
+static unsigned long
+ring_consume(void)
+{
+    unsigned long next[64], seen = 0, total = nproducers * per_producer, gone;
+    record_t *r;
+    unsigned i;
+
+    memset(next, 0, sizeof(next));
+    for (;;) {
+        if ((r = cprowl_ring_take(&ring)) == NULL) {
+            for (gone = 0, i = 0; i < nproducers; i++) {
+                gone += __atomic_load_n(&taken[i], __ATOMIC_RELAXED);
+            }
+            if (seen + gone == total) {
+                return seen;
+            }
+            sched_yield();
+            continue;
+        }
+        if (r->seq < next[r->producer] ||
+            (!overwrite && r->seq != next[r->producer]) ||
+            (unsigned char) r->payload[PAYLOAD - 1] != (unsigned char) r->seq) {
+            fprintf(stderr, "producer %u: got %lu, expected %lu\n",
+                    r->producer, r->seq, next[r->producer]);
+            return 0;
+        }
+        next[r->producer] = r->seq + 1;
+        cprowl_ring_release(&ring, r);
+        seen++;
+    }
+}
+
+static unsigned long
+list_consume(void)
+{
+    unsigned long seen = 0, total = nproducers * per_producer;
+    node_t *n;
+
+    pthread_mutex_lock(&list_lock);
+    while (seen < total) {
+        if ((n = TAILQ_FIRST(&list)) == NULL) {
+            list_waiting = TRUE;
+            pthread_cond_wait(&list_cond, &list_lock);
+            list_waiting = FALSE;
+            continue;
+        }
+        TAILQ_REMOVE(&list, n, entries);
+        pthread_mutex_unlock(&list_lock);
+        free(n);
+        seen++;
+        pthread_mutex_lock(&list_lock);
+    }
+    pthread_mutex_unlock(&list_lock);
+    return seen;
+}
+
+/* run producers against the calling thread as consumer; returns seconds,
+ * or a negative number on a fault */
+static double
+run(void *(*producer)(void *), unsigned long (*consume)(void),
+    unsigned long *seen)
+{
+    pthread_t threads[64];
+    double start;
+    unsigned i;
+
+    go = FALSE;
+    memset(taken, 0, sizeof(taken));
+    for (i = 0; i < nproducers; i++) {
+        pthread_create(&threads[i], NULL, producer, (void *) (long) i);
+    }
+    start = now_sec();
+    __atomic_store_n(&go, TRUE, __ATOMIC_RELEASE);
+    *seen = consume();
+    for (i = 0; i < nproducers; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return *seen ? now_sec() - start : -1;
+}
+
+static int
+stress(int mode)
+{
+    unsigned long seen, gone = 0;
+    unsigned i;
+
+    overwrite = mode;
+    nproducers = STRESS_PRODUCERS;
+    per_producer = STRESS_RECORDS;
+    cprowl_ring_init(&ring, STRESS_SLOTS, sizeof(record_t));
+    if (run(ring_producer, ring_consume, &seen) < 0) {
+        return FALSE;
+    }
+    for (i = 0; i < nproducers; i++) {
+        gone += taken[i];
+    }
+    cprowl_ring_cleanup(&ring);
+    printf("stress %-9s %u producers x %lu records: %lu consumed, "
+           "%lu overwritten, ok\n", mode ? "overwrite" : "block",
+           nproducers, per_producer, seen, gone);
+    return TRUE;
+}
+
+/* on the I/O thread: the callback of a first submission fills the ring */
+static void
+client_cb(cprowl_add_request_t *req, CURLcode res, int http_error_code,
+          void *arg)
+{
+    unsigned i;
+
+    __atomic_fetch_add(&client_calls, 1, __ATOMIC_RELAXED);
+    for (i = 0; arg == NULL && req != NULL && i < CLIENT_RESUBMITS; i++) {
+        cprowl_client_submit(client, req, client_cb, (void *) 1);
+    }
+}
+
+static void
+client_hung(int sig)
+{
+    static const char msg[] = "stress client: hung in a callback\n";
+
+    (void) sig;
+    (void) write(2, msg, sizeof(msg) - 1);
+    _exit(1);
+}
+
+static int
+stress_client(void)
+{
+    cprowl_client_config_t config;
+    cprowl_add_request_t *req = cprowl_request_new();
+    unsigned i;
+
+    cprowl_client_config_init(&config);
+    config.url = CLIENT_URL;
+    config.concurrency = 2;
+    config.retries = 0;
+    config.queue_size = CLIENT_SLOTS;
+    config.queue_full = CPROWL_QUEUE_BLOCK;
+    if (req == NULL || (client = cprowl_client_new(&config)) == NULL) {
+        return FALSE;
+    }
+    cprowl_request_add_apikey(req, "0123456789012345678901234567890123456789");
+    cprowl_request_set(req, CPROWL_FIELD_EVENT, "stress", 6);
+
+    signal(SIGALRM, client_hung);
+    alarm(30);
+    for (i = 0; i < CLIENT_SUBMITS; i++) {
+        cprowl_client_submit(client, req, client_cb, NULL);
+    }
+    cprowl_client_flush(client);
+    alarm(0);
+    cprowl_client_free(client);
+    cprowl_request_destroy(req);
+
+    if (client_calls != CLIENT_CALLS) {
+        fprintf(stderr, "stress client: %lu callbacks, expected %u\n",
+                client_calls, CLIENT_CALLS);
+        return FALSE;
+    }
+    printf("stress client    %u slots, %u submits x %u from callbacks: "
+           "%lu callbacks, ok\n", CLIENT_SLOTS, CLIENT_SUBMITS,
+           CLIENT_RESUBMITS, client_calls);
+    return TRUE;
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long total = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_TOTAL;
+    unsigned long seen;
+    unsigned threads;
+    double t;
+
+    if (!stress(FALSE) || !stress(TRUE) || !stress_client()) {
+        fprintf(stderr, "stress test failed\n");
+        return 1;
+    }
+
+    printf("\n%-10s %14s %14s\n", "producers", "ring sub/s", "mutex sub/s");
+    overwrite = FALSE;
+    for (threads = 1; threads <= 64; threads *= 2) {
+        nproducers = threads;
+        per_producer = total / threads;
+
+        cprowl_ring_init(&ring, BENCH_SLOTS, sizeof(record_t));
+        t = run(ring_producer, ring_consume, &seen);
+        cprowl_ring_cleanup(&ring);
+        printf("%-10u %14.0f", threads, seen / t);
+
+        t = run(list_producer, list_consume, &seen);
+        printf(" %14.0f\n", seen / t);
+    }
+    return 0;
+}
@@ -0,0 +1,127 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+/*
+ * serialize : compares building a request body with curl_formadd()
+ * (multipart/form-data, the original path) against the single pass
+ * urlencoded serializer, in bytes on the wire and time per request.
+ *
+ *   serialize [iterations] [description_bytes]
+ */
+/* curl_formadd() is the old path being measured, so no warnings for it */
+#define CURL_DISABLE_DEPRECATION
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "cprowl.h"
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t
+count_cb(void *arg, const char *buf, size_t len)
+{
+    *(size_t *) arg += len;
+    return len;
+}
+
+/* the multipart body as cprowl used to build it */
+static size_t
+multipart(cprowl_add_request_t *req)
+{
+    struct curl_httppost *form = NULL, *last = NULL;
+    size_t bytes = 0;
+    char *api_keys = cprowl_request_get_api_string(req);
+
+    curl_formadd(&form, &last, CURLFORM_COPYNAME, "apikey",
+                 CURLFORM_PTRCONTENTS, api_keys, CURLFORM_END);
+    curl_formadd(&form, &last, CURLFORM_PTRNAME, "application",
+                 CURLFORM_PTRCONTENTS, cprowl_request_get(req, CPROWL_FIELD_APP),
+                 CURLFORM_END);
+    curl_formadd(&form, &last, CURLFORM_PTRNAME, "event",
+                 CURLFORM_PTRCONTENTS, cprowl_request_get(req, CPROWL_FIELD_EVENT),
+                 CURLFORM_END);
+    curl_formadd(&form, &last, CURLFORM_PTRNAME, "description",
+                 CURLFORM_PTRCONTENTS, cprowl_request_get(req, CPROWL_FIELD_DESCRIPTION),
+                 CURLFORM_END);
+    curl_formadd(&form, &last, CURLFORM_PTRNAME, "priority",
+                 CURLFORM_PTRCONTENTS, cprowl_request_get(req, CPROWL_FIELD_PRIORITY),
+                 CURLFORM_END);
+
+    /* render the body the way curl would send it */
+    curl_formget(form, &bytes, count_cb);
+    curl_formfree(form);
+    free(api_keys);
+    return bytes;
+}
+
+int main(int argc, char *argv[])
+{
+    cprowl_add_request_t req;
+    cprowl_buf_t buf;
+    char *desc;
+    int iterations = argc > 1 ? atoi(argv[1]) : 100000;
+    int desc_len = argc > 2 ? atoi(argv[2]) : CPROWL_MAX_LENGTH_DESC;
+    size_t old_bytes = 0, new_bytes = 0;
+    double t0, t_old, t_new;
+    int i;
+
+    if (desc_len > CPROWL_MAX_LENGTH_DESC) {
+        desc_len = CPROWL_MAX_LENGTH_DESC;
+    }
+
+    cprowl_request_add_init(&req);
+    cprowl_request_add_apikey(&req, "0123456789012345678901234567890123456789");
+    cprowl_request_set(&req, CPROWL_FIELD_APP, "build", 5);
+    cprowl_request_set(&req, CPROWL_FIELD_EVENT, "nightly finished", 16);
+    desc = malloc(desc_len + 1);
+    for (i = 0; i < desc_len; i++) {
+        /* mostly plain text with the odd character that needs escaping */
+        desc[i] = (i % 64 == 63) ? '\n' : (i % 8 == 7) ? ' ' : 'a' + i % 26;
+    }
+    cprowl_request_set(&req, CPROWL_FIELD_DESCRIPTION, desc, desc_len);
+    free(desc);
+
+    t0 = now_sec();
+    for (i = 0; i < iterations; i++) {
+        old_bytes = multipart(&req);
+    }
+    t_old = now_sec() - t0;
+
+    cprowl_buf_init(&buf);
+    t0 = now_sec();
+    for (i = 0; i < iterations; i++) {
+        cprowl_request_serialize(&buf, &req);
+        new_bytes = buf.len;
+    }
+    t_new = now_sec() - t0;
+
+    printf("description: %d bytes, %d iterations\n", desc_len, iterations);
+    printf("%-12s %8s %12s\n", "", "bytes", "ns/request");
+    printf("%-12s %8zu %12.0f\n", "multipart", old_bytes,
+           t_old / iterations * 1e9);
+    printf("%-12s %8zu %12.0f\n", "urlencoded", new_bytes,
+           t_new / iterations * 1e9);
+
+    cprowl_buf_free(&buf);
+    cprowl_request_free(&req);
+    return 0;
+}
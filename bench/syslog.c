@@ -0,0 +1,244 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+/*
+ * syslog : checks the syslog parser against sample messages, measures
+ * how fast it parses, and with a socket floods a running "cprowl
+ * --syslog" with messages of which one in every `every` is crit, the
+ * rest info.  Over a unix datagram socket the sender waits whenever the
+ * receiver falls behind, so the rate printed is what the sink sustains.
+ *
+ *   syslog [-u path | -h host:port] [-n messages] [-e every]
+ */
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+typedef struct {
+    const char *in;
+    int facility, severity;
+    const char *host, *program, *msg;
+} sample_t;
+
+static const sample_t samples[] = {
+    { "<34>Oct 11 22:14:15 mymachine su: 'su root' failed for lonvick",
+      4, 2, "mymachine", "su", "'su root' failed for lonvick" },
+    { "<13>Feb  5 17:32:18 10.0.0.99 sshd[4721]: Accepted publickey\n",
+      1, 5, "10.0.0.99", "sshd", "Accepted publickey" },
+    { "<11>Feb  5 17:32:18 kernel: Out of memory: Killed process 42",
+      1, 3, "", "kernel", "Out of memory: Killed process 42" },
+    { "<11>Feb  5 17:32:18 myhost no tag here",
+      1, 3, "myhost", "", "no tag here" },
+    { "<187>nginx[7]: upstream timed out",
+      23, 3, "", "nginx", "upstream timed out" },
+    { "<0>plain text", 0, 0, "", "", "plain text" },
+    { "<165>1 2003-10-11T22:14:15.003Z mymachine.example.com evntslog - "
+      "ID47 [exampleSDID@32473 iut=\"3\" eventSource=\"Application\"] "
+      "\xef\xbb\xbf" "An application event log entry...",
+      20, 5, "mymachine.example.com", "evntslog",
+      "An application event log entry..." },
+    { "<34>1 2003-10-11T22:14:15.003Z host su - ID47 - BOM'su root' failed",
+      4, 2, "host", "su", "BOM'su root' failed" },
+    { "<10>1 - - - - - [a x=\"]\\\"\"][b] text", 1, 2, "", "", "text" },
+    { "<2>1 2024-01-01T00:00:00Z h app 1 - -", 0, 2, "h", "app", "" },
+    { "<192>too big", -1, -1, NULL, NULL, NULL },
+    { "<>empty", -1, -1, NULL, NULL, NULL },
+    { "no pri", -1, -1, NULL, NULL, NULL },
+    { "<1", -1, -1, NULL, NULL, NULL },
+    { "<10>1 - - - - - [unterminated", -1, -1, NULL, NULL, NULL },
+};
+
+#define NSAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+static double
+now_sec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+same(const char *p, size_t len, const char *want)
+{
+    return strlen(want) == len && memcmp(p, want, len) == 0;
+}
+
+static int
+check(void)
+{
+    size_t i;
+    int failed = 0;
+
+    for (i = 0; i < NSAMPLES; i++) {
+        const sample_t *s = &samples[i];
+        cprowl_syslog_msg_t m;
+        int ok = cprowl_syslog_parse(&m, s->in, strlen(s->in));
+
+        if (s->facility < 0 ? ok :
+            !ok || m.facility != s->facility || m.severity != s->severity ||
+            !same(m.host, m.host_len, s->host) ||
+            !same(m.program, m.program_len, s->program) ||
+            !same(m.msg, m.msg_len, s->msg)) {
+            fprintf(stderr, "parse mismatch: %s\n", s->in);
+            failed++;
+        }
+    }
+    printf("parser: %zu samples, %d wrong\n", NSAMPLES, failed);
+    return failed == 0;
+}
+
+/* message i; crit every `every`, alternately RFC 3164 and 5424 */
+static int
+format(char *buf, size_t len, unsigned long i, unsigned long every)
+{
+    int severity = i % every == 0 ? 2 : 6;
+
+    if (i & 1) {
+        return snprintf(buf, len, "<%d>1 2024-05-01T12:00:00.000Z web%lu "
+                        "app %lu - - request %lu served in 12ms",
+                        16 * 8 + severity, i % 16, i, i);
+    }
+    return snprintf(buf, len, "<%d>May  1 12:00:00 web%lu sshd[%lu]: "
+                    "session %lu opened for user deploy",
+                    4 * 8 + severity, i % 16, i % 30000, i);
+}
+
+static void
+parse_rate(void)
+{
+    char buf[512];
+    unsigned long i, n = 5000000, kept = 0;
+    double t;
+
+    t = now_sec();
+    for (i = 0; i < n; i++) {
+        cprowl_syslog_msg_t m;
+        int len = format(buf, sizeof(buf), i, 1000);
+
+        if (cprowl_syslog_parse(&m, buf, len) && m.severity <= 2) {
+            kept++;
+        }
+    }
+    t = now_sec() - t;
+    printf("format+parse: %.0f messages/s (%lu kept)\n", n / t, kept);
+}
+
+static int
+connect_to(const char *unix_path, const char *udp)
+{
+    int fd = -1;
+
+    if (unix_path) {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", unix_path);
+        if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0 ||
+            connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror(unix_path);
+            return -1;
+        }
+    } else {
+        struct addrinfo hints, *res;
+        char host[256];
+        const char *port = strrchr(udp, ':');
+
+        if (port == NULL) {
+            return -1;
+        }
+        snprintf(host, sizeof(host), "%.*s", (int) (port - udp), udp);
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_socktype = SOCK_DGRAM;
+        if (getaddrinfo(host, port + 1, &hints, &res) != 0) {
+            fprintf(stderr, "%s: unknown host\n", udp);
+            return -1;
+        }
+        if ((fd = socket(res->ai_family, SOCK_DGRAM, 0)) < 0 ||
+            connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+            perror(udp);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+    }
+    return fd;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *unix_path = NULL, *udp = NULL;
+    unsigned long i, n = 1000000, every = 1000;
+    char buf[512];
+    double t;
+    int ch, fd;
+
+    while ((ch = getopt(argc, argv, "u:h:n:e:")) != -1) {
+        switch (ch) {
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'h':
+            udp = optarg;
+            break;
+        case 'n':
+            n = strtoul(optarg, NULL, 10);
+            break;
+        case 'e':
+            every = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "usage: syslog [-u path | -h host:port] "
+                    "[-n messages] [-e every]\n");
+            return 1;
+        }
+    }
+    if (every == 0) {
+        every = 1;
+    }
+
+    if (!check()) {
+        return 1;
+    }
+    parse_rate();
+    if (unix_path == NULL && udp == NULL) {
+        return 0;
+    }
+
+    if ((fd = connect_to(unix_path, udp)) < 0) {
+        return 1;
+    }
+    t = now_sec();
+    for (i = 0; i < n; i++) {
+        int len = format(buf, sizeof(buf), i, every);
+
+        if (send(fd, buf, len, 0) < 0) {
+            perror("send");
+            return 1;
+        }
+    }
+    t = now_sec() - t;
+    printf("sent %lu messages, %lu crit, at %.0f messages/s\n", n,
+           (n + every - 1) / every, n / t);
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,50 @@
+#!/bin/sh
+#
+# TLS handshake time of one-shot sends, each a separate cprowl process,
+# with --tls-nocache and then with sessions resumed from the spool.  The
+# mock serves HTTPS on a throwaway self-signed certificate (KEYTYPE, as
+# for openssl req -newkey; RSA like most public servers); the handshake
+# is appconnect - connect from --timing, and the median is reported.
+#
+#   bench/tls.sh [runs]
+#
+# Expects cprowl and mock (built with OpenSSL) in ./build
+# (./waf configure --with-bench; ./waf) and the openssl command.
+
+RUNS=${1:-50}
+PORT=${PORT:-18443}
+KEYTYPE=${KEYTYPE:-rsa:2048}
+BUILD=${BUILD:-./build/default}
+URL=https://localhost:$PORT/publicapi/add
+KEY=0123456789012345678901234567890123456789
+DIR=$(mktemp -d)
+
+openssl req -x509 -newkey $KEYTYPE -nodes \
+    -subj /CN=localhost -addext subjectAltName=DNS:localhost -days 1 \
+    -keyout $DIR/key.pem -out $DIR/cert.pem 2> /dev/null || exit 1
+
+$BUILD/mock -p $PORT -s $DIR/cert.pem:$DIR/key.pem 2> $DIR/mock.log &
+MOCK=$!
+sleep 0.2
+
+for mode in --tls-nocache --tls-resume; do
+    rm -f $DIR/timing
+    flag=$mode
+    [ $mode = --tls-resume ] && flag=
+    # the first run warms the DNS and session caches
+    for i in $(seq 0 $RUNS); do
+        $BUILD/cprowl $flag --spool $DIR/spool --cacert $DIR/cert.pem \
+            -u $URL -a $KEY -e tls --timing=$DIR/timing > /dev/null
+    done
+    tail -n $RUNS $DIR/timing |
+        sed 's/.*"connect":\([0-9.]*\),"appconnect":\([0-9.]*\).*/\2 \1/' |
+        awk '{ print $1 - $2 }' | sort -n |
+        awk -v m=$mode '{ v[NR] = $1 }
+            END { printf "%-14s runs=%d handshake p50=%.3fms min=%.3fms max=%.3fms\n",
+                         m, NR, v[int((NR + 1) / 2)], v[1], v[NR] }'
+done
+
+kill $MOCK
+sleep 0.1
+grep handshakes $DIR/mock.log
+rm -rf $DIR
@@ -0,0 +1,80 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "cprowl.h"
+
+void
+cprowl_buf_init(cprowl_buf_t *buf)
+{
+    buf->data = NULL;
+    buf->len = 0;
+    buf->cap = 0;
+}
+
+/* make room for len more bytes (plus a terminating nul) */
+int
+cprowl_buf_reserve(cprowl_buf_t *buf, size_t len)
+{
+    size_t cap;
+    char *data;
+
+    if (buf->len + len + 1 <= buf->cap) {
+        return TRUE;
+    }
+
+    cap = buf->cap ? buf->cap : 256;
+    while (cap < buf->len + len + 1) {
+        cap *= 2;
+    }
+
+    if ((data = realloc(buf->data, cap)) == NULL) {
+        return FALSE;
+    }
+
+    buf->data = data;
+    buf->cap = cap;
+    return TRUE;
+}
+
+int
+cprowl_buf_append(cprowl_buf_t *buf, const char *data, size_t len)
+{
+    if (!cprowl_buf_reserve(buf, len)) {
+        return FALSE;
+    }
+
+    memcpy(buf->data + buf->len, data, len);
+    buf->len += len;
+    buf->data[buf->len] = '\0';
+    return TRUE;
+}
+
+void
+cprowl_buf_reset(cprowl_buf_t *buf)
+{
+    buf->len = 0;
+    if (buf->data) {
+        buf->data[0] = '\0';
+    }
+}
+
+void
+cprowl_buf_free(cprowl_buf_t *buf)
+{
+    free(buf->data);
+    cprowl_buf_init(buf);
+}
@@ -0,0 +1,618 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <curl/curl.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * A client is a send engine on a thread of its own.
+ *
+ * Submitting copies the request into a slot of a lock-free ring
+ * (ring.c) that was allocated with the client: the keys as text, then the
+ * fields.  Producers only compare-and-swap the ring's tail, so any number
+ * of threads can submit without a lock or an allocation.  The I/O thread
+ * takes slots in order, rebuilds each request with interned keys in an
+ * arena of its own and hands them to the engine in batches, but only
+ * while the engine holds fewer than queue_size requests; beyond that the
+ * ring fills up and the client's full policy applies.
+ *
+ * The I/O thread sleeps in curl_multi_poll() with a pipe among its fds.
+ * Before it does, it raises its sleeping flag and looks at the ring once
+ * more; a producer that publishes a slot and then finds the flag raised
+ * clears it and writes to the pipe.  So only the first submission after
+ * an idle spell costs a system call.
+ *
+ * Requests too large for a slot, synchronous sends and callbacks that
+ * submit into a full ring take the older path: a malloc'd job on a list
+ * under the client's lock.
+ */
+
+#define CLIENT_POLL_MS 1000
+#define CLIENT_SLOT_SIZE (2048 - 16)    /* a 2KB stride with the ring's header */
+#define CLIENT_ARENA_CHUNK (256 * 1024)
+
+/* a request in the ring */
+typedef struct {
+    cprowl_client_cb cb;
+    void *arg;
+    uint32_t nkeys;
+    uint32_t len[CPROWL_NFIELDS];
+    char data[];                /* keys without separators, then fields */
+} client_slot_t;
+
+#define CLIENT_SLOT_DATA (CLIENT_SLOT_SIZE - sizeof(client_slot_t))
+
+/* a synchronous send waiting for its result */
+typedef struct {
+    int done;
+    CURLcode res;
+    int http_error_code;
+} client_wait_t;
+
+typedef struct client_job {
+    cprowl_job_t job;
+    cprowl_add_request_t req;   /* packed right after the struct */
+    struct cprowl_client *client;
+    cprowl_client_cb cb;
+    void *arg;
+    client_wait_t *wait;
+    int pooled;                 /* in the client's arena, not malloc'd */
+    TAILQ_ENTRY(client_job) entries;
+} client_job_t;
+
+struct cprowl_client {
+    cprowl_ring_t ring;
+    int full;                   /* CPROWL_QUEUE_* */
+    size_t queue_size;
+
+    /* written by producers and the I/O thread, away from the above */
+    size_t outstanding __attribute__ ((aligned (CPROWL_CACHELINE)));
+    int sleeping;               /* the I/O thread is about to wait */
+
+    cprowl_options_t opts;
+    cprowl_engine_t engine;
+    cprowl_arena_t jobs;        /* jobs built from slots, I/O thread only */
+    cprowl_add_request_t scratch;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t finished;    /* a job is done */
+    int wake[2];
+    TAILQ_HEAD(, client_job) submitted;
+    int stopping;
+};
+
+static pthread_once_t client_once = PTHREAD_ONCE_INIT;
+
+static void
+client_global_init(void)
+{
+    curl_global_init(CURL_GLOBAL_ALL);
+}
+
+/* one submission less to wait for */
+static void
+client_finished(cprowl_client_t *client, client_wait_t *wait, CURLcode res,
+                int http_error_code)
+{
+    pthread_mutex_lock(&client->lock);
+    if (wait) {
+        wait->res = res;
+        wait->http_error_code = http_error_code;
+        wait->done = TRUE;
+    }
+    __atomic_fetch_sub(&client->outstanding, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&client->finished);
+    pthread_mutex_unlock(&client->lock);
+}
+
+/* engine callback, on the I/O thread */
+static void
+client_done(cprowl_job_t *job)
+{
+    client_job_t *cj = job->arg;
+    cprowl_client_t *client = cj->client;
+
+    if (cj->cb) {
+        cj->cb(&cj->req, job->res, job->http_error_code, cj->arg);
+    }
+    cprowl_request_free(&cj->req);
+    client_finished(client, cj->wait, job->res, job->http_error_code);
+    if (cj->pooled) {
+        cprowl_arena_release(cj);
+    } else {
+        free(cj);
+    }
+}
+
+/* pack req into cj, which has room for it */
+static void
+client_job_init(cprowl_client_t *client, client_job_t *cj,
+                cprowl_add_request_t *req)
+{
+    memset(cj, 0, sizeof(*cj));
+    cprowl_request_pack(&cj->req, req, cj + 1);
+    cj->client = client;
+    cj->job.req = &cj->req;
+    cj->job.cb = client_done;
+    cj->job.arg = cj;
+}
+
+/* rebuild the request in a slot as a job, on the I/O thread */
+static client_job_t*
+client_job_decode(cprowl_client_t *client, client_slot_t *slot)
+{
+    cprowl_add_request_t *req = &client->scratch;
+    char key[CPROWL_MAX_LENGTH_API + 1];
+    const char *p = slot->data;
+    client_job_t *cj = NULL;
+    uint32_t i;
+
+    for (i = 0; i < slot->nkeys; i++, p += CPROWL_MAX_LENGTH_API) {
+        memcpy(key, p, CPROWL_MAX_LENGTH_API);
+        key[CPROWL_MAX_LENGTH_API] = '\0';
+        if (!cprowl_request_add_apikey(req, key)) {
+            goto done;
+        }
+    }
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        if (!cprowl_request_set(req, i, p, slot->len[i])) {
+            goto done;
+        }
+        p += slot->len[i];
+    }
+
+    cj = cprowl_arena_alloc(&client->jobs,
+                            sizeof(*cj) + cprowl_request_packed_size(req));
+    if (cj) {
+        client_job_init(client, cj, req);
+        cj->pooled = TRUE;
+        cj->cb = slot->cb;
+        cj->arg = slot->arg;
+    }
+
+done:
+    cprowl_request_clear_keys(req);
+    return cj;
+}
+
+/* move slots into the engine while it has room */
+static void
+client_drain(cprowl_client_t *client)
+{
+    client_slot_t *slot;
+    client_job_t *cj;
+
+    while (cprowl_engine_pending(&client->engine) < client->queue_size &&
+           (slot = cprowl_ring_take(&client->ring)) != NULL) {
+        cj = client_job_decode(client, slot);
+        if (cj == NULL && slot->cb) {
+            slot->cb(NULL, CURLE_OUT_OF_MEMORY, 0, slot->arg);
+        }
+        cprowl_ring_release(&client->ring, slot);
+        if (cj) {
+            cprowl_engine_submit(&client->engine, &cj->job);
+        } else {
+            client_finished(client, NULL, CURLE_OUT_OF_MEMORY, 0);
+        }
+    }
+}
+
+/* hand everything submitted since the last call to the engine; TRUE once
+ * the client is being freed and nothing is left */
+static int
+client_take(cprowl_client_t *client)
+{
+    TAILQ_HEAD(, client_job) jobs = TAILQ_HEAD_INITIALIZER(jobs);
+    client_job_t *cj;
+    char drain[64];
+    int stop;
+
+    while (read(client->wake[0], drain, sizeof(drain)) > 0)
+        ;
+
+    /* submit outside the lock: a job may fail, and call back, at once */
+    pthread_mutex_lock(&client->lock);
+    while ((cj = TAILQ_FIRST(&client->submitted)) != NULL) {
+        TAILQ_REMOVE(&client->submitted, cj, entries);
+        TAILQ_INSERT_TAIL(&jobs, cj, entries);
+    }
+    stop = client->stopping &&
+           __atomic_load_n(&client->outstanding, __ATOMIC_ACQUIRE) == 0;
+    pthread_mutex_unlock(&client->lock);
+
+    while ((cj = TAILQ_FIRST(&jobs)) != NULL) {
+        TAILQ_REMOVE(&jobs, cj, entries);
+        cprowl_engine_submit(&client->engine, &cj->job);
+    }
+    client_drain(client);
+    return stop;
+}
+
+static void*
+client_thread(void *arg)
+{
+    cprowl_client_t *client = arg;
+    struct curl_waitfd fd;
+    int timeout;
+
+    while (!client_take(client)) {
+        timeout = CLIENT_POLL_MS;
+
+        /* with the engine full, sends finishing wake us up anyway */
+        if (cprowl_engine_pending(&client->engine) < client->queue_size) {
+            __atomic_store_n(&client->sleeping, TRUE, __ATOMIC_SEQ_CST);
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
+            if (cprowl_ring_ready(&client->ring)) {
+                __atomic_store_n(&client->sleeping, FALSE, __ATOMIC_RELAXED);
+                timeout = 0;
+            }
+        }
+
+        fd.fd = client->wake[0];
+        fd.events = CURL_WAIT_POLLIN;
+        fd.revents = 0;
+        cprowl_engine_poll(&client->engine, &fd, 1, timeout);
+        __atomic_store_n(&client->sleeping, FALSE, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void
+client_wake(cprowl_client_t *client)
+{
+    /* a full pipe is as good as a write */
+    while (write(client->wake[1], "", 1) < 0 && errno == EINTR)
+        ;
+}
+
+/* after publishing: wake the I/O thread if it is going to sleep */
+static void
+client_notify(cprowl_client_t *client)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&client->sleeping, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&client->sleeping, FALSE, __ATOMIC_ACQ_REL)) {
+        client_wake(client);
+    }
+}
+
+/* the ring is full: make room as the policy says, or FALSE to give up */
+static int
+client_full(cprowl_client_t *client, unsigned *tries)
+{
+    struct timespec ts = { 0, 100000 };
+    client_slot_t *old;
+    cprowl_client_cb cb;
+    void *arg;
+
+    switch (client->full) {
+    case CPROWL_QUEUE_DROP:
+        return FALSE;
+    case CPROWL_QUEUE_OVERWRITE:
+        if ((old = cprowl_ring_take(&client->ring)) != NULL) {
+            cb = old->cb;
+            arg = old->arg;
+            cprowl_ring_release(&client->ring, old);
+            if (cb) {
+                cb(NULL, CPROWL_DROPPED, 0, arg);
+            }
+            client_finished(client, NULL, CPROWL_DROPPED, 0);
+            return TRUE;
+        }
+        /* the I/O thread took it first; the slot frees up soon */
+        break;
+    }
+
+    /* CPROWL_QUEUE_BLOCK: yield at first, then sleep */
+    if (++*tries < 64) {
+        sched_yield();
+    } else {
+        nanosleep(&ts, NULL);
+    }
+    return TRUE;
+}
+
+/* the request in a slot, or FALSE when it does not fit in one */
+static int
+client_slot_fill(client_slot_t *slot, cprowl_add_request_t *req)
+{
+    size_t need = req->nkeys * CPROWL_MAX_LENGTH_API;
+    uint32_t i;
+    char *p;
+
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        need += req->fields[i].len;
+    }
+    if (need > CLIENT_SLOT_DATA) {
+        return FALSE;
+    }
+    if (slot == NULL) {
+        return TRUE;
+    }
+
+    p = slot->data;
+    slot->nkeys = req->nkeys;
+    for (i = 0; i < req->nkeys; i++, p += CPROWL_MAX_LENGTH_API) {
+        memcpy(p, req->keys[i]->api, CPROWL_MAX_LENGTH_API);
+    }
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        slot->len[i] = req->fields[i].len;
+        memcpy(p, cprowl_request_get(req, i), req->fields[i].len);
+        p += req->fields[i].len;
+    }
+    return TRUE;
+}
+
+/* copy req into a malloc'd job */
+static client_job_t*
+client_job_new(cprowl_client_t *client, cprowl_add_request_t *req)
+{
+    client_job_t *cj;
+
+    if ((cj = malloc(sizeof(*cj) + cprowl_request_packed_size(req))) == NULL) {
+        return NULL;
+    }
+    client_job_init(client, cj, req);
+    return cj;
+}
+
+/* queue a job already counted in outstanding */
+static void
+client_queue(cprowl_client_t *client, client_job_t *cj)
+{
+    pthread_mutex_lock(&client->lock);
+    TAILQ_INSERT_TAIL(&client->submitted, cj, entries);
+    pthread_mutex_unlock(&client->lock);
+    client_wake(client);
+}
+
+/* the older path: a malloc'd copy of req on the locked list */
+static int
+client_submit_job(cprowl_client_t *client, cprowl_add_request_t *req,
+                  cprowl_client_cb cb, void *arg)
+{
+    client_job_t *cj;
+
+    if ((cj = client_job_new(client, req)) == NULL) {
+        client_finished(client, NULL, CURLE_OUT_OF_MEMORY, 0);
+        return FALSE;
+    }
+    cj->cb = cb;
+    cj->arg = arg;
+    client_queue(client, cj);
+    return TRUE;
+}
+
+static cprowl_client_t*
+client_create(const cprowl_options_t *opts, size_t queue_size, int full)
+{
+    cprowl_client_t *client;
+    sigset_t all, old;
+    int i, started;
+
+    pthread_once(&client_once, client_global_init);
+
+    if (posix_memalign((void **) &client, CPROWL_CACHELINE,
+                       sizeof(*client)) != 0) {
+        return NULL;
+    }
+    memset(client, 0, sizeof(*client));
+    client->opts = *opts;
+    client->queue_size = queue_size;
+    client->full = full;
+    client->wake[0] = client->wake[1] = -1;
+    TAILQ_INIT(&client->submitted);
+    cprowl_arena_init(&client->jobs, CLIENT_ARENA_CHUNK);
+    cprowl_request_add_init(&client->scratch);
+    pthread_mutex_init(&client->lock, NULL);
+    pthread_cond_init(&client->finished, NULL);
+
+    if (!cprowl_ring_init(&client->ring, queue_size, CLIENT_SLOT_SIZE) ||
+        pipe(client->wake) < 0) {
+        goto fail;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(client->wake[i], F_SETFL,
+              fcntl(client->wake[i], F_GETFL) | O_NONBLOCK);
+        fcntl(client->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+    if (!cprowl_engine_init(&client->engine, &client->opts)) {
+        goto fail;
+    }
+
+    /* the program's signals go to its own threads */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    started = pthread_create(&client->thread, NULL, client_thread,
+                             client) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (!started) {
+        cprowl_engine_cleanup(&client->engine);
+        goto fail;
+    }
+    return client;
+
+fail:
+    for (i = 0; i < 2; i++) {
+        if (client->wake[i] >= 0) {
+            close(client->wake[i]);
+        }
+    }
+    cprowl_ring_cleanup(&client->ring);
+    pthread_cond_destroy(&client->finished);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+    return NULL;
+}
+
+/* state kept across runs: spool segments, TLS sessions, the DNS cache */
+const char*
+cprowl_spool_default_dir(void)
+{
+    static char path[256];
+    snprintf(path, sizeof(path), "/var/tmp/cprowl-%d", (int) getuid());
+    return path;
+}
+
+cprowl_client_t*
+cprowl_client_open(const cprowl_options_t *opts)
+{
+    return client_create(opts, CPROWL_CLIENT_QUEUE_SIZE, CPROWL_QUEUE_BLOCK);
+}
+
+void
+cprowl_client_config_init(cprowl_client_config_t *config)
+{
+    memset(config, 0, sizeof(*config));
+    config->url = CPROWL_ADD_ENDPOINT;
+    config->concurrency = CPROWL_DEFAULT_CONCURRENCY;
+    config->retries = CPROWL_DEFAULT_RETRIES;
+    config->retry_deadline_ms = CPROWL_DEFAULT_RETRY_DEADLINE * 1000L;
+    config->queue_size = CPROWL_CLIENT_QUEUE_SIZE;
+    config->queue_full = CPROWL_QUEUE_BLOCK;
+}
+
+cprowl_client_t*
+cprowl_client_new(const cprowl_client_config_t *config)
+{
+    cprowl_options_t opts;
+
+    /* nothing is kept on disk for an embedding program */
+    memset(&opts, 0, sizeof(opts));
+    opts.url = config->url ? config->url : CPROWL_ADD_ENDPOINT;
+    opts.debug = config->debug;
+    opts.concurrency = config->concurrency > 0 ? config->concurrency :
+                       CPROWL_DEFAULT_CONCURRENCY;
+    opts.spool_dir = cprowl_spool_default_dir();
+    opts.retries = config->retries;
+    opts.retry_deadline_ms = config->retry_deadline_ms;
+    opts.cacert = config->cacert;
+    return client_create(&opts, config->queue_size > 0 ? config->queue_size :
+                         CPROWL_CLIENT_QUEUE_SIZE, config->queue_full);
+}
+
+/* queue a copy of req; cb, if any, runs on the I/O thread once it is
+ * sent or has finally failed.  FALSE when it was dropped. */
+int
+cprowl_client_submit(cprowl_client_t *client, cprowl_add_request_t *req,
+                     cprowl_client_cb cb, void *arg)
+{
+    client_slot_t *slot;
+    unsigned tries = 0;
+
+    __atomic_fetch_add(&client->outstanding, 1, __ATOMIC_RELAXED);
+    if (!client_slot_fill(NULL, req)) {
+        return client_submit_job(client, req, cb, arg);
+    }
+
+    while ((slot = cprowl_ring_claim(&client->ring)) == NULL) {
+        /* only the I/O thread empties the ring: a callback waiting
+         * there for room would wait forever */
+        if (client->full == CPROWL_QUEUE_BLOCK &&
+            pthread_equal(pthread_self(), client->thread)) {
+            return client_submit_job(client, req, cb, arg);
+        }
+        if (!client_full(client, &tries)) {
+            if (cb) {
+                cb(NULL, CPROWL_DROPPED, 0, arg);
+            }
+            client_finished(client, NULL, CPROWL_DROPPED, 0);
+            return FALSE;
+        }
+    }
+    slot->cb = cb;
+    slot->arg = arg;
+    client_slot_fill(slot, req);
+    cprowl_ring_publish(&client->ring, slot);
+    client_notify(client);
+    return TRUE;
+}
+
+/* send req and wait for the outcome, retries included */
+CURLcode
+cprowl_client_send(cprowl_client_t *client, cprowl_add_request_t *req,
+                   int *http_error_code)
+{
+    client_wait_t wait;
+    client_job_t *cj;
+
+    *http_error_code = 0;
+
+    /* the I/O thread would wait for itself */
+    if (pthread_equal(pthread_self(), client->thread)) {
+        return CURLE_RECURSIVE_API_CALL;
+    }
+    if ((cj = client_job_new(client, req)) == NULL) {
+        return CURLE_OUT_OF_MEMORY;
+    }
+    memset(&wait, 0, sizeof(wait));
+    cj->wait = &wait;
+    __atomic_fetch_add(&client->outstanding, 1, __ATOMIC_RELAXED);
+    client_queue(client, cj);
+
+    pthread_mutex_lock(&client->lock);
+    while (!wait.done) {
+        pthread_cond_wait(&client->finished, &client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+
+    *http_error_code = wait.http_error_code;
+    return wait.res;
+}
+
+/* wait until everything submitted so far is done */
+void
+cprowl_client_flush(cprowl_client_t *client)
+{
+    pthread_mutex_lock(&client->lock);
+    while (__atomic_load_n(&client->outstanding, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&client->finished, &client->lock);
+    }
+    pthread_mutex_unlock(&client->lock);
+}
+
+/* send what is still queued, then stop the I/O thread */
+void
+cprowl_client_free(cprowl_client_t *client)
+{
+    if (client == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&client->lock);
+    client->stopping = TRUE;
+    pthread_mutex_unlock(&client->lock);
+    client_wake(client);
+    pthread_join(client->thread, NULL);
+
+    cprowl_engine_cleanup(&client->engine);
+    cprowl_request_free(&client->scratch);
+    cprowl_arena_cleanup(&client->jobs);
+    cprowl_ring_cleanup(&client->ring);
+    close(client->wake[0]);
+    close(client->wake[1]);
+    pthread_cond_destroy(&client->finished);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+}
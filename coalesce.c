@@ -0,0 +1,280 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cprowl.h"
+
+/*
+ * Coalescing suppresses repeats of the same notification inside a time
+ * window.  The first occurrence goes out at once; repeats are only counted,
+ * and when the window closes one summary carrying an "(xN)" repeat count is
+ * emitted through the caller's callback.
+ *
+ * Requests are tracked by a 64 bit hash of their fields in a fixed size
+ * open addressing table (linear probing, backward shift deletion), so the
+ * table never grows however many events arrive.  A copy of the request is
+ * kept only once it has repeated, because only then is a summary needed.
+ * When the table is too full the request simply passes through.
+ *
+ * Entries are made in time order, so their hashes also go into a FIFO
+ * ring ordered by when their windows close.  Expiring pops its head while
+ * it is due and looks each one up again (entries move when others are
+ * removed), so it costs what it closes, never a sweep of the table.
+ */
+
+#define COALESCE_MAX_PROBE 32
+
+static uint64_t
+coalesce_fnv(uint64_t h, const char *s)
+{
+    while (*s) {
+        h ^= (unsigned char) *s++;
+        h *= 0x100000001b3ULL;
+    }
+    /* field separator */
+    h ^= 0xff;
+    h *= 0x100000001b3ULL;
+    return h;
+}
+
+static uint64_t
+coalesce_hash(cprowl_add_request_t *req)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    uint32_t i;
+
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        h = coalesce_fnv(h, cprowl_request_get(req, i));
+    }
+    for (i = 0; i < req->nkeys; i++) {
+        h = coalesce_fnv(h, req->keys[i]->api);
+    }
+    /* 0 marks an empty slot */
+    return h ? h : 1;
+}
+
+int
+cprowl_coalesce_init(cprowl_coalesce_t *c, size_t capacity, long window_ms,
+                     void (*emit)(cprowl_add_request_t *req, void *arg),
+                     void *arg)
+{
+    size_t cap = 16;
+
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+
+    memset(c, 0, sizeof(*c));
+    c->entries = calloc(cap, sizeof(cprowl_coalesce_entry_t));
+    c->fifo = malloc(cap * sizeof(cprowl_coalesce_window_t));
+    if (c->entries == NULL || c->fifo == NULL) {
+        free(c->entries);
+        free(c->fifo);
+        c->entries = NULL;
+        c->fifo = NULL;
+        return FALSE;
+    }
+    c->mask = cap - 1;
+    c->window_ms = window_ms;
+    c->emit = emit;
+    c->arg = arg;
+    return TRUE;
+}
+
+static void
+coalesce_drop(cprowl_coalesce_entry_t *e)
+{
+    if (e->req) {
+        cprowl_request_free(e->req);
+        free(e->req);
+    }
+    memset(e, 0, sizeof(*e));
+}
+
+/* remove slot i, shifting later members of the probe run back */
+static void
+coalesce_remove(cprowl_coalesce_t *c, size_t i)
+{
+    size_t j = i;
+
+    coalesce_drop(&c->entries[i]);
+    c->used--;
+
+    for (;;) {
+        size_t home;
+
+        j = (j + 1) & c->mask;
+        if (c->entries[j].hash == 0) {
+            break;
+        }
+        home = c->entries[j].hash & c->mask;
+        /* move j into the hole unless its home lies between hole and j */
+        if (((j - home) & c->mask) >= ((j - i) & c->mask)) {
+            c->entries[i] = c->entries[j];
+            memset(&c->entries[j], 0, sizeof(cprowl_coalesce_entry_t));
+            i = j;
+        }
+    }
+}
+
+static void
+coalesce_close(cprowl_coalesce_t *c, size_t i)
+{
+    cprowl_coalesce_entry_t *e = &c->entries[i];
+
+    if (e->count > 1) {
+        c->open--;
+    }
+    if (e->count > 1 && e->req) {
+        char event[CPROWL_MAX_LENGTH_EVENT + 1], suffix[32];
+        size_t len = cprowl_request_len(e->req, CPROWL_FIELD_EVENT);
+        size_t suffix_len;
+
+        suffix_len = snprintf(suffix, sizeof(suffix), " (x%u)", e->count);
+        if (len + suffix_len > CPROWL_MAX_LENGTH_EVENT) {
+            len = CPROWL_MAX_LENGTH_EVENT - suffix_len;
+        }
+        memcpy(event, cprowl_request_get(e->req, CPROWL_FIELD_EVENT), len);
+        memcpy(event + len, suffix, suffix_len);
+        cprowl_request_set(e->req, CPROWL_FIELD_EVENT, event, len + suffix_len);
+        c->emit(e->req, c->arg);
+    }
+    coalesce_remove(c, i);
+}
+
+/* TRUE when req should be sent now, FALSE when it was folded into an
+ * earlier occurrence */
+int
+cprowl_coalesce_check(cprowl_coalesce_t *c, cprowl_add_request_t *req,
+                      long long now)
+{
+    uint64_t hash = coalesce_hash(req);
+    size_t i = hash & c->mask;
+    int probe;
+
+    /* so a match below is always inside its window */
+    cprowl_coalesce_expire(c, now, FALSE);
+
+    for (probe = 0; probe < COALESCE_MAX_PROBE; probe++, i = (i + 1) & c->mask) {
+        cprowl_coalesce_entry_t *e = &c->entries[i];
+
+        if (e->hash == 0) {
+            /* keep the load factor below 3/4 */
+            if (c->used >= (c->mask + 1) / 4 * 3) {
+                return TRUE;
+            }
+            e->hash = hash;
+            e->first = now;
+            e->count = 1;
+            c->used++;
+            c->fifo[c->tail & c->mask].hash = hash;
+            c->fifo[c->tail & c->mask].first = now;
+            c->tail++;
+            return TRUE;
+        }
+
+        if (e->hash != hash) {
+            continue;
+        }
+
+        if (++e->count == 2) {
+            c->open++;
+        }
+        if (e->req == NULL && (e->req = malloc(sizeof(*e->req))) != NULL &&
+            !cprowl_request_copy(e->req, req)) {
+            free(e->req);
+            e->req = NULL;
+        }
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/* the table slot of the entry made at first with this hash, or -1 once
+ * it is gone */
+static long
+coalesce_find(cprowl_coalesce_t *c, uint64_t hash, long long first)
+{
+    size_t i = hash & c->mask;
+    int probe;
+
+    /* removal only ever moves entries towards their home slot */
+    for (probe = 0; probe < COALESCE_MAX_PROBE; probe++, i = (i + 1) & c->mask) {
+        cprowl_coalesce_entry_t *e = &c->entries[i];
+
+        if (e->hash == 0) {
+            break;
+        }
+        if (e->hash == hash && e->first == first) {
+            return (long) i;
+        }
+    }
+    return -1;
+}
+
+/* close every window that has run out, or all of them when force is set */
+void
+cprowl_coalesce_expire(cprowl_coalesce_t *c, long long now, int force)
+{
+    cprowl_coalesce_window_t *w;
+    long i;
+
+    while (c->head != c->tail) {
+        w = &c->fifo[c->head & c->mask];
+        if (!force && now - w->first < c->window_ms) {
+            break;
+        }
+        c->head++;
+        if ((i = coalesce_find(c, w->hash, w->first)) >= 0) {
+            coalesce_close(c, (size_t) i);
+        }
+    }
+}
+
+/* milliseconds until the next window closes, -1 when none has repeats
+ * to summarize */
+long
+cprowl_coalesce_timeout(cprowl_coalesce_t *c, long long now)
+{
+    long long next;
+
+    if (c->open == 0) {
+        return -1;
+    }
+    /* the oldest window closes first, summary or not */
+    next = c->fifo[c->head & c->mask].first + c->window_ms;
+    return next > now ? (long) (next - now) : 0;
+}
+
+void
+cprowl_coalesce_cleanup(cprowl_coalesce_t *c)
+{
+    size_t i;
+
+    if (c->entries == NULL) {
+        return;
+    }
+    for (i = 0; i <= c->mask; i++) {
+        coalesce_drop(&c->entries[i]);
+    }
+    free(c->entries);
+    free(c->fifo);
+    c->entries = NULL;
+    c->fifo = NULL;
+}
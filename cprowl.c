@@ -18,56 +18,66 @@
 #include <string.h>
 #include <stdlib.h>
 #include "cprowl_config.h"
-#include "queue.h"
-
-#ifndef TRUE
-#define TRUE 1
-#endif
-
-#ifndef FALSE
-#define FALSE 0
-#endif
-
-#define CPROWL_ADD_ENDPOINT     "https://prowl.weks.net/publicapi/add"
-#define CPROWL_MAX_LENGTH_API   40
-#define CPROWL_MAX_LENGTH_APP   256
-#define CPROWL_MAX_LENGTH_EVENT 1024
-#define CPROWL_MAX_LENGTH_DESC  10000
-#define CPROWL_MAX_LENGTH_PRIORITY 5
-
-typedef struct api_node {
-    char api[CPROWL_MAX_LENGTH_API];
-    SLIST_ENTRY(api_node) nodes;
-} api_node_t;
-
-typedef struct {
-    SLIST_HEAD(api_node_head, api_node) api_list;
-    char app[CPROWL_MAX_LENGTH_APP + 1];
-    char event[CPROWL_MAX_LENGTH_EVENT + 1];
-    char description[CPROWL_MAX_LENGTH_DESC + 1];
-    char priority[CPROWL_MAX_LENGTH_PRIORITY + 1];
-} cprowl_add_request_t;
-
-/* Request Helper Functions */
-static char* cprowl_request_get_api_string(cprowl_add_request_t *req);
-static void  cprowl_request_add_init(cprowl_add_request_t *req);
-static int   cprowl_request_add_apikey(cprowl_add_request_t *req, 
-                                      const char *apikey);
-static void  cprowl_request_free(cprowl_add_request_t *req);
-
-/* RPC request */
-static CURLcode cprowl_add(cprowl_add_request_t *req, int debug, 
-                           int *http_error_code);
+#include "cprowl.h"
+
+/* long options without a short form */
+enum {
+    OPT_DRAIN = 256,
+    OPT_SPOOL,
+    OPT_SPOOL_MAX,
+    OPT_SPOOL_POLICY,
+    OPT_SPOOL_NOSYNC,
+    OPT_COALESCE,
+    OPT_TIMING,
+    OPT_RETRIES,
+    OPT_RETRY_DEADLINE,
+    OPT_EXEC,
+    OPT_TAIL,
+    OPT_WATCH,
+    OPT_MATCH,
+    OPT_CONTEXT,
+    OPT_WATCH_STATE,
+    OPT_WEBHOOK,
+    OPT_BACKENDS,
+    OPT_DESC_TAIL,
+    OPT_DNS_TTL,
+    OPT_TLS_NOCACHE,
+    OPT_CACERT,
+    OPT_STATS,
+    OPT_METRICS,
+    OPT_METRICS_INTERVAL,
+    OPT_SYSLOG,
+    OPT_SEVERITY,
+    OPT_FACILITY,
+    OPT_PROGRAM
+};
 
 static void usage();
 
 int main(int argc, char *argv[])
 {
     int ch;
-    int http_error_code;
-    int debug = FALSE;
+    int rc = 0;
+    int daemon = FALSE;
+    int exec = FALSE;
+    int set_event = TRUE;
+    unsigned tail = CPROWL_EXEC_DEFAULT_LINES;
+    unsigned desc_tail = 0;
+    long dns_ttl = CPROWL_DEFAULT_DNS_TTL;
+    const char *desc_path = NULL;
+    int enqueue = FALSE;
+    int drain = FALSE;
+    int stats = -1;
+    const char *socket_path = NULL;
+    const char *batch_path = NULL;
+    cprowl_client_t *client;
     CURLcode res;
+    int http_error_code;
+    cprowl_options_t opts;
     cprowl_add_request_t req;
+    cprowl_watch_t watch;
+    cprowl_syslog_t sl;
+    char *name;
     
     static struct option longopts[] = {
         { "api", required_argument, NULL, 'a' },
@@ -75,14 +85,83 @@ int main(int argc, char *argv[])
         { "event", required_argument, NULL, 'e' },
         { "description", required_argument, NULL, 'd' },
         { "priority", required_argument, NULL, 'p' },
+        { "daemon", no_argument, NULL, 'D' },
+        { "socket", required_argument, NULL, 'S' },
+        { "batch", required_argument, NULL, 'B' },
+        { "concurrency", required_argument, NULL, 'j' },
+        { "url", required_argument, NULL, 'u' },
+        { "enqueue", no_argument, NULL, 'Q' },
+        { "drain", no_argument, NULL, OPT_DRAIN },
+        { "spool", required_argument, NULL, OPT_SPOOL },
+        { "spool-max", required_argument, NULL, OPT_SPOOL_MAX },
+        { "spool-policy", required_argument, NULL, OPT_SPOOL_POLICY },
+        { "spool-nosync", no_argument, NULL, OPT_SPOOL_NOSYNC },
+        { "coalesce", required_argument, NULL, OPT_COALESCE },
+        { "timing", optional_argument, NULL, OPT_TIMING },
+        { "retries", required_argument, NULL, OPT_RETRIES },
+        { "retry-deadline", required_argument, NULL, OPT_RETRY_DEADLINE },
+        { "exec", no_argument, NULL, OPT_EXEC },
+        { "tail", required_argument, NULL, OPT_TAIL },
+        { "watch", required_argument, NULL, OPT_WATCH },
+        { "match", required_argument, NULL, OPT_MATCH },
+        { "context", required_argument, NULL, OPT_CONTEXT },
+        { "watch-state", required_argument, NULL, OPT_WATCH_STATE },
+        { "webhook", required_argument, NULL, OPT_WEBHOOK },
+        { "backends", required_argument, NULL, OPT_BACKENDS },
+        { "desc-tail", required_argument, NULL, OPT_DESC_TAIL },
+        { "dns-ttl", required_argument, NULL, OPT_DNS_TTL },
+        { "tls-nocache", no_argument, NULL, OPT_TLS_NOCACHE },
+        { "cacert", required_argument, NULL, OPT_CACERT },
+        { "stats", optional_argument, NULL, OPT_STATS },
+        { "metrics", required_argument, NULL, OPT_METRICS },
+        { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+        { "syslog", required_argument, NULL, OPT_SYSLOG },
+        { "severity", required_argument, NULL, OPT_SEVERITY },
+        { "facility", required_argument, NULL, OPT_FACILITY },
+        { "program", required_argument, NULL, OPT_PROGRAM },
         { "help", no_argument, NULL, 'h' },
         { "debug", no_argument, NULL, 'z' },
         { NULL, 0, NULL, 0 }
     };
 
+    opts.url = getenv("CPROWL_URL") ? getenv("CPROWL_URL") : CPROWL_ADD_ENDPOINT;
+    opts.debug = FALSE;
+    opts.concurrency = CPROWL_DEFAULT_CONCURRENCY;
+    opts.spool_dir = cprowl_spool_default_dir();
+    opts.spool_max = CPROWL_DEFAULT_SPOOL_MAX;
+    opts.spool_policy = CPROWL_SPOOL_DROP_NEW;
+    opts.spool_sync = TRUE;
+    opts.coalesce_ms = 0;
+    opts.timing = NULL;
+    opts.retries = CPROWL_DEFAULT_RETRIES;
+    opts.retry_deadline_ms = CPROWL_DEFAULT_RETRY_DEADLINE * 1000L;
+    opts.backends = NULL;
+    opts.nbackends = 0;
+    opts.dns = NULL;
+    opts.tls_resume = TRUE;
+    opts.cacert = NULL;
+    opts.metrics_path = NULL;
+    opts.metrics_interval_ms = CPROWL_DEFAULT_METRICS_INTERVAL * 1000L;
+
+    memset(&watch, 0, sizeof(watch));
+    watch.set_event = TRUE;
+    watch.context = CPROWL_WATCH_DEFAULT_CONTEXT;
+    watch.files = calloc(argc, sizeof(char *));
+    watch.patterns = calloc(argc, sizeof(char *));
+
+    memset(&sl, 0, sizeof(sl));
+    sl.severity = CPROWL_SYSLOG_DEFAULT_SEVERITY;
+    sl.set_app = TRUE;
+    sl.programs = calloc(argc, sizeof(char *));
+    if (watch.files == NULL || watch.patterns == NULL ||
+        sl.programs == NULL) {
+        fprintf(stderr, "out of memory\n");
+        return 1;
+    }
+
     cprowl_request_add_init(&req);
 
-    while ((ch = getopt_long(argc, argv, "p:a:n:e:d:hz", longopts, NULL)) != -1) {
+    while ((ch = getopt_long(argc, argv, "+p:a:n:e:d:DS:B:j:u:Qhz", longopts, NULL)) != -1) {
         switch (ch) {
         case 'a':
             if (!cprowl_request_add_apikey(&req, optarg)) {
@@ -91,19 +170,177 @@ int main(int argc, char *argv[])
             }
             break;
         case 'n':
-            strncpy(req.app, optarg, CPROWL_MAX_LENGTH_APP);
+            cprowl_request_set(&req, CPROWL_FIELD_APP,
+                               optarg, strlen(optarg));
+            sl.set_app = FALSE;
             break;
         case 'e':
-            strncpy(req.event, optarg, CPROWL_MAX_LENGTH_EVENT);
+            cprowl_request_set(&req, CPROWL_FIELD_EVENT,
+                               optarg, strlen(optarg));
+            set_event = FALSE;
+            watch.set_event = FALSE;
             break;
         case 'd':
-            strncpy(req.description, optarg, CPROWL_MAX_LENGTH_DESC);
+            if (optarg[0] == '@' || strcmp(optarg, "-") == 0) {
+                desc_path = optarg[0] == '@' ? optarg + 1 : optarg;
+            } else {
+                desc_path = NULL;
+                cprowl_request_set(&req, CPROWL_FIELD_DESCRIPTION,
+                                   optarg, strlen(optarg));
+            }
             break;
         case 'p':
-            strncpy(req.priority, optarg, CPROWL_MAX_LENGTH_PRIORITY);
+            cprowl_request_set(&req, CPROWL_FIELD_PRIORITY,
+                               optarg, strlen(optarg));
+            break;
+        case 'D':
+            daemon = TRUE;
+            break;
+        case 'S':
+            socket_path = optarg;
+            break;
+        case 'B':
+            batch_path = optarg;
+            break;
+        case 'j':
+            if ((opts.concurrency = atoi(optarg)) < 1) {
+                fprintf(stderr, "invalid concurrency (%s)\n", optarg);
+                goto done;
+            }
+            break;
+        case 'u':
+            opts.url = optarg;
+            break;
+        case 'Q':
+            enqueue = TRUE;
+            break;
+        case OPT_DRAIN:
+            drain = TRUE;
+            break;
+        case OPT_SPOOL:
+            opts.spool_dir = optarg;
+            break;
+        case OPT_SPOOL_MAX:
+            opts.spool_max = (size_t) atoi(optarg) * 1024 * 1024;
+            break;
+        case OPT_SPOOL_POLICY:
+            if (strcmp(optarg, "drop-new") == 0) {
+                opts.spool_policy = CPROWL_SPOOL_DROP_NEW;
+            } else if (strcmp(optarg, "drop-old") == 0) {
+                opts.spool_policy = CPROWL_SPOOL_DROP_OLD;
+            } else {
+                fprintf(stderr, "invalid spool policy (%s)\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_SPOOL_NOSYNC:
+            opts.spool_sync = FALSE;
+            break;
+        case OPT_COALESCE:
+            opts.coalesce_ms = atol(optarg) * 1000;
+            break;
+        case OPT_TIMING:
+            if (optarg == NULL) {
+                opts.timing = stderr;
+            } else if ((opts.timing = fopen(optarg, "a")) == NULL) {
+                perror(optarg);
+                goto done;
+            }
+            break;
+        case OPT_RETRIES:
+            if ((opts.retries = atoi(optarg)) < 0) {
+                usage();
+            }
+            break;
+        case OPT_RETRY_DEADLINE:
+            opts.retry_deadline_ms = atol(optarg) * 1000;
+            break;
+        case OPT_EXEC:
+            exec = TRUE;
+            break;
+        case OPT_TAIL:
+            tail = (unsigned) atoi(optarg);
+            break;
+        case OPT_WATCH:
+            watch.files[watch.nfiles++] = optarg;
+            break;
+        case OPT_MATCH:
+            watch.patterns[watch.npatterns++] = optarg;
+            break;
+        case OPT_CONTEXT:
+            watch.context = (unsigned) atoi(optarg);
+            break;
+        case OPT_WATCH_STATE:
+            watch.state = optarg;
+            break;
+        case OPT_WEBHOOK:
+            if (!cprowl_backend_add_webhook(&opts, optarg)) {
+                rc = 1;
+                goto done;
+            }
+            break;
+        case OPT_TLS_NOCACHE:
+            opts.tls_resume = FALSE;
+            break;
+        case OPT_CACERT:
+            opts.cacert = optarg;
+            break;
+        case OPT_STATS:
+            if (optarg == NULL) {
+                stats = CPROWL_STATS_TEXT;
+            } else if (strcmp(optarg, "prometheus") == 0) {
+                stats = CPROWL_STATS_PROMETHEUS;
+            } else {
+                fprintf(stderr, "invalid stats format (%s)\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_SYSLOG:
+            sl.listen = optarg;
+            break;
+        case OPT_SEVERITY:
+            if ((sl.severity = cprowl_syslog_severity(optarg)) < 0) {
+                fprintf(stderr, "invalid severity (%s)\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_FACILITY:
+            for (name = strtok(optarg, ","); name; name = strtok(NULL, ",")) {
+                int facility = cprowl_syslog_facility(name);
+
+                if (facility < 0) {
+                    fprintf(stderr, "invalid facility (%s)\n", name);
+                    goto done;
+                }
+                sl.facilities |= 1u << facility;
+            }
+            break;
+        case OPT_PROGRAM:
+            sl.programs[sl.nprograms++] = optarg;
+            break;
+        case OPT_METRICS:
+            opts.metrics_path = optarg;
+            break;
+        case OPT_METRICS_INTERVAL:
+            if ((opts.metrics_interval_ms = atol(optarg) * 1000) <= 0) {
+                fprintf(stderr, "invalid metrics interval (%s)\n", optarg);
+                goto done;
+            }
+            break;
+        case OPT_DNS_TTL:
+            dns_ttl = atol(optarg);
+            break;
+        case OPT_DESC_TAIL:
+            desc_tail = (unsigned) atoi(optarg);
+            break;
+        case OPT_BACKENDS:
+            if (!cprowl_backend_load(&opts, optarg)) {
+                rc = 1;
+                goto done;
+            }
             break;
         case 'z':
-            debug = TRUE;
+            opts.debug = TRUE;
             break;
         case 'h':
         default:
@@ -111,172 +348,114 @@ int main(int argc, char *argv[])
         }
     }
 
-    /* argument validation */
-    if (SLIST_EMPTY(&req.api_list)) {
-        fprintf(stderr, "invalid api key\n");
+    /* read once all options are known */
+    if (desc_path && !cprowl_desc_read(&req, desc_path, desc_tail)) {
+        rc = 1;
         goto done;
     }
 
-    /* init curl */
-    curl_global_init(CURL_GLOBAL_ALL);
-
-    /* perform rpc call */
-    if ((res=cprowl_add(&req, debug, &http_error_code)) != CURLE_OK) {
-        fprintf(stderr, "%s", curl_easy_strerror(res));
+    /* a query, not a send */
+    if (stats >= 0) {
+        rc = cprowl_daemon_stats(socket_path ? socket_path :
+                                 cprowl_daemon_default_socket(), stats) ? 0 : 1;
         goto done;
     }
 
-    /* error handling */
-    switch (http_error_code) {
-        case 200:
-            fprintf(stdout, "ok\n");
-            break;
-        case 401:
-            fprintf(stdout, "authentication error\n");
-            break;
-        default:
-            fprintf(stdout, "http_error_code = %d\n", http_error_code);
-            break;
+    /* only modes that send look anything up */
+    if (dns_ttl > 0 && !enqueue && (daemon || !socket_path)) {
+        opts.dns = cprowl_dns_open(opts.spool_dir, dns_ttl, opts.debug);
     }
 
-done:
-    cprowl_request_free(&req);
-    return 0;
-}
-
-static void 
-cprowl_request_add_init(cprowl_add_request_t *req)
-{
-    memset(req, 0, sizeof(*req));
-    SLIST_INIT(&req->api_list);
-    strcpy(req->app, "cprowl");
-    strcpy(req->event, "event");
-    strcpy(req->description, "description");
-    strcpy(req->priority, "0");
-}
-
-static void 
-cprowl_request_free(cprowl_add_request_t *req)
-{
-    while (!SLIST_EMPTY(&req->api_list)) {
-        api_node_t *n = SLIST_FIRST(&req->api_list);
-        SLIST_REMOVE_HEAD(&req->api_list, nodes);
-        free(n);
+    if (daemon) {
+        if (!socket_path) {
+            socket_path = cprowl_daemon_default_socket();
+        }
+        cprowl_daemon_run(socket_path, &opts);
+        goto done;
     }
-}
 
-#define BLOCK_SIZE 1024
+    if (drain) {
+        cprowl_spool_drain(&opts);
+        goto done;
+    }
 
-static char* 
-cprowl_request_get_api_string(cprowl_add_request_t *req)
-{
-    api_node_t *node;
-    char *str = NULL, *p;
-    int mem_len = 0;
-    int str_len = 0;
+    /* -a/-n/-e/-p act as defaults for every record */
+    if (batch_path) {
+        cprowl_batch_run(batch_path, &req, &opts);
+        goto done;
+    }
 
-    /* this is not optimized */
-    str = malloc(BLOCK_SIZE);
-    str[0] = '\0';
-    mem_len += BLOCK_SIZE;
+    /* argument validation; webhooks need no key */
+    if (req.nkeys == 0 && opts.nbackends == 0) {
+        fprintf(stderr, "invalid api key\n");
+        goto done;
+    }
 
-    SLIST_FOREACH(node, &req->api_list, nodes) {
-        if (mem_len < (str_len + strlen(node->api) + 3)) {
-            str = realloc(str, BLOCK_SIZE);
+    /* -a/-n/-p are used for every match */
+    if (watch.nfiles > 0) {
+        if (watch.npatterns == 0) {
+            fprintf(stderr, "--watch needs at least one --match pattern\n");
+            goto done;
         }
-        strncat(str, node->api, CPROWL_MAX_LENGTH_API);
-        if (SLIST_END(&req->api_list) != SLIST_NEXT(node, nodes))
-            strcat(str, ",");
+        rc = cprowl_watch_run(&watch, &req, &opts) ? 0 : 1;
+        goto done;
     }
 
-    return str;
-}
-
-static int
-cprowl_request_add_apikey(cprowl_add_request_t *req, 
-                          const char *apikey)
-{
-    api_node_t *node;
-
-    if (strlen(apikey) != CPROWL_MAX_LENGTH_API) {
-        return FALSE;
+    /* -a and a given -n are used for every message forwarded */
+    if (sl.listen) {
+        rc = cprowl_syslog_run(&sl, &req, &opts) ? 0 : 1;
+        goto done;
     }
 
-    node = malloc(sizeof(api_node_t));
-    strncpy(node->api, optarg, CPROWL_MAX_LENGTH_API);
-    SLIST_INSERT_HEAD(&req->api_list, node, nodes);
-    return TRUE;
-}
-
-static size_t 
-curl_write_cb(void *ptr, size_t size, size_t nmemb, void *stream)
-{
-    /* noop */
-    return (size * nmemb);
-}
-
-static CURLcode 
-cprowl_add(cprowl_add_request_t *req, int debug, int *http_error_code)
-{
-    CURL *curl;
-    CURLcode res;
-    struct curl_httppost *formpost=NULL;
-    struct curl_httppost *lastptr=NULL;
-    char *api_keys;
-
-    *http_error_code = 0;
-
-    if ((curl = curl_easy_init()) == NULL) {
-        return CURLE_OUT_OF_MEMORY;
+    /* run the command first; its outcome becomes the notification and
+     * its exit status ours */
+    if (exec) {
+        if (optind >= argc) {
+            usage();
+        }
+        if ((rc = cprowl_exec_run(argv + optind, tail, set_event, &req)) < 0) {
+            rc = 1;
+            goto done;
+        }
     }
 
-    api_keys = cprowl_request_get_api_string(req);
-
-    /* add post data */
-    curl_formadd(&formpost,
-                 &lastptr,
-                 CURLFORM_COPYNAME, "apikey",
-                 CURLFORM_PTRCONTENTS,  api_keys,
-                 CURLFORM_END);
-    curl_formadd(&formpost,
-                 &lastptr,
-                 CURLFORM_PTRNAME , "application",
-                 CURLFORM_PTRCONTENTS,  req->app,
-                 CURLFORM_END);
-    curl_formadd(&formpost,
-                 &lastptr,
-                 CURLFORM_PTRNAME , "event",
-                 CURLFORM_PTRCONTENTS,  req->event,
-                 CURLFORM_END);
-    curl_formadd(&formpost,
-                 &lastptr,
-                 CURLFORM_PTRNAME , "description",
-                 CURLFORM_PTRCONTENTS,  req->description,
-                 CURLFORM_END);
-    curl_formadd(&formpost,
-                 &lastptr,
-                 CURLFORM_PTRNAME , "priority",
-                 CURLFORM_PTRCONTENTS,  req->priority,
-                 CURLFORM_END);
+    /* leave the request for a later --drain */
+    if (enqueue) {
+        if (cprowl_spool_enqueue(&opts, &req)) {
+            fprintf(stdout, "queued\n");
+        }
+        goto done;
+    }
 
-    /* perform connection */
-    curl_easy_setopt(curl, CURLOPT_URL, CPROWL_ADD_ENDPOINT);
-    curl_easy_setopt(curl, CURLOPT_VERBOSE, debug);
-    curl_easy_setopt(curl, CURLOPT_HTTPPOST, formpost);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-#ifdef WIN32
-    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, FALSE);
-#endif
+    /* hand the request to a running daemon; no curl setup needed */
+    if (socket_path) {
+        if (cprowl_daemon_submit(socket_path, &req)) {
+            fprintf(stdout, "queued\n");
+        }
+        goto done;
+    }
 
-    res = curl_easy_perform(curl);
-    if (res == CURLE_OK) {
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, http_error_code);
+    /* perform rpc call through the library; long key lists go out as
+     * concurrent shards */
+    if ((client = cprowl_client_open(&opts)) == NULL) {
+        fprintf(stderr, "unable to initialize curl\n");
+        goto done;
     }
+    res = cprowl_client_send(client, &req, &http_error_code);
+    cprowl_client_free(client);
+    cprowl_print_result(res, http_error_code);
 
-    curl_formfree(formpost);
-    curl_easy_cleanup(curl);
-    free(api_keys);
-    return res;
+done:
+    if (opts.timing && opts.timing != stderr) {
+        fclose(opts.timing);
+    }
+    cprowl_dns_close(opts.dns);
+    cprowl_backend_free_all(&opts);
+    cprowl_request_free(&req);
+    free(watch.files);
+    free(watch.patterns);
+    free(sl.programs);
+    return rc;
 }
 
 static void usage()
@@ -284,11 +463,22 @@ static void usage()
     fprintf(stderr, "%s v%s : prowl client\n", CPROWL_NAME, CPROWL_VERSION);
     fprintf(stderr, "  usage:\n");
     fprintf(stderr, "    cprowl [-a apikey] [-n appname] [-e event] [-d description] [-p priority]\n");
+    fprintf(stderr, "           [-S socket]\n");
+    fprintf(stderr, "    cprowl --daemon [-S socket] [--metrics file [--metrics-interval seconds]]\n");
+    fprintf(stderr, "    cprowl --stats[=prometheus] [-S socket]\n");
+    fprintf(stderr, "    cprowl --batch file|- [-j concurrency] [-a apikey] [-n appname] [-e event] [-p priority]\n");
+    fprintf(stderr, "    cprowl --enqueue [spool options] [-a apikey] [-n appname] [-e event] [-d description] [-p priority]\n");
+    fprintf(stderr, "    cprowl --drain [spool options] [-j concurrency]\n");
+    fprintf(stderr, "    cprowl --watch file [--watch file...] --match pattern [--match pattern...] [-a apikey] [-n appname] [-e event] [-p priority]\n");
+    fprintf(stderr, "    cprowl --syslog path|udp:[host:]port [--severity level] [--facility name[,name...]] [--program name...] [-a apikey] [-n appname]\n");
+    fprintf(stderr, "    cprowl --exec [--tail lines] [-a apikey] [-n appname] [-e event] [-p priority] -- command [args]\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    apikey:\n");
     fprintf(stderr, "      string : prowl api key\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "      Note: the -a option can be called more than once to provide more than one api key.\n");
+    fprintf(stderr, "      Duplicate keys are ignored; more than %d keys are sent as several\n", CPROWL_MAX_KEYS_PER_REQUEST);
+    fprintf(stderr, "      concurrent requests and the first failure is reported.\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    appname:\n");
     fprintf(stderr, "      string : application name (default: \"cprowl\")\n");
@@ -298,6 +488,11 @@ static void usage()
     fprintf(stderr, "\n");
     fprintf(stderr, "    description:\n");
     fprintf(stderr, "      string : description (default: \"\")\n");
+    fprintf(stderr, "      @file  : read it from file\n");
+    fprintf(stderr, "      -      : read it from stdin\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "      --desc-tail N : with @file or -, send the last N lines instead of\n");
+    fprintf(stderr, "                      the start; a large file is not read through\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    priority:\n");
     fprintf(stderr, "      -2 : very low\n");
@@ -306,5 +501,97 @@ static void usage()
     fprintf(stderr, "       1 : high\n");
     fprintf(stderr, "       2 : emergency\n");
     fprintf(stderr, "\n");
+    fprintf(stderr, "    daemon:\n");
+    fprintf(stderr, "      -D, --daemon : stay running and send requests received on the socket;\n");
+    fprintf(stderr, "                     up to -j requests are in flight at once\n");
+    fprintf(stderr, "      -S, --socket : unix socket of the daemon (default: %s)\n",
+            cprowl_daemon_default_socket());
+    fprintf(stderr, "\n");
+    fprintf(stderr, "      Note: with -S and without -D the request is handed to the daemon,\n");
+    fprintf(stderr, "      which prints \"queued\" once the daemon has accepted it.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "      --stats[=prometheus] : print the daemon's counters, queue depth and\n");
+    fprintf(stderr, "                             latency quantiles per backend, or all of\n");
+    fprintf(stderr, "                             them in the Prometheus text format\n");
+    fprintf(stderr, "      --metrics file : have the daemon keep file up to date in the\n");
+    fprintf(stderr, "                       Prometheus text format\n");
+    fprintf(stderr, "      --metrics-interval seconds : how often (default: %d)\n",
+            CPROWL_DEFAULT_METRICS_INTERVAL);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    batch:\n");
+    fprintf(stderr, "      -B, --batch : send one notification per JSON line read from file (- for stdin)\n");
+    fprintf(stderr, "                    {\"app\":..,\"event\":..,\"description\":..,\"priority\":..,\"apikeys\":[..]}\n");
+    fprintf(stderr, "                    missing fields default to the -a/-n/-e/-p options\n");
+    fprintf(stderr, "      -j, --concurrency : requests in flight at once (default: %d)\n",
+            CPROWL_DEFAULT_CONCURRENCY);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    spool:\n");
+    fprintf(stderr, "      -Q, --enqueue : append the request to the spool and return at once\n");
+    fprintf(stderr, "      --drain : send everything in the spool, then exit\n");
+    fprintf(stderr, "      --spool dir : spool directory (default: %s)\n",
+            cprowl_spool_default_dir());
+    fprintf(stderr, "      --spool-max mb : spool size cap (default: %d)\n",
+            CPROWL_DEFAULT_SPOOL_MAX / (1024 * 1024));
+    fprintf(stderr, "      --spool-policy drop-new|drop-old : what to drop when the spool is full\n");
+    fprintf(stderr, "      --spool-nosync : do not wait for the request to reach the disk\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    coalescing (--daemon, --batch, --drain):\n");
+    fprintf(stderr, "      --coalesce seconds : send repeats of the same notification within\n");
+    fprintf(stderr, "                           this window once, as a single \"(xN)\" summary\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    endpoint:\n");
+    fprintf(stderr, "      -u, --url : endpoint url (default: $CPROWL_URL or %s)\n", CPROWL_ADD_ENDPOINT);
+    fprintf(stderr, "      --dns-ttl seconds : how long looked up addresses are kept in the\n");
+    fprintf(stderr, "                          spool directory for later runs (default: %d,\n",
+            CPROWL_DEFAULT_DNS_TTL);
+    fprintf(stderr, "                          0 disables)\n");
+    fprintf(stderr, "      --tls-nocache : do not keep TLS sessions in the spool directory to\n");
+    fprintf(stderr, "                      resume them in later runs\n");
+    fprintf(stderr, "      --cacert file : CA certificates to verify the endpoint with\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    webhooks (not with -S or --enqueue):\n");
+    fprintf(stderr, "      --webhook url : also post every notification to url as JSON\n");
+    fprintf(stderr, "      --backends file : webhooks with their own body templates, headers,\n");
+    fprintf(stderr, "                        concurrency and rate, see README\n");
+    fprintf(stderr, "      Note: with webhooks the api key is optional.\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    timing:\n");
+    fprintf(stderr, "      --timing[=FILE] : one JSON line of phase times per HTTP request, on\n");
+    fprintf(stderr, "                        stderr or appended to FILE\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    exec:\n");
+    fprintf(stderr, "      --exec : run the command, then send its exit status, run time and\n");
+    fprintf(stderr, "               last lines of output; exits with the command's status\n");
+    fprintf(stderr, "      --tail lines : output lines to send (default: %d)\n",
+            CPROWL_EXEC_DEFAULT_LINES);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    watch:\n");
+    fprintf(stderr, "      --watch file : follow the file, across rotation and truncation\n");
+    fprintf(stderr, "      --match pattern : send lines containing this fixed string\n");
+    fprintf(stderr, "      --context lines : lines before the match to send (default: %d)\n",
+            CPROWL_WATCH_DEFAULT_CONTEXT);
+    fprintf(stderr, "      --watch-state file : where read offsets are kept (default: %s)\n",
+            cprowl_watch_default_state(cprowl_spool_default_dir()));
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    syslog:\n");
+    fprintf(stderr, "      --syslog path|udp:[host:]port : receive syslog messages (RFC 3164 or\n");
+    fprintf(stderr, "                                      5424) on a unix datagram socket or a\n");
+    fprintf(stderr, "                                      UDP port and forward those that pass\n");
+    fprintf(stderr, "      --severity level : this severity or worse (default: crit)\n");
+    fprintf(stderr, "      --facility name : only these facilities, comma separated\n");
+    fprintf(stderr, "      --program name : only this program; may be given more than once\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "      Note: the host becomes the application unless -n is given, program\n");
+    fprintf(stderr, "      and severity the event, and the severity the priority (emerg 2,\n");
+    fprintf(stderr, "      alert and crit 1, err and warning 0, notice and info -1, debug -2).\n");
+    fprintf(stderr, "\n");
+    fprintf(stderr, "    retries:\n");
+    fprintf(stderr, "      --retries N : retries after a network error, 5xx or 406 (default: %d,\n",
+            CPROWL_DEFAULT_RETRIES);
+    fprintf(stderr, "                    0 disables)\n");
+    fprintf(stderr, "      --retry-deadline seconds : start no retry later than this after the\n");
+    fprintf(stderr, "                                 first attempt (default: %d)\n",
+            CPROWL_DEFAULT_RETRY_DEADLINE);
+    fprintf(stderr, "\n");
     exit(0);
 }
@@ -0,0 +1,576 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#ifndef _CPROWL_H_
+#define _CPROWL_H_
+
+#include <curl/curl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include "libcprowl.h"
+#include "queue.h"
+
+#ifndef TRUE
+#define TRUE 1
+#endif
+
+#ifndef FALSE
+#define FALSE 0
+#endif
+
+#define CPROWL_ADD_ENDPOINT     "https://prowl.weks.net/publicapi/add"
+#define CPROWL_MAX_LENGTH_API   40
+#define CPROWL_MAX_LENGTH_APP   256
+#define CPROWL_MAX_LENGTH_EVENT 1024
+#define CPROWL_MAX_LENGTH_DESC  10000
+#define CPROWL_MAX_LENGTH_PRIORITY 5
+#define CPROWL_MAX_KEYS_PER_REQUEST 5
+#define CPROWL_DEFAULT_CONCURRENCY 8
+#define CPROWL_DEFAULT_SPOOL_MAX (64 * 1024 * 1024)
+
+#define CPROWL_COALESCE_SLOTS 4096
+
+#define CPROWL_NLANES 5                 /* one per priority, -2 .. 2 */
+#define CPROWL_PRIORITY_HIGH 1          /* and up: reserved slots and budget */
+
+#define CPROWL_EXEC_DEFAULT_LINES 10
+#define CPROWL_WATCH_DEFAULT_CONTEXT 2
+
+#define CPROWL_DEFAULT_RETRIES 4
+#define CPROWL_DEFAULT_RETRY_DEADLINE 60        /* seconds */
+#define CPROWL_DEFAULT_DNS_TTL 300             /* seconds */
+#define CPROWL_DEFAULT_METRICS_INTERVAL 15     /* seconds */
+#define CPROWL_RETRY_BASE_MS   1000
+#define CPROWL_RETRY_MAX_MS    60000
+
+#define CPROWL_SPOOL_DROP_NEW 0
+#define CPROWL_SPOOL_DROP_OLD 1
+
+/* Binary submission frames (wire.c): an 8 byte header of magic, version,
+ * two reserved bytes and the payload length (32 bit big endian), then
+ * fields of <type:1><length:2, big endian><bytes>.  The daemon answers
+ * each frame with one status byte. */
+#define CPROWL_FRAME_MAGIC    0xcb
+#define CPROWL_FRAME_VERSION  1
+#define CPROWL_FRAME_HEADER   8
+#define CPROWL_FRAME_APIKEY   0x01
+#define CPROWL_FRAME_FIELD    0x10      /* + CPROWL_FIELD_* */
+
+#define CPROWL_ACK_QUEUED     0
+#define CPROWL_ACK_INVALID    1
+#define CPROWL_ACK_BUSY       2
+
+#define CPROWL_DAEMON_MAX_QUEUED 100000
+
+#define CPROWL_CACHELINE 64
+#define CPROWL_CLIENT_QUEUE_SIZE 1024   /* slots of a library client */
+
+/* An api key, interned: every request naming the key shares one copy */
+typedef struct cprowl_key {
+    char api[CPROWL_MAX_LENGTH_API + 1];
+    uint32_t hash;
+    unsigned refs;
+} cprowl_key_t;
+
+/* A field of a request: a nul-terminated string at arena + off */
+typedef struct {
+    uint32_t off;
+    uint32_t len;
+} cprowl_span_t;
+
+/* Text fields live as spans of one arena and keys as pointers to interned
+ * keys, in insertion order, without duplicates.  A copy packs both into a
+ * single block of the exact size; a request being built grows its arena
+ * as fields are set.  Read fields with cprowl_request_get(). */
+struct cprowl_add_request {
+    char *arena;
+    cprowl_key_t **keys;
+    struct cprowl_keyset *keyset;   /* dedup index for long key lists */
+    void *block;                    /* packed storage, when owned */
+    uint32_t arena_len;
+    uint32_t arena_cap;
+    uint32_t nkeys;
+    uint32_t keys_cap;
+    cprowl_span_t fields[CPROWL_NFIELDS];
+    unsigned flags;
+};
+
+/* Bounded lock-free queue of fixed size slots (ring.c); head and tail
+ * sit on cache lines of their own */
+typedef struct {
+    size_t tail;                /* next position to claim */
+    char pad1[CPROWL_CACHELINE - sizeof(size_t)];
+    size_t head;                /* next position to take */
+    char pad2[CPROWL_CACHELINE - sizeof(size_t)];
+    char *slots;
+    size_t mask;
+    size_t stride;
+} cprowl_ring_t;
+
+/* Chunked bump allocator for queued requests (arena.c) */
+typedef struct {
+    struct cprowl_arena_chunk *current;
+    size_t chunk_size;
+} cprowl_arena_t;
+
+/* A webhook that gets a copy of every request, next to Prowl */
+typedef struct {
+    char *name;
+    char *url;
+    char *body;                 /* template, see backend.c */
+    int format;                 /* how fields are escaped into the body */
+    struct curl_slist *headers;
+    int concurrency;
+    double rate;                /* sends per second, 0 for no limit */
+} cprowl_backend_t;
+
+#define CPROWL_FORMAT_TEXT 0
+#define CPROWL_FORMAT_JSON 1
+#define CPROWL_FORMAT_FORM 2
+
+typedef struct cprowl_dns cprowl_dns_t;
+
+/* Settings shared by all send modes */
+typedef struct {
+    const char *url;
+    int debug;
+    int concurrency;
+    const char *spool_dir;
+    size_t spool_max;
+    int spool_policy;
+    int spool_sync;
+    long coalesce_ms;
+    FILE *timing;               /* --timing output, or NULL */
+    int retries;                /* extra attempts after a transient failure */
+    long retry_deadline_ms;     /* no retry starts later than this */
+    cprowl_backend_t *backends; /* webhooks besides Prowl */
+    size_t nbackends;
+    cprowl_dns_t *dns;          /* on-disk DNS cache, or NULL */
+    int tls_resume;             /* keep TLS sessions for later runs */
+    const char *cacert;         /* CA bundle, or NULL for curl's */
+    const char *metrics_path;   /* Prometheus file, or NULL */
+    long metrics_interval_ms;
+} cprowl_options_t;
+
+/* Growable byte buffer */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} cprowl_buf_t;
+
+/* Parsed API response (response.c) */
+typedef struct {
+    int parsed;
+    int success;
+    int code;
+    long remaining;
+    long resetdate;
+    char message[256];
+    size_t message_len;
+
+    /* parser state */
+    int in_tag;
+    int in_error;
+    char carry[256];
+    size_t carry_len;
+} cprowl_response_t;
+
+/* Token bucket fed by the API's remaining/resetdate (ratelimit.c) */
+typedef struct {
+    int known;
+    double tokens;
+    double capacity;
+    double rate;        /* tokens per millisecond */
+    long long last;
+    long remaining;
+    time_t resetdate;
+} cprowl_ratelimit_t;
+
+/* Latency histogram (metrics.c), after HdrHistogram: values in
+ * microseconds, 16 linear sub-buckets per power of two, so a bucket is
+ * never wider than 1/16 of its value; anything past 2^36us (19 hours)
+ * lands in the last one */
+#define CPROWL_HIST_SUB_BITS 4
+#define CPROWL_HIST_BUCKETS  528
+
+typedef struct {
+    uint64_t counts[CPROWL_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+} cprowl_histogram_t;
+
+/* What one engine has done.  Only the engine's own thread writes, with
+ * relaxed atomic loads and stores rather than locked adds, so updates
+ * cost the same as plain ones and any thread may read at any time. */
+typedef struct {
+    uint64_t submitted;         /* API calls queued, shards counted */
+    uint64_t succeeded;
+    uint64_t failed;            /* finally, after any retries */
+    uint64_t retried;
+    uint64_t rejected;          /* refused by the daemon, queue full */
+    uint64_t responses[4];      /* 2xx, 4xx, 5xx and other, no response */
+    cprowl_histogram_t request; /* one HTTP request, from curl's timer */
+    cprowl_histogram_t delivery; /* queued to final outcome, ms precision */
+} cprowl_metrics_t;
+
+#define CPROWL_METRICS_ADD(field, n) \
+    __atomic_store_n(&(field), __atomic_load_n(&(field), __ATOMIC_RELAXED) + \
+                     (n), __ATOMIC_RELAXED)
+
+#define CPROWL_STATS_TEXT       0
+#define CPROWL_STATS_PROMETHEUS 1
+
+/* Timer wheel (wheel.c) */
+typedef struct cprowl_timer {
+    unsigned rounds;
+    LIST_ENTRY(cprowl_timer) entries;
+} cprowl_timer_t;
+
+typedef struct {
+    LIST_HEAD(cprowl_timer_head, cprowl_timer) *slots;
+    size_t mask;
+    long tick_ms;
+    long long tick;             /* last tick processed */
+    size_t count;
+} cprowl_wheel_t;
+
+/* One asynchronous send.  The caller fills in req, cb and arg; res and
+ * http_error_code are set before cb runs.  A request with more keys than
+ * the API takes at once is sent as several shards, and the job reports
+ * the first failure among them. */
+typedef struct cprowl_job {
+    cprowl_add_request_t *req;
+    uint32_t key_first;         /* key range of a shard, */
+    uint32_t key_count;         /* 0 for all keys */
+    void (*cb)(struct cprowl_job *job);
+    void *arg;
+    CURLcode res;
+    int http_error_code;
+
+    /* engine private */
+    struct cprowl_handle *handle;
+    int attempts;
+    long long queued;
+    long long deadline;
+    cprowl_timer_t retry;
+    int lane;
+    TAILQ_ENTRY(cprowl_job) entries;
+} cprowl_job_t;
+
+/* Jobs of one priority waiting to be sent */
+typedef struct {
+    TAILQ_HEAD(cprowl_job_head, cprowl_job) jobs;
+    unsigned long pass;         /* stride scheduling position */
+} cprowl_lane_t;
+
+/* Concurrent send engine on top of the curl multi interface */
+typedef struct cprowl_engine {
+    CURLM *multi;
+    const cprowl_options_t *opts;
+    const cprowl_backend_t *backend;    /* NULL for Prowl */
+    int max_inflight;
+    int inflight;
+    struct cprowl_handle *handles;
+    struct cprowl_handle **idle;
+    int nidle;
+    cprowl_ratelimit_t limiter;
+    cprowl_arena_t copies;      /* requests queued by submit_copy */
+    long long wait_until;       /* paced by the limiter until then */
+    size_t npending;
+    cprowl_wheel_t retries;     /* jobs waiting to be tried again */
+    unsigned seed;              /* retry jitter */
+    int reserved;               /* slots kept for priority >= 1 */
+    int dns_pinned;             /* handles use cached addresses */
+    unsigned long vtime;        /* pass of the last lane served */
+    cprowl_lane_t lanes[CPROWL_NLANES];
+    struct cprowl_engine *peers;        /* one per webhook backend */
+    cprowl_options_t *peer_opts;
+    size_t npeers;
+    int peers_busy;
+    struct curl_waitfd *waitfds;        /* caller's and peers' fds */
+    unsigned waitfds_cap;
+    cprowl_metrics_t metrics;
+} cprowl_engine_t;
+
+/* Duplicate suppression table */
+typedef struct {
+    uint64_t hash;
+    long long first;
+    unsigned count;
+    cprowl_add_request_t *req;
+} cprowl_coalesce_entry_t;
+
+/* an entry in the order its window closes */
+typedef struct {
+    uint64_t hash;
+    long long first;
+} cprowl_coalesce_window_t;
+
+typedef struct {
+    cprowl_coalesce_entry_t *entries;
+    cprowl_coalesce_window_t *fifo;     /* as many as entries, see coalesce.c */
+    size_t head, tail;
+    size_t mask;
+    size_t used;
+    size_t open;                        /* entries that have repeated */
+    long window_ms;
+    void (*emit)(cprowl_add_request_t *req, void *arg);
+    void *arg;
+} cprowl_coalesce_t;
+
+/* Multi-pattern matcher */
+typedef struct {
+    uint32_t *next;             /* nstates x nclasses, see match.c */
+    uint32_t *out;              /* pattern index + 1 matched in a state */
+    uint32_t nstates;
+    uint32_t nclasses;
+    unsigned char cls[256];     /* byte -> input class */
+    unsigned char start[256];   /* bytes that begin a pattern */
+    unsigned char pairs[8][2];  /* first two bytes, for the prefilter */
+    unsigned char pair_any;     /* bit k: pairs[k] is one byte long */
+    unsigned npairs;
+} cprowl_matcher_t;
+
+/* What --watch follows and looks for */
+typedef struct {
+    char **files;
+    size_t nfiles;
+    char **patterns;
+    size_t npatterns;
+    unsigned context;           /* lines sent before the matching one */
+    const char *state;          /* read offsets, NULL for the default */
+    int set_event;              /* name the file and pattern in the event */
+} cprowl_watch_t;
+
+/* What --syslog listens on and forwards */
+#define CPROWL_SYSLOG_NFACILITIES 24
+#define CPROWL_SYSLOG_DEFAULT_SEVERITY 2        /* crit */
+
+typedef struct {
+    const char *listen;         /* unix datagram socket, or udp:[host:]port */
+    int severity;               /* forward this and anything more urgent */
+    uint32_t facilities;        /* a bit per facility, 0 for any */
+    char **programs;            /* forward only these, if any */
+    size_t nprograms;
+    int set_app;                /* the sending host as application */
+} cprowl_syslog_t;
+
+/* One syslog message; the strings point into the datagram and are not
+ * terminated */
+typedef struct {
+    int facility;
+    int severity;
+    const char *host;
+    size_t host_len;
+    const char *program;
+    size_t program_len;
+    const char *msg;
+    size_t msg_len;
+} cprowl_syslog_msg_t;
+
+/* Request Helper Functions (request.c); the public ones are in
+ * libcprowl.h */
+char* cprowl_request_get_api_string(cprowl_add_request_t *req);
+void  cprowl_request_add_init(cprowl_add_request_t *req);
+void  cprowl_request_clear_keys(cprowl_add_request_t *req);
+size_t cprowl_request_len(cprowl_add_request_t *req, int field);
+void  cprowl_request_free(cprowl_add_request_t *req);
+int   cprowl_request_copy(cprowl_add_request_t *dst,
+                          cprowl_add_request_t *src);
+size_t cprowl_request_packed_size(cprowl_add_request_t *req);
+void  cprowl_request_pack(cprowl_add_request_t *dst,
+                          cprowl_add_request_t *src, void *mem);
+
+/* Arena (arena.c) */
+void  cprowl_arena_init(cprowl_arena_t *arena, size_t chunk_size);
+void* cprowl_arena_alloc(cprowl_arena_t *arena, size_t size);
+void  cprowl_arena_release(void *ptr);
+void  cprowl_arena_cleanup(cprowl_arena_t *arena);
+
+/* RPC request (session.c) */
+void     cprowl_curl_setup(CURL *curl, const cprowl_options_t *opts);
+int      cprowl_post_prepare(cprowl_buf_t *body, CURL *curl,
+                             cprowl_add_request_t *req,
+                             size_t key_first, size_t key_count);
+void     cprowl_result_merge(CURLcode *res, int *http_error_code,
+                             CURLcode shard_res, int shard_code);
+void     cprowl_print_result(CURLcode res, int http_error_code);
+long long   cprowl_now_ms(void);
+
+/* Lock-free ring (ring.c) */
+int   cprowl_ring_init(cprowl_ring_t *ring, size_t nslots, size_t size);
+void  cprowl_ring_cleanup(cprowl_ring_t *ring);
+void* cprowl_ring_claim(cprowl_ring_t *ring);
+void  cprowl_ring_publish(cprowl_ring_t *ring, void *slot);
+void* cprowl_ring_take(cprowl_ring_t *ring);
+void  cprowl_ring_release(cprowl_ring_t *ring, void *slot);
+int   cprowl_ring_ready(cprowl_ring_t *ring);
+
+/* Buffers (buf.c) */
+void cprowl_buf_init(cprowl_buf_t *buf);
+int  cprowl_buf_reserve(cprowl_buf_t *buf, size_t len);
+int  cprowl_buf_append(cprowl_buf_t *buf, const char *data, size_t len);
+void cprowl_buf_reset(cprowl_buf_t *buf);
+void cprowl_buf_free(cprowl_buf_t *buf);
+
+/* Serialization and line protocol (wire.c) */
+int  cprowl_request_serialize(cprowl_buf_t *buf, cprowl_add_request_t *req);
+int  cprowl_request_serialize_keys(cprowl_buf_t *buf,
+                                   cprowl_add_request_t *req,
+                                   size_t key_first, size_t key_count);
+/* room cprowl_wire_escape() needs for len bytes: each may become an
+ * escaped U+FFFD, and vector stores run up to 32 bytes ahead */
+#define CPROWL_WIRE_ESCAPE_SIZE(len) ((len) * 9 + 32)
+char* cprowl_wire_escape(char *out, const char *value, size_t len);
+int   cprowl_wire_escape_select(const char *name);
+int  cprowl_wire_encode(cprowl_buf_t *buf, cprowl_add_request_t *req);
+int  cprowl_wire_decode(cprowl_add_request_t *req, char *line, size_t len);
+int  cprowl_wire_encode_frame(cprowl_buf_t *buf, cprowl_add_request_t *req);
+int  cprowl_wire_decode_frame(cprowl_add_request_t *req, const char *payload,
+                              size_t len);
+
+/* Webhook backends (backend.c) */
+int  cprowl_backend_add_webhook(cprowl_options_t *opts, const char *url);
+int  cprowl_backend_load(cprowl_options_t *opts, const char *path);
+int  cprowl_backend_prepare(const cprowl_backend_t *backend,
+                            cprowl_buf_t *body, CURL *curl,
+                            cprowl_add_request_t *req);
+void cprowl_backend_free_all(cprowl_options_t *opts);
+
+/* Daemon (daemon.c) */
+const char* cprowl_daemon_default_socket(void);
+int  cprowl_daemon_run(const char *path, const cprowl_options_t *opts);
+int  cprowl_daemon_submit(const char *path, cprowl_add_request_t *req);
+int  cprowl_daemon_stats(const char *path, int format);
+
+/* Batch mode (batch.c, ndjson.c) */
+int  cprowl_ndjson_decode(cprowl_add_request_t *req, char *line, size_t len);
+int  cprowl_batch_run(const char *path, cprowl_add_request_t *defaults,
+                      const cprowl_options_t *opts);
+
+/* Library clients (client.c): one with the CLI's own settings */
+cprowl_client_t* cprowl_client_open(const cprowl_options_t *opts);
+const char* cprowl_spool_default_dir(void);
+
+/* Send engine (engine.c) */
+int  cprowl_engine_init(cprowl_engine_t *engine, const cprowl_options_t *opts);
+void cprowl_engine_cleanup(cprowl_engine_t *engine);
+void cprowl_engine_submit(cprowl_engine_t *engine, cprowl_job_t *job);
+size_t cprowl_engine_pending(const cprowl_engine_t *engine);
+int  cprowl_engine_submit_copy(cprowl_engine_t *engine,
+                               cprowl_add_request_t *req);
+int  cprowl_engine_perform(cprowl_engine_t *engine, int timeout_ms);
+int  cprowl_engine_poll(cprowl_engine_t *engine, struct curl_waitfd *fds,
+                        unsigned nfds, int timeout_ms);
+void cprowl_engine_run(cprowl_engine_t *engine);
+
+/* Metrics (metrics.c) */
+void     cprowl_histogram_record(cprowl_histogram_t *h, uint64_t us);
+uint64_t cprowl_histogram_quantile(const cprowl_histogram_t *h, double q);
+uint64_t cprowl_histogram_below(const cprowl_histogram_t *h, uint64_t us);
+void cprowl_metrics_response(cprowl_metrics_t *m, CURL *curl, CURLcode res,
+                             int http_error_code);
+int  cprowl_metrics_render(cprowl_buf_t *out, const cprowl_engine_t *engine,
+                           int format);
+int  cprowl_metrics_write(const char *path, const cprowl_engine_t *engine);
+
+/* Timer wheel (wheel.c) */
+int  cprowl_wheel_init(cprowl_wheel_t *wheel, size_t nslots, long tick_ms,
+                       long long now);
+void cprowl_wheel_cleanup(cprowl_wheel_t *wheel);
+void cprowl_wheel_add(cprowl_wheel_t *wheel, cprowl_timer_t *timer,
+                      long long due);
+void cprowl_wheel_cancel(cprowl_wheel_t *wheel, cprowl_timer_t *timer);
+void cprowl_wheel_advance(cprowl_wheel_t *wheel, long long now,
+                          void (*fire)(cprowl_timer_t *timer, void *arg),
+                          void *arg);
+long cprowl_wheel_timeout(cprowl_wheel_t *wheel, long long now);
+
+/* Spool (spool.c) */
+int  cprowl_spool_enqueue(const cprowl_options_t *opts,
+                          cprowl_add_request_t *req);
+int  cprowl_spool_drain(const cprowl_options_t *opts);
+
+/* Coalescing (coalesce.c) */
+int  cprowl_coalesce_init(cprowl_coalesce_t *c, size_t capacity,
+                          long window_ms,
+                          void (*emit)(cprowl_add_request_t *req, void *arg),
+                          void *arg);
+int  cprowl_coalesce_check(cprowl_coalesce_t *c, cprowl_add_request_t *req,
+                           long long now);
+void cprowl_coalesce_expire(cprowl_coalesce_t *c, long long now, int force);
+long cprowl_coalesce_timeout(cprowl_coalesce_t *c, long long now);
+void cprowl_coalesce_cleanup(cprowl_coalesce_t *c);
+
+/* Multi-pattern matching (match.c) */
+int  cprowl_matcher_init(cprowl_matcher_t *m, char *const patterns[],
+                         size_t npatterns);
+long cprowl_matcher_find(const cprowl_matcher_t *m, const char *text,
+                         size_t len, unsigned *which);
+void cprowl_matcher_cleanup(cprowl_matcher_t *m);
+
+/* Syslog sink (syslog.c) */
+int  cprowl_syslog_parse(cprowl_syslog_msg_t *m, const char *buf, size_t len);
+int  cprowl_syslog_facility(const char *name);
+int  cprowl_syslog_severity(const char *name);
+int  cprowl_syslog_run(const cprowl_syslog_t *sl,
+                       cprowl_add_request_t *defaults,
+                       const cprowl_options_t *opts);
+
+/* Log watching (watch.c) */
+const char* cprowl_watch_default_state(const char *spool_dir);
+int  cprowl_watch_run(const cprowl_watch_t *watch,
+                      cprowl_add_request_t *defaults,
+                      const cprowl_options_t *opts);
+
+/* TLS sessions kept across runs (tls.c) */
+void cprowl_tls_setup(CURL *curl, const cprowl_options_t *opts);
+
+/* On-disk DNS cache (dns.c) */
+cprowl_dns_t* cprowl_dns_open(const char *dir, long ttl, int debug);
+void cprowl_dns_close(cprowl_dns_t *dns);
+int  cprowl_dns_apply(cprowl_dns_t *dns, CURL *curl, const char *url);
+void cprowl_dns_drop(cprowl_dns_t *dns, CURL *curl, const char *url);
+
+/* Description from a file or stdin (desc.c) */
+int    cprowl_desc_read(cprowl_add_request_t *req, const char *path,
+                        unsigned lines);
+size_t cprowl_desc_tail(const char *buf, size_t *len, unsigned lines, int cut);
+
+/* Exec and notify (exec.c) */
+int cprowl_exec_run(char *const argv[], unsigned lines, int set_event,
+                    cprowl_add_request_t *req);
+
+/* Per-request phase timing (timing.c) */
+void cprowl_timing_write(FILE *out, CURL *curl, CURLcode res,
+                         int http_error_code);
+
+/* Responses and pacing (response.c, ratelimit.c) */
+void cprowl_response_init(cprowl_response_t *resp);
+void cprowl_response_feed(cprowl_response_t *resp, const char *data,
+                          size_t len);
+void cprowl_ratelimit_init(cprowl_ratelimit_t *rl);
+void cprowl_ratelimit_fixed(cprowl_ratelimit_t *rl, double per_second);
+void cprowl_ratelimit_update(cprowl_ratelimit_t *rl, cprowl_response_t *resp,
+                             int http_error_code, int debug);
+long cprowl_ratelimit_take(cprowl_ratelimit_t *rl, long long now,
+                           int priority);
+void cprowl_ratelimit_print(cprowl_ratelimit_t *rl);
+
+#endif
@@ -0,0 +1,568 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * Daemon mode accepts requests over a unix domain socket and sends them on
+ * the engine, so submitters never wait for the network: a request is
+ * acknowledged as soon as it is queued, and failures are reported on
+ * stderr.  A client may keep its connection open and pipeline any number
+ * of requests.  Each message picks its protocol by its first byte:
+ *
+ *   binary  a frame as described in cprowl.h, answered by one status byte
+ *   text    one urlencoded line (see wire.c), answered by "queued" or
+ *           "error <reason>"
+ *
+ * The text lines "stats" and "metrics" are answered with the engine's
+ * metrics (see metrics.c), as a summary or in the Prometheus text format,
+ * and the connection is closed once the reply, which may take several
+ * writes, is out.  With --metrics the Prometheus text
+ * is also written to a file every so often, for node_exporter's textfile
+ * collector or anything else that scrapes files.
+ *
+ * The listening socket, the clients and the transfers are all waited on in
+ * one curl_multi_poll().
+ */
+
+#define DAEMON_MAX_MESSAGE  (128 * 1024)
+#define DAEMON_MAX_CLIENTS  256
+#define DAEMON_POLL_MS      1000
+
+typedef struct {
+    int fd;
+    cprowl_buf_t in;
+    cprowl_buf_t out;           /* a stats reply still being sent */
+    size_t sent;
+    int closing;                /* close once out is sent */
+} daemon_client_t;
+
+typedef struct {
+    cprowl_engine_t engine;
+    cprowl_coalesce_t coalesce;
+    int coalescing;
+    daemon_client_t clients[DAEMON_MAX_CLIENTS];
+    int nclients;
+    struct curl_waitfd fds[DAEMON_MAX_CLIENTS + 1];
+    long long metrics_next;     /* when the metrics file is due */
+} daemon_t;
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void
+daemon_signal(int sig)
+{
+    (void) sig;
+    daemon_stop = 1;
+}
+
+const char*
+cprowl_daemon_default_socket(void)
+{
+    static char path[sizeof(((struct sockaddr_un *) 0)->sun_path)];
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+
+    if (dir && *dir) {
+        snprintf(path, sizeof(path), "%s/cprowl.sock", dir);
+    } else {
+        snprintf(path, sizeof(path), "/tmp/cprowl-%d.sock", (int) getuid());
+    }
+    return path;
+}
+
+static int
+daemon_sockaddr(struct sockaddr_un *addr, const char *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "socket path too long (%s)\n", path);
+        return FALSE;
+    }
+    strcpy(addr->sun_path, path);
+    return TRUE;
+}
+
+static int
+daemon_write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return FALSE;
+        }
+        data += n;
+        len -= n;
+    }
+    return TRUE;
+}
+
+/* summaries of coalesced repeats are queued like any other request */
+static void
+daemon_emit(cprowl_add_request_t *req, void *arg)
+{
+    daemon_t *d = arg;
+
+    if (!cprowl_engine_submit_copy(&d->engine, req)) {
+        fprintf(stderr, "unable to queue summary\n");
+    }
+}
+
+static int
+daemon_queue(daemon_t *d, cprowl_add_request_t *req)
+{
+    /* a full queue still takes high priority requests */
+    if (cprowl_engine_pending(&d->engine) >= CPROWL_DAEMON_MAX_QUEUED &&
+        atoi(cprowl_request_get(req, CPROWL_FIELD_PRIORITY)) <
+        CPROWL_PRIORITY_HIGH) {
+        CPROWL_METRICS_ADD(d->engine.metrics.rejected, 1);
+        return CPROWL_ACK_BUSY;
+    }
+    if (d->coalescing) {
+        if (!cprowl_coalesce_check(&d->coalesce, req, cprowl_now_ms())) {
+            /* accepted; it will be counted in the summary */
+            return CPROWL_ACK_QUEUED;
+        }
+    }
+    return cprowl_engine_submit_copy(&d->engine, req) ?
+           CPROWL_ACK_QUEUED : CPROWL_ACK_BUSY;
+}
+
+static int
+daemon_reply(daemon_client_t *c, const char *data, size_t len)
+{
+    /* a client that does not read its acks is dropped rather than
+     * allowed to stall the daemon */
+    return send(c->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) len;
+}
+
+static int
+daemon_reply_text(daemon_client_t *c, int status)
+{
+    static const char *replies[] = {
+        "queued\n", "error invalid request\n", "error queue full\n"
+    };
+
+    return daemon_reply(c, replies[status], strlen(replies[status]));
+}
+
+/* send what is queued for a client; FALSE once it is all out or the
+ * client has gone away */
+static int
+daemon_client_flush(daemon_client_t *c)
+{
+    while (c->sent < c->out.len) {
+        ssize_t n = send(c->fd, c->out.data + c->sent, c->out.len - c->sent,
+                         MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return errno == EAGAIN;
+        }
+        c->sent += n;
+    }
+    return FALSE;
+}
+
+/* answer a stats query; the rest goes out as the client reads, and
+ * anything it sent after the query is ignored */
+static int
+daemon_reply_stats(daemon_t *d, daemon_client_t *c, int format)
+{
+    c->in.len = 0;
+    c->closing = TRUE;
+    if (!cprowl_metrics_render(&c->out, &d->engine, format)) {
+        return FALSE;
+    }
+    return daemon_client_flush(c);
+}
+
+/* write the metrics file when it is due, or at once with force */
+static void
+daemon_metrics(daemon_t *d, const cprowl_options_t *opts, int force)
+{
+    long long now = cprowl_now_ms();
+
+    if (opts->metrics_path == NULL || (!force && now < d->metrics_next)) {
+        return;
+    }
+    cprowl_metrics_write(opts->metrics_path, &d->engine);
+    d->metrics_next = now + opts->metrics_interval_ms;
+}
+
+/* answer every complete message in the client's buffer; FALSE when the
+ * client should be dropped */
+static int
+daemon_client_parse(daemon_t *d, daemon_client_t *c)
+{
+    char *p = c->in.data, *end = c->in.data + c->in.len;
+
+    while (p < end) {
+        cprowl_add_request_t req;
+        int status;
+
+        if ((unsigned char) *p == CPROWL_FRAME_MAGIC) {
+            const unsigned char *h = (const unsigned char *) p;
+            size_t payload;
+            char ack;
+
+            if (end - p < CPROWL_FRAME_HEADER) {
+                break;
+            }
+            payload = ((size_t) h[4] << 24) | (h[5] << 16) | (h[6] << 8) | h[7];
+            if (h[1] != CPROWL_FRAME_VERSION || payload > DAEMON_MAX_MESSAGE) {
+                fprintf(stderr, "invalid frame\n");
+                return FALSE;
+            }
+            if ((size_t) (end - p) < CPROWL_FRAME_HEADER + payload) {
+                break;
+            }
+
+            cprowl_request_add_init(&req);
+            status = cprowl_wire_decode_frame(&req, p + CPROWL_FRAME_HEADER,
+                                              payload) ?
+                     daemon_queue(d, &req) : CPROWL_ACK_INVALID;
+            cprowl_request_free(&req);
+
+            ack = (char) status;
+            if (!daemon_reply(c, &ack, 1)) {
+                return FALSE;
+            }
+            p += CPROWL_FRAME_HEADER + payload;
+        } else {
+            char *nl = memchr(p, '\n', end - p);
+
+            if (nl == NULL) {
+                if (end - p > DAEMON_MAX_MESSAGE) {
+                    fprintf(stderr, "request line too long\n");
+                    return FALSE;
+                }
+                break;
+            }
+
+            *nl = '\0';
+            if (strcmp(p, "stats") == 0 || strcmp(p, "metrics") == 0) {
+                return daemon_reply_stats(d, c, *p == 's' ?
+                                          CPROWL_STATS_TEXT :
+                                          CPROWL_STATS_PROMETHEUS);
+            }
+            cprowl_request_add_init(&req);
+            status = cprowl_wire_decode(&req, p, nl - p) ?
+                     daemon_queue(d, &req) : CPROWL_ACK_INVALID;
+            cprowl_request_free(&req);
+
+            if (!daemon_reply_text(c, status)) {
+                return FALSE;
+            }
+            p = nl + 1;
+        }
+    }
+
+    /* keep a partial message for the next read */
+    c->in.len = end - p;
+    memmove(c->in.data, p, c->in.len);
+    return TRUE;
+}
+
+/* FALSE when the client has gone away or misbehaved */
+static int
+daemon_client_read(daemon_t *d, daemon_client_t *c)
+{
+    ssize_t n;
+
+    if (!cprowl_buf_reserve(&c->in, 16384)) {
+        return FALSE;
+    }
+    do {
+        n = read(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len - 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+        return n < 0 && errno == EAGAIN;
+    }
+    c->in.len += n;
+    return daemon_client_parse(d, c);
+}
+
+static void
+daemon_client_close(daemon_t *d, int i)
+{
+    close(d->clients[i].fd);
+    cprowl_buf_free(&d->clients[i].in);
+    cprowl_buf_free(&d->clients[i].out);
+    d->clients[i] = d->clients[--d->nclients];
+}
+
+static void
+daemon_accept(daemon_t *d, int fd)
+{
+    int client;
+
+    if ((client = accept(fd, NULL, NULL)) < 0) {
+        if (errno != EINTR && errno != EAGAIN) {
+            perror("accept");
+        }
+        return;
+    }
+    if (d->nclients == DAEMON_MAX_CLIENTS) {
+        fprintf(stderr, "too many clients\n");
+        close(client);
+        return;
+    }
+    fcntl(client, F_SETFL, fcntl(client, F_GETFL) | O_NONBLOCK);
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+    d->clients[d->nclients].fd = client;
+    cprowl_buf_init(&d->clients[d->nclients].in);
+    cprowl_buf_init(&d->clients[d->nclients].out);
+    d->clients[d->nclients].sent = 0;
+    d->clients[d->nclients].closing = FALSE;
+    d->nclients++;
+}
+
+int
+cprowl_daemon_run(const char *path, const cprowl_options_t *opts)
+{
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    daemon_t *d;
+    int fd = -1;
+    int rc = FALSE;
+
+    if (!daemon_sockaddr(&addr, path)) {
+        return FALSE;
+    }
+    if ((d = calloc(1, sizeof(*d))) == NULL) {
+        return FALSE;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (!cprowl_engine_init(&d->engine, opts)) {
+        fprintf(stderr, "unable to initialize curl\n");
+        goto done;
+    }
+
+    if (opts->coalesce_ms > 0) {
+        if (!cprowl_coalesce_init(&d->coalesce, CPROWL_COALESCE_SLOTS,
+                                  opts->coalesce_ms, daemon_emit, d)) {
+            goto done;
+        }
+        d->coalescing = TRUE;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        perror("socket");
+        goto done;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        perror(path);
+        goto done;
+    }
+
+    if (opts->debug) {
+        fprintf(stderr, "listening on %s\n", path);
+    }
+
+    while (!daemon_stop) {
+        int i, timeout = DAEMON_POLL_MS;
+
+        d->fds[0].fd = fd;
+        d->fds[0].events = CURL_WAIT_POLLIN;
+        d->fds[0].revents = 0;
+        for (i = 0; i < d->nclients; i++) {
+            d->fds[i + 1].fd = d->clients[i].fd;
+            d->fds[i + 1].events = d->clients[i].closing ?
+                                   CURL_WAIT_POLLOUT : CURL_WAIT_POLLIN;
+            d->fds[i + 1].revents = 0;
+        }
+
+        /* wake up when a coalescing window closes */
+        if (d->coalescing) {
+            long t = cprowl_coalesce_timeout(&d->coalesce, cprowl_now_ms());
+            if (t >= 0 && t < timeout) {
+                timeout = (int) t;
+            }
+        }
+        if (opts->metrics_path) {
+            long long t = d->metrics_next - cprowl_now_ms();
+            if (t < timeout) {
+                timeout = t > 0 ? (int) t : 0;
+            }
+        }
+
+        cprowl_engine_poll(&d->engine, d->fds, d->nclients + 1, timeout);
+        daemon_metrics(d, opts, FALSE);
+
+        if (d->coalescing) {
+            cprowl_coalesce_expire(&d->coalesce, cprowl_now_ms(), FALSE);
+        }
+
+        /* from the end, so closing a client only moves one already seen */
+        for (i = d->nclients - 1; i >= 0; i--) {
+            daemon_client_t *c = &d->clients[i];
+
+            if (d->fds[i + 1].revents &&
+                !(c->closing ? daemon_client_flush(c) :
+                  daemon_client_read(d, c))) {
+                daemon_client_close(d, i);
+            }
+        }
+        if (d->fds[0].revents) {
+            daemon_accept(d, fd);
+        }
+    }
+
+    /* everything acknowledged is still sent before exiting */
+    close(fd);
+    fd = -1;
+    unlink(path);
+    while (d->nclients > 0) {
+        daemon_client_close(d, d->nclients - 1);
+    }
+    if (d->coalescing) {
+        cprowl_coalesce_expire(&d->coalesce, cprowl_now_ms(), TRUE);
+    }
+    cprowl_engine_run(&d->engine);
+    daemon_metrics(d, opts, TRUE);
+    rc = TRUE;
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    cprowl_coalesce_cleanup(&d->coalesce);
+    cprowl_engine_cleanup(&d->engine);
+    free(d);
+    curl_global_cleanup();
+    return rc;
+}
+
+/* hand req to the daemon as a binary frame; TRUE once it is queued */
+int
+cprowl_daemon_submit(const char *path, cprowl_add_request_t *req)
+{
+    struct sockaddr_un addr;
+    cprowl_buf_t buf;
+    unsigned char ack;
+    ssize_t n;
+    int fd = -1;
+    int rc = FALSE;
+
+    cprowl_buf_init(&buf);
+
+    if (!daemon_sockaddr(&addr, path)) {
+        return FALSE;
+    }
+
+    if (!cprowl_wire_encode_frame(&buf, req)) {
+        goto done;
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        goto done;
+    }
+
+    if (!daemon_write_all(fd, buf.data, buf.len)) {
+        perror("write");
+        goto done;
+    }
+
+    do {
+        n = read(fd, &ack, 1);
+    } while (n < 0 && errno == EINTR);
+
+    if (n != 1) {
+        fprintf(stderr, "no reply from daemon\n");
+    } else if (ack == CPROWL_ACK_QUEUED) {
+        rc = TRUE;
+    } else if (ack == CPROWL_ACK_BUSY) {
+        fprintf(stderr, "daemon queue full\n");
+    } else {
+        fprintf(stderr, "invalid request\n");
+    }
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    cprowl_buf_free(&buf);
+    return rc;
+}
+
+/* ask the daemon for its metrics and print them; TRUE on a reply */
+int
+cprowl_daemon_stats(const char *path, int format)
+{
+    struct sockaddr_un addr;
+    const char *query = format == CPROWL_STATS_PROMETHEUS ?
+                        "metrics\n" : "stats\n";
+    char buf[4096];
+    ssize_t n;
+    int fd;
+    int rc = FALSE;
+
+    if (!daemon_sockaddr(&addr, path)) {
+        return FALSE;
+    }
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+        connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        goto done;
+    }
+    if (!daemon_write_all(fd, query, strlen(query))) {
+        perror("write");
+        goto done;
+    }
+
+    for (;;) {
+        n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        fwrite(buf, 1, n, stdout);
+        rc = TRUE;
+    }
+    if (!rc) {
+        fprintf(stderr, "no reply from daemon\n");
+    }
+
+done:
+    if (fd >= 0) {
+        close(fd);
+    }
+    return rc;
+}
@@ -0,0 +1,177 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * -d @file and -d - read the description from a file or stdin instead of
+ * the command line.  Only as much as the description can hold is ever
+ * kept: the start of the input, or with --desc-tail N its last N lines.
+ * A regular file is tailed with a single pread of its last bytes, so a
+ * multi-GB log costs no more than a small one; a pipe is read through and
+ * only its end is kept.
+ */
+
+#define DESC_MAX CPROWL_MAX_LENGTH_DESC
+#define DESC_CHUNK (64 * 1024)
+
+/* where the last lines of buf start; len loses a final newline.  cut says
+ * buf does not start at the start of a line, so a partial first line is
+ * dropped when anything follows it.  Never points into a UTF-8 sequence. */
+size_t
+cprowl_desc_tail(const char *buf, size_t *len, unsigned lines, int cut)
+{
+    size_t i, off = 0;
+
+    if (*len > 0 && buf[*len - 1] == '\n') {
+        (*len)--;
+    }
+    for (i = *len; i > 0; i--) {
+        if (buf[i - 1] == '\n' && lines-- <= 1) {
+            off = i;
+            break;
+        }
+    }
+    if (i == 0 && cut) {
+        char *nl = memchr(buf, '\n', *len);
+        if (nl) {
+            off = nl - buf + 1;
+        }
+    }
+    while (off < *len && ((unsigned char) buf[off] & 0xc0) == 0x80) {
+        off++;
+    }
+    return off;
+}
+
+static ssize_t
+desc_pread(int fd, char *buf, size_t len, off_t off)
+{
+    size_t done = 0;
+
+    while (done < len) {
+        ssize_t n = pread(fd, buf + done, len - done, off + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+/* read a pipe to the end; buf holds 2 * DESC_MAX and keeps the last
+ * DESC_MAX bytes at least, or with lines == 0 the first DESC_MAX + 1 */
+static ssize_t
+desc_stream(int fd, char *buf, unsigned lines, int *cut)
+{
+    size_t len = 0;
+
+    for (;;) {
+        ssize_t n = read(fd, buf + len, 2 * DESC_MAX - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            return len;
+        }
+        len += n;
+        if (len == 2 * DESC_MAX) {
+            if (lines == 0) {
+                return len;
+            }
+            memmove(buf, buf + DESC_MAX, DESC_MAX);
+            len = DESC_MAX;
+            *cut = TRUE;
+        }
+    }
+}
+
+/* set the description from path (- for stdin) */
+int
+cprowl_desc_read(cprowl_add_request_t *req, const char *path, unsigned lines)
+{
+    char *buf;
+    struct stat st;
+    ssize_t len;
+    size_t off = 0, n;
+    int fd, regular, cut = FALSE, rc = FALSE;
+
+    if (strcmp(path, "-") == 0) {
+        fd = STDIN_FILENO;
+    } else if ((fd = open(path, O_RDONLY)) < 0) {
+        perror(path);
+        return FALSE;
+    }
+    if ((buf = malloc(2 * DESC_MAX)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+    }
+
+    regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (regular && lines > 0) {
+        /* one more byte tells whether the first line is whole */
+        off_t start = st.st_size > DESC_MAX ? st.st_size - DESC_MAX - 1 : 0;
+
+        len = desc_pread(fd, buf, st.st_size - start, start);
+        cut = start > 0;
+    } else if (regular) {
+        len = desc_pread(fd, buf, DESC_MAX + 1, 0);
+    } else {
+        len = desc_stream(fd, buf, lines, &cut);
+    }
+    if (len < 0) {
+        perror(path);
+        goto done;
+    }
+
+    n = len;
+    if (lines == 0 && n <= DESC_MAX && n > 0 && buf[n - 1] == '\n') {
+        n--;
+    } else if (lines > 0) {
+        off = cprowl_desc_tail(buf, &n, lines, cut);
+        if (n - off > DESC_MAX) {
+            /* keep the end of an overlong last line */
+            off = n - DESC_MAX;
+            while (off < n && ((unsigned char) buf[off] & 0xc0) == 0x80) {
+                off++;
+            }
+        }
+    }
+    /* a longer description is cut by cprowl_request_set() */
+    rc = cprowl_request_set(req, CPROWL_FIELD_DESCRIPTION, buf + off, n - off);
+
+done:
+    free(buf);
+    if (fd != STDIN_FILENO) {
+        close(fd);
+    }
+    return rc;
+}
@@ -0,0 +1,398 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * A one-shot run pays for a DNS lookup before it can connect.  The
+ * addresses of the hosts cprowl talks to are kept in a small file in the
+ * spool directory, mapped into memory, and handed to curl as
+ * pre-resolved entries (CURLOPT_RESOLVE), so a run with a warm cache
+ * never waits on the resolver.
+ *
+ * An entry is good for --dns-ttl seconds.  A missing or expired entry is
+ * looked up by a background thread while the request goes out, with the
+ * expired addresses or a live lookup, and the result is there for the
+ * next run.  If a cached address refuses the connection, the entry is
+ * dropped and the engine sends again with a live lookup.
+ *
+ * Several processes share the file; entries are read and written under
+ * flock().  The refresh thread and the engine share one open file, which
+ * flock() does not tell apart, so within a process dns->lock is taken
+ * around it as well.
+ */
+
+#define DNS_FILE "dns.cache"
+#define DNS_MAGIC 0x736e6463    /* "cdns" */
+#define DNS_VERSION 1
+#define DNS_ENTRIES 16
+#define DNS_HOST_MAX 256
+#define DNS_ADDRS_MAX 240
+#define DNS_CLOSE_WAIT_MS 1000  /* for a refresh still running at exit */
+
+typedef struct {
+    char host[DNS_HOST_MAX];
+    int64_t resolved;           /* wall clock seconds, 0 for a free slot */
+    uint32_t port;
+    char addrs[DNS_ADDRS_MAX];  /* "1.2.3.4,[2001:db8::1]" */
+} dns_entry_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    dns_entry_t entries[DNS_ENTRIES];
+} dns_file_t;
+
+struct cprowl_dns {
+    int fd;
+    dns_file_t *map;
+    long ttl;
+    int debug;
+    struct curl_slist **lists;  /* handed to curl, freed on close */
+    size_t nlists;
+
+    pthread_mutex_t lock;       /* entries, and the refresh below */
+    pthread_cond_t done;
+    int refreshing;
+    int closing;                /* the refresh thread frees us */
+    char refresh_host[DNS_HOST_MAX];
+    unsigned refresh_port;
+};
+
+static void
+dns_free(cprowl_dns_t *dns)
+{
+    size_t i;
+
+    if (dns->map != MAP_FAILED) {
+        munmap(dns->map, sizeof(dns_file_t));
+    }
+    if (dns->fd >= 0) {
+        close(dns->fd);
+    }
+    for (i = 0; i < dns->nlists; i++) {
+        curl_slist_free_all(dns->lists[i]);
+    }
+    free(dns->lists);
+    pthread_mutex_destroy(&dns->lock);
+    pthread_cond_destroy(&dns->done);
+    free(dns);
+}
+
+cprowl_dns_t*
+cprowl_dns_open(const char *dir, long ttl, int debug)
+{
+    cprowl_dns_t *dns;
+    char path[PATH_MAX];
+    struct stat st;
+
+    if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+    if ((dns = calloc(1, sizeof(*dns))) == NULL) {
+        return NULL;
+    }
+    dns->fd = -1;
+    dns->ttl = ttl;
+    dns->debug = debug;
+    dns->map = MAP_FAILED;
+    pthread_mutex_init(&dns->lock, NULL);
+    pthread_cond_init(&dns->done, NULL);
+
+    snprintf(path, sizeof(path), "%s/%s", dir, DNS_FILE);
+    if ((dns->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0 ||
+        flock(dns->fd, LOCK_EX) < 0 || fstat(dns->fd, &st) < 0) {
+        goto fail;
+    }
+    if (st.st_size != sizeof(dns_file_t) &&
+        ftruncate(dns->fd, sizeof(dns_file_t)) < 0) {
+        goto fail;
+    }
+    dns->map = mmap(NULL, sizeof(dns_file_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, dns->fd, 0);
+    if (dns->map == MAP_FAILED) {
+        goto fail;
+    }
+    if (dns->map->magic != DNS_MAGIC || dns->map->version != DNS_VERSION) {
+        memset(dns->map, 0, sizeof(dns_file_t));
+        dns->map->magic = DNS_MAGIC;
+        dns->map->version = DNS_VERSION;
+    }
+    flock(dns->fd, LOCK_UN);
+    return dns;
+
+fail:
+    if (debug) {
+        perror(path);
+    }
+    dns_free(dns);
+    return NULL;
+}
+
+/* wait a little for a refresh in flight, so the next run finds it */
+void
+cprowl_dns_close(cprowl_dns_t *dns)
+{
+    struct timespec deadline;
+
+    if (dns == NULL) {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += DNS_CLOSE_WAIT_MS / 1000;
+
+    pthread_mutex_lock(&dns->lock);
+    while (dns->refreshing &&
+           pthread_cond_timedwait(&dns->done, &dns->lock, &deadline) == 0)
+        ;
+    if (dns->refreshing) {
+        /* the thread cleans up when the lookup returns */
+        dns->closing = TRUE;
+        pthread_mutex_unlock(&dns->lock);
+        return;
+    }
+    pthread_mutex_unlock(&dns->lock);
+    dns_free(dns);
+}
+
+static dns_entry_t*
+dns_find(cprowl_dns_t *dns, const char *host, unsigned port)
+{
+    int i;
+
+    for (i = 0; i < DNS_ENTRIES; i++) {
+        dns_entry_t *e = &dns->map->entries[i];
+        if (e->resolved != 0 && e->port == port &&
+            strncmp(e->host, host, DNS_HOST_MAX) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* replace the entry for host:port, or drop it when addrs is NULL */
+static void
+dns_store(cprowl_dns_t *dns, const char *host, unsigned port,
+          const char *addrs)
+{
+    dns_entry_t *e;
+    int i;
+
+    pthread_mutex_lock(&dns->lock);
+    flock(dns->fd, LOCK_EX);
+    if ((e = dns_find(dns, host, port)) == NULL && addrs) {
+        /* a free slot, or the oldest */
+        e = &dns->map->entries[0];
+        for (i = 1; i < DNS_ENTRIES && e->resolved != 0; i++) {
+            if (dns->map->entries[i].resolved < e->resolved) {
+                e = &dns->map->entries[i];
+            }
+        }
+    }
+    if (e && addrs) {
+        snprintf(e->host, sizeof(e->host), "%s", host);
+        snprintf(e->addrs, sizeof(e->addrs), "%s", addrs);
+        e->port = port;
+        e->resolved = (int64_t) time(NULL);
+    } else if (e) {
+        e->resolved = 0;
+    }
+    flock(dns->fd, LOCK_UN);
+    pthread_mutex_unlock(&dns->lock);
+}
+
+static void*
+dns_refresh_thread(void *arg)
+{
+    cprowl_dns_t *dns = arg;
+    struct addrinfo hints, *res = NULL, *ai;
+    char port[16], addrs[DNS_ADDRS_MAX];
+    size_t len = 0;
+    int closing;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+    snprintf(port, sizeof(port), "%u", dns->refresh_port);
+
+    addrs[0] = '\0';
+    if (getaddrinfo(dns->refresh_host, port, &hints, &res) == 0) {
+        for (ai = res; ai; ai = ai->ai_next) {
+            char ip[INET6_ADDRSTRLEN];
+            const void *a = ai->ai_family == AF_INET6 ?
+                (const void *) &((struct sockaddr_in6 *) ai->ai_addr)->sin6_addr :
+                (const void *) &((struct sockaddr_in *) ai->ai_addr)->sin_addr;
+            int n;
+
+            if (inet_ntop(ai->ai_family, a, ip, sizeof(ip)) == NULL) {
+                continue;
+            }
+            n = snprintf(addrs + len, sizeof(addrs) - len,
+                         ai->ai_family == AF_INET6 ? "%s[%s]" : "%s%s",
+                         len ? "," : "", ip);
+            if (n < 0 || (size_t) n >= sizeof(addrs) - len) {
+                addrs[len] = '\0';
+                break;
+            }
+            len += n;
+        }
+        freeaddrinfo(res);
+    }
+    if (len > 0) {
+        dns_store(dns, dns->refresh_host, dns->refresh_port, addrs);
+    }
+    if (dns->debug) {
+        fprintf(stderr, "dns cache: %s:%u -> %s\n", dns->refresh_host,
+                dns->refresh_port, len ? addrs : "lookup failed");
+    }
+
+    pthread_mutex_lock(&dns->lock);
+    dns->refreshing = FALSE;
+    closing = dns->closing;
+    pthread_cond_broadcast(&dns->done);
+    pthread_mutex_unlock(&dns->lock);
+    if (closing) {
+        dns_free(dns);
+    }
+    return NULL;
+}
+
+/* look host:port up in the background, one lookup at a time */
+static void
+dns_refresh(cprowl_dns_t *dns, const char *host, unsigned port)
+{
+    pthread_t thread;
+
+    pthread_mutex_lock(&dns->lock);
+    if (!dns->refreshing) {
+        snprintf(dns->refresh_host, sizeof(dns->refresh_host), "%s", host);
+        dns->refresh_port = port;
+        if (pthread_create(&thread, NULL, dns_refresh_thread, dns) == 0) {
+            dns->refreshing = TRUE;
+            pthread_detach(thread);
+        }
+    }
+    pthread_mutex_unlock(&dns->lock);
+}
+
+/* host and port of url; FALSE for an address literal, which needs no
+ * lookup */
+static int
+dns_target(const char *url, char *host, size_t len, unsigned *port)
+{
+    CURLU *u = curl_url();
+    char *h = NULL, *p = NULL;
+    unsigned char addr[sizeof(struct in6_addr)];
+    int rc = FALSE;
+
+    if (u && curl_url_set(u, CURLUPART_URL, url, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_HOST, &h, 0) == CURLUE_OK &&
+        curl_url_get(u, CURLUPART_PORT, &p, CURLU_DEFAULT_PORT) == CURLUE_OK &&
+        h[0] != '[' && inet_pton(AF_INET, h, addr) != 1 &&
+        strlen(h) < len) {
+        strcpy(host, h);
+        *port = (unsigned) atoi(p);
+        rc = TRUE;
+    }
+    curl_free(h);
+    curl_free(p);
+    curl_url_cleanup(u);
+    return rc;
+}
+
+static int
+dns_setopt(cprowl_dns_t *dns, CURL *curl, const char *line)
+{
+    struct curl_slist **lists, *list;
+
+    lists = realloc(dns->lists, (dns->nlists + 1) * sizeof(*lists));
+    if (lists == NULL) {
+        return FALSE;
+    }
+    dns->lists = lists;
+    if ((list = curl_slist_append(NULL, line)) == NULL) {
+        return FALSE;
+    }
+    dns->lists[dns->nlists++] = list;
+    curl_easy_setopt(curl, CURLOPT_RESOLVE, list);
+    return TRUE;
+}
+
+/* give curl the cached addresses of url's host; TRUE when it got some */
+int
+cprowl_dns_apply(cprowl_dns_t *dns, CURL *curl, const char *url)
+{
+    char host[DNS_HOST_MAX], line[DNS_HOST_MAX + DNS_ADDRS_MAX + 16];
+    dns_entry_t *e;
+    unsigned port;
+    int stale = TRUE;
+
+    if (!dns_target(url, host, sizeof(host), &port)) {
+        return FALSE;
+    }
+
+    line[0] = '\0';
+    pthread_mutex_lock(&dns->lock);
+    flock(dns->fd, LOCK_SH);
+    if ((e = dns_find(dns, host, port)) != NULL) {
+        /* "+": curl drops it after its own cache timeout, so a long
+         * running daemon still picks up address changes */
+        snprintf(line, sizeof(line), "+%s:%u:%s", host, port, e->addrs);
+        stale = e->resolved + dns->ttl <= (int64_t) time(NULL);
+    }
+    flock(dns->fd, LOCK_UN);
+    pthread_mutex_unlock(&dns->lock);
+
+    if (stale) {
+        dns_refresh(dns, host, port);
+    }
+    return line[0] && dns_setopt(dns, curl, line);
+}
+
+/* a cached address failed: forget it, here and on disk */
+void
+cprowl_dns_drop(cprowl_dns_t *dns, CURL *curl, const char *url)
+{
+    char host[DNS_HOST_MAX], line[DNS_HOST_MAX + 16];
+    unsigned port;
+
+    if (!dns_target(url, host, sizeof(host), &port)) {
+        return;
+    }
+    if (dns->debug) {
+        fprintf(stderr, "dns cache: %s:%u failed to connect, "
+                "looking it up\n", host, port);
+    }
+    dns_store(dns, host, port, NULL);
+    snprintf(line, sizeof(line), "-%s:%u", host, port);
+    dns_setopt(dns, curl, line);
+    dns_refresh(dns, host, port);
+}
@@ -0,0 +1,916 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <sys/select.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * The engine runs many sends at once on the curl multi interface.  Jobs
+ * queue up in submission order and up to max_inflight of them run
+ * concurrently.  All transfers share the multi handle's connection cache;
+ * against an HTTP/2 server they are multiplexed over a single connection,
+ * otherwise they spread over up to max_inflight keep-alive connections.
+ * Completion order may differ from submission order, so every job carries
+ * its own result and callback.
+ *
+ * Each transfer slot pairs an easy handle with the buffer its body is
+ * serialized into; both are reused, so a warm engine does not allocate per
+ * send.
+ *
+ * Pending jobs wait in one lane per priority.  Emergency (2) always goes
+ * first; the other lanes share what is left by stride scheduling, each
+ * getting sends in proportion to its weight, so low priority chatter still
+ * moves but never starves anything above it.  A quarter of the transfer
+ * slots and a share of the rate budget (see ratelimit.c) are kept for
+ * priority 1 and up, so a page finds room even while a backlog of routine
+ * sends is saturating the engine.
+ *
+ * Webhook backends get an engine each, a peer of the Prowl engine with its
+ * own multi handle (so its own connection pool), transfer slots, lanes and
+ * limiter.  A job submitted to the Prowl engine is fanned out to every
+ * peer and completes once all of them are done, failing if any failed.
+ * The Prowl engine waits on the peers' sockets along with its own, so a
+ * slow backend only ever delays its own sends.
+ *
+ * A send that fails transiently (network errors, timeouts, 5xx, 406/429)
+ * is tried again after an exponential backoff with jitter, until it runs
+ * out of attempts or the next try would start after its deadline.  Jobs
+ * waiting for a retry sit on a timer wheel rather than in the pending
+ * queue, so they never hold up fresh sends.  Permanent failures such as
+ * 401 complete at once.  A send refused at an address from the DNS cache
+ * goes again at once, with a live lookup (see dns.c).
+ *
+ * Each engine counts what it does in its metrics (see metrics.c): sends,
+ * outcomes, retries, responses by class and how long requests and whole
+ * deliveries took.
+ */
+
+#define ENGINE_COPY_CHUNK (64 * 1024)
+#define ENGINE_WHEEL_SLOTS 1024
+#define ENGINE_WHEEL_TICK_MS 100
+
+#define ENGINE_LANE(priority) ((priority) + 2)
+#define ENGINE_LANE_EMERGENCY ENGINE_LANE(2)
+#define ENGINE_LANE_HIGH ENGINE_LANE(CPROWL_PRIORITY_HIGH)
+#define ENGINE_STRIDE 8
+
+/* lane weights for priority -2 .. 1; emergency is served strictly first */
+static const unsigned engine_weight[ENGINE_LANE_EMERGENCY] = { 1, 2, 4, 8 };
+
+struct cprowl_handle {
+    CURL *curl;
+    cprowl_buf_t body;
+    cprowl_response_t response;
+};
+
+/* an engine per webhook backend, with the backend's url, concurrency
+ * and rate */
+static int
+engine_peers_init(cprowl_engine_t *engine, const cprowl_options_t *opts)
+{
+    size_t i;
+
+    engine->peers = calloc(opts->nbackends, sizeof(*engine->peers));
+    engine->peer_opts = calloc(opts->nbackends, sizeof(*engine->peer_opts));
+    if (engine->peers == NULL || engine->peer_opts == NULL) {
+        return FALSE;
+    }
+    for (i = 0; i < opts->nbackends; i++) {
+        const cprowl_backend_t *b = &opts->backends[i];
+        cprowl_options_t *o = &engine->peer_opts[i];
+
+        *o = *opts;
+        o->url = b->url;
+        o->concurrency = b->concurrency;
+        o->backends = NULL;
+        o->nbackends = 0;
+        if (!cprowl_engine_init(&engine->peers[i], o)) {
+            return FALSE;
+        }
+        engine->npeers++;
+        engine->peers[i].backend = b;
+        if (b->rate > 0) {
+            cprowl_ratelimit_fixed(&engine->peers[i].limiter, b->rate);
+        }
+    }
+    return TRUE;
+}
+
+int
+cprowl_engine_init(cprowl_engine_t *engine, const cprowl_options_t *opts)
+{
+    int i;
+
+    memset(engine, 0, sizeof(*engine));
+    for (i = 0; i < CPROWL_NLANES; i++) {
+        TAILQ_INIT(&engine->lanes[i].jobs);
+    }
+    engine->opts = opts;
+    engine->max_inflight = opts->concurrency > 0 ? opts->concurrency : 1;
+    engine->reserved = engine->max_inflight / 4;
+    if (engine->reserved == 0 && engine->max_inflight > 1) {
+        engine->reserved = 1;
+    }
+    cprowl_ratelimit_init(&engine->limiter);
+    cprowl_arena_init(&engine->copies, ENGINE_COPY_CHUNK);
+    engine->seed = (unsigned) (getpid() ^ cprowl_now_ms());
+
+    if (!cprowl_wheel_init(&engine->retries, ENGINE_WHEEL_SLOTS,
+                           ENGINE_WHEEL_TICK_MS, cprowl_now_ms())) {
+        return FALSE;
+    }
+    if ((engine->multi = curl_multi_init()) == NULL) {
+        cprowl_wheel_cleanup(&engine->retries);
+        return FALSE;
+    }
+    engine->handles = calloc(engine->max_inflight, sizeof(struct cprowl_handle));
+    engine->idle = calloc(engine->max_inflight, sizeof(struct cprowl_handle *));
+    if (engine->handles == NULL || engine->idle == NULL) {
+        free(engine->handles);
+        free(engine->idle);
+        curl_multi_cleanup(engine->multi);
+        cprowl_wheel_cleanup(&engine->retries);
+        return FALSE;
+    }
+    for (i = 0; i < engine->max_inflight; i++) {
+        engine->idle[engine->nidle++] = &engine->handles[i];
+    }
+
+    curl_multi_setopt(engine->multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+    curl_multi_setopt(engine->multi, CURLMOPT_MAX_HOST_CONNECTIONS,
+                      (long) engine->max_inflight);
+    curl_multi_setopt(engine->multi, CURLMOPT_MAXCONNECTS,
+                      (long) engine->max_inflight);
+
+    if (opts->nbackends > 0 && !engine_peers_init(engine, opts)) {
+        cprowl_engine_cleanup(engine);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+void
+cprowl_engine_cleanup(cprowl_engine_t *engine)
+{
+    size_t p;
+    int i;
+
+    for (i = 0; engine->handles && i < engine->max_inflight; i++) {
+        if (engine->handles[i].curl) {
+            curl_easy_cleanup(engine->handles[i].curl);
+        }
+        cprowl_buf_free(&engine->handles[i].body);
+    }
+    free(engine->handles);
+    free(engine->idle);
+    cprowl_arena_cleanup(&engine->copies);
+    cprowl_wheel_cleanup(&engine->retries);
+    if (engine->multi) {
+        curl_multi_cleanup(engine->multi);
+    }
+    for (p = 0; p < engine->npeers; p++) {
+        cprowl_engine_cleanup(&engine->peers[p]);
+    }
+    free(engine->peers);
+    free(engine->peer_opts);
+    free(engine->waitfds);
+    memset(engine, 0, sizeof(*engine));
+}
+
+/* the shards of one job; the parent completes with the last of them */
+typedef struct {
+    cprowl_job_t *parent;
+    size_t left;
+    cprowl_job_t shards[];
+} engine_shards_t;
+
+static void
+engine_shard_done(cprowl_job_t *shard)
+{
+    engine_shards_t *group = shard->arg;
+    cprowl_job_t *parent = group->parent;
+
+    cprowl_result_merge(&parent->res, &parent->http_error_code,
+                        shard->res, shard->http_error_code);
+
+    if (--group->left == 0) {
+        free(group);
+        parent->cb(parent);
+    }
+}
+
+static int
+engine_priority(cprowl_add_request_t *req)
+{
+    int priority = atoi(cprowl_request_get(req, CPROWL_FIELD_PRIORITY));
+
+    return priority < -2 ? -2 : priority > 2 ? 2 : priority;
+}
+
+static void
+engine_enqueue(cprowl_engine_t *engine, cprowl_job_t *job)
+{
+    cprowl_lane_t *lane;
+
+    job->res = CURLE_OK;
+    job->http_error_code = 0;
+    job->handle = NULL;
+    job->lane = ENGINE_LANE(engine_priority(job->req));
+
+    /* a lane that sat empty does not bank credit for a burst later */
+    lane = &engine->lanes[job->lane];
+    if (TAILQ_EMPTY(&lane->jobs) && lane->pass < engine->vtime) {
+        lane->pass = engine->vtime;
+    }
+    TAILQ_INSERT_TAIL(&lane->jobs, job, entries);
+    engine->npending++;
+}
+
+/* the lane to send from next, or -1; high_only skips lanes below
+ * CPROWL_PRIORITY_HIGH */
+static int
+engine_lane_next(cprowl_engine_t *engine, int high_only)
+{
+    int i, best = -1;
+
+    if (!TAILQ_EMPTY(&engine->lanes[ENGINE_LANE_EMERGENCY].jobs)) {
+        return ENGINE_LANE_EMERGENCY;
+    }
+    for (i = high_only ? ENGINE_LANE_HIGH : 0; i < ENGINE_LANE_EMERGENCY; i++) {
+        if (!TAILQ_EMPTY(&engine->lanes[i].jobs) &&
+            (best < 0 || engine->lanes[i].pass < engine->lanes[best].pass)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+static void
+engine_dequeue(cprowl_engine_t *engine, cprowl_job_t *job)
+{
+    cprowl_lane_t *lane = &engine->lanes[job->lane];
+
+    TAILQ_REMOVE(&lane->jobs, job, entries);
+    engine->npending--;
+    if (job->lane < ENGINE_LANE_EMERGENCY) {
+        engine->vtime = lane->pass;
+        lane->pass += ENGINE_STRIDE / engine_weight[job->lane];
+    }
+}
+
+/* queue a job; a request with more than CPROWL_MAX_KEYS_PER_REQUEST keys
+ * is split into shards that are sent concurrently */
+static void
+engine_submit(cprowl_engine_t *engine, cprowl_job_t *job)
+{
+    engine_shards_t *group;
+    size_t i, nshards;
+
+    job->key_first = 0;
+    job->key_count = 0;
+    job->attempts = 0;
+    job->queued = cprowl_now_ms();
+    job->deadline = job->queued + engine->opts->retry_deadline_ms;
+    if (engine->backend || job->req->nkeys <= CPROWL_MAX_KEYS_PER_REQUEST) {
+        CPROWL_METRICS_ADD(engine->metrics.submitted, 1);
+        engine_enqueue(engine, job);
+        return;
+    }
+
+    nshards = (job->req->nkeys + CPROWL_MAX_KEYS_PER_REQUEST - 1) /
+              CPROWL_MAX_KEYS_PER_REQUEST;
+    group = malloc(sizeof(*group) + nshards * sizeof(cprowl_job_t));
+    if (group == NULL) {
+        /* completed with the error from engine_dispatch */
+        CPROWL_METRICS_ADD(engine->metrics.submitted, 1);
+        engine_enqueue(engine, job);
+        job->res = CURLE_OUT_OF_MEMORY;
+        return;
+    }
+
+    job->res = CURLE_OK;
+    job->http_error_code = 0;
+    job->handle = NULL;
+    group->parent = job;
+    group->left = nshards;
+    CPROWL_METRICS_ADD(engine->metrics.submitted, nshards);
+
+    for (i = 0; i < nshards; i++) {
+        cprowl_job_t *shard = &group->shards[i];
+
+        memset(shard, 0, sizeof(*shard));
+        shard->req = job->req;
+        shard->key_first = i * CPROWL_MAX_KEYS_PER_REQUEST;
+        shard->key_count = CPROWL_MAX_KEYS_PER_REQUEST;
+        shard->cb = engine_shard_done;
+        shard->arg = group;
+        shard->queued = job->queued;
+        shard->deadline = job->deadline;
+        engine_enqueue(engine, shard);
+    }
+}
+
+/* the sends of one job to Prowl and each webhook; the parent completes
+ * with the last of them */
+typedef struct {
+    cprowl_job_t *parent;
+    cprowl_engine_t *engine;
+    size_t left;
+    int prowl;                  /* jobs[0] goes to Prowl */
+    cprowl_job_t jobs[];
+} engine_fanout_t;
+
+static void
+engine_fanout_done(cprowl_job_t *job)
+{
+    engine_fanout_t *group = job->arg;
+    cprowl_job_t *parent = group->parent;
+    size_t i = job - group->jobs;
+
+    if ((job->res != CURLE_OK || job->http_error_code != 200) &&
+        (!group->prowl || i > 0)) {
+        char buf[128];
+        fprintf(stderr, "webhook %s: %s\n",
+                group->engine->peers[i - group->prowl].backend->name,
+                cprowl_result_string(job->res, job->http_error_code,
+                                     buf, sizeof(buf)));
+    }
+    cprowl_result_merge(&parent->res, &parent->http_error_code,
+                        job->res, job->http_error_code);
+
+    if (--group->left == 0) {
+        free(group);
+        parent->cb(parent);
+    }
+}
+
+/* queue a job for Prowl, if it has keys, and for every webhook */
+void
+cprowl_engine_submit(cprowl_engine_t *engine, cprowl_job_t *job)
+{
+    engine_fanout_t *group;
+    size_t i, njobs;
+    int prowl = job->req->nkeys > 0;
+
+    if (engine->npeers == 0) {
+        engine_submit(engine, job);
+        return;
+    }
+
+    njobs = engine->npeers + prowl;
+    group = malloc(sizeof(*group) + njobs * sizeof(cprowl_job_t));
+    if (group == NULL) {
+        /* completed with the error from engine_dispatch */
+        job->attempts = 0;
+        job->queued = cprowl_now_ms();
+        CPROWL_METRICS_ADD(engine->metrics.submitted, 1);
+        engine_enqueue(engine, job);
+        job->res = CURLE_OUT_OF_MEMORY;
+        return;
+    }
+
+    job->res = CURLE_OK;
+    job->http_error_code = 0;
+    job->handle = NULL;
+    group->parent = job;
+    group->engine = engine;
+    group->left = njobs;
+    group->prowl = prowl;
+
+    for (i = 0; i < njobs; i++) {
+        cprowl_job_t *sub = &group->jobs[i];
+
+        memset(sub, 0, sizeof(*sub));
+        sub->req = job->req;
+        sub->cb = engine_fanout_done;
+        sub->arg = group;
+    }
+    if (prowl) {
+        engine_submit(engine, &group->jobs[0]);
+    }
+    for (i = 0; i < engine->npeers; i++) {
+        engine_submit(&engine->peers[i], &group->jobs[i + prowl]);
+    }
+}
+
+/* jobs queued but not yet sent, webhooks included */
+size_t
+cprowl_engine_pending(const cprowl_engine_t *engine)
+{
+    size_t i, n = engine->npending;
+
+    for (i = 0; i < engine->npeers; i++) {
+        n += engine->peers[i].npending;
+    }
+    return n;
+}
+
+/* a job that owns a private copy of its request */
+typedef struct {
+    cprowl_job_t job;
+    cprowl_add_request_t req;
+} engine_copy_t;
+
+static void
+engine_copy_done(cprowl_job_t *job)
+{
+    engine_copy_t *copy = job->arg;
+    char buf[128];
+
+    if (job->res != CURLE_OK || job->http_error_code != 200) {
+        fprintf(stderr, "%s\n", cprowl_result_string(job->res,
+                job->http_error_code, buf, sizeof(buf)));
+    }
+    cprowl_request_free(&copy->req);
+    cprowl_arena_release(copy);
+}
+
+/* fire and forget: req is copied, so the caller may reuse it at once;
+ * failures are reported on stderr */
+int
+cprowl_engine_submit_copy(cprowl_engine_t *engine, cprowl_add_request_t *req)
+{
+    engine_copy_t *copy;
+
+    /* the job, the request and its packed text in one allocation */
+    copy = cprowl_arena_alloc(&engine->copies,
+                              sizeof(*copy) + cprowl_request_packed_size(req));
+    if (copy == NULL) {
+        return FALSE;
+    }
+    cprowl_request_pack(&copy->req, req, copy + 1);
+    copy->job.req = &copy->req;
+    copy->job.cb = engine_copy_done;
+    copy->job.arg = copy;
+    cprowl_engine_submit(engine, &copy->job);
+    return TRUE;
+}
+
+static void
+engine_complete(cprowl_engine_t *engine, cprowl_job_t *job)
+{
+    if (job->res == CURLE_OK && job->http_error_code == 200) {
+        CPROWL_METRICS_ADD(engine->metrics.succeeded, 1);
+    } else {
+        CPROWL_METRICS_ADD(engine->metrics.failed, 1);
+    }
+    cprowl_histogram_record(&engine->metrics.delivery,
+                            (uint64_t) (cprowl_now_ms() - job->queued) * 1000);
+
+    if (job->handle) {
+        engine->idle[engine->nidle++] = job->handle;
+        job->handle = NULL;
+    }
+    job->cb(job);
+}
+
+static int
+engine_retryable(CURLcode res, int http_error_code)
+{
+    switch (res) {
+    case CURLE_OK:
+        return http_error_code >= 500 || http_error_code == 406 ||
+               http_error_code == 429;
+    case CURLE_COULDNT_RESOLVE_HOST:
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_SSL_CONNECT_ERROR:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static void
+engine_retry_fire(cprowl_timer_t *timer, void *arg)
+{
+    cprowl_job_t *job = (cprowl_job_t *) ((char *) timer -
+                                          offsetof(cprowl_job_t, retry));
+
+    engine_enqueue(arg, job);
+}
+
+/* put a failed job on the wheel; FALSE when it should complete instead */
+static int
+engine_retry(cprowl_engine_t *engine, cprowl_job_t *job)
+{
+    long long now = cprowl_now_ms();
+    long delay = CPROWL_RETRY_BASE_MS;
+    int i;
+
+    if (job->attempts >= engine->opts->retries ||
+        !engine_retryable(job->res, job->http_error_code)) {
+        return FALSE;
+    }
+
+    for (i = 0; i < job->attempts && delay < CPROWL_RETRY_MAX_MS; i++) {
+        delay *= 2;
+    }
+    if (delay > CPROWL_RETRY_MAX_MS) {
+        delay = CPROWL_RETRY_MAX_MS;
+    }
+    /* half the backoff is fixed, half is random, so a burst of failures
+     * does not come back in lockstep */
+    delay = delay / 2 + rand_r(&engine->seed) % (delay / 2 + 1);
+    if (now + delay > job->deadline) {
+        return FALSE;
+    }
+
+    if (engine->opts->debug) {
+        char buf[128];
+        fprintf(stderr, "%s, retrying in %ldms\n",
+                cprowl_result_string(job->res, job->http_error_code,
+                                     buf, sizeof(buf)), delay);
+    }
+
+    job->attempts++;
+    CPROWL_METRICS_ADD(engine->metrics.retried, 1);
+    if (job->handle) {
+        engine->idle[engine->nidle++] = job->handle;
+        job->handle = NULL;
+    }
+    cprowl_wheel_add(&engine->retries, &job->retry, now + delay);
+    return TRUE;
+}
+
+/* move pending jobs onto the multi handle while there is room and the
+ * rate limiter allows, highest priority first */
+static void
+engine_dispatch(cprowl_engine_t *engine)
+{
+    long long now = cprowl_now_ms();
+    int held = now < engine->wait_until;    /* low lanes are being paced */
+    long low_wait = 0;
+
+    while (engine->inflight < engine->max_inflight && engine->npending > 0) {
+        int high_only = held || engine->nidle <= engine->reserved;
+        int lane = engine_lane_next(engine, high_only);
+        cprowl_job_t *job;
+        struct cprowl_handle *h;
+        long wait;
+
+        if (lane < 0) {
+            break;
+        }
+        job = TAILQ_FIRST(&engine->lanes[lane].jobs);
+
+        if (job->res != CURLE_OK) {
+            /* failed before it was sent */
+            engine_dequeue(engine, job);
+            engine_complete(engine, job);
+            continue;
+        }
+
+        if ((wait = cprowl_ratelimit_take(&engine->limiter, now,
+                                          lane - ENGINE_LANE(0))) > 0) {
+            if (lane < ENGINE_LANE_HIGH) {
+                /* higher lanes may still have budget */
+                held = TRUE;
+                low_wait = wait;
+                continue;
+            }
+            engine->wait_until = now + wait;
+            return;
+        }
+
+        engine_dequeue(engine, job);
+
+        h = engine->idle[--engine->nidle];
+        job->handle = h;
+
+        if (h->curl == NULL) {
+            if ((h->curl = curl_easy_init()) == NULL) {
+                job->res = CURLE_OUT_OF_MEMORY;
+                engine_complete(engine, job);
+                continue;
+            }
+            cprowl_curl_setup(h->curl, engine->opts);
+            if (engine->opts->dns &&
+                cprowl_dns_apply(engine->opts->dns, h->curl,
+                                 engine->opts->url)) {
+                engine->dns_pinned = TRUE;
+            }
+        }
+
+        if (engine->backend ?
+            !cprowl_backend_prepare(engine->backend, &h->body, h->curl,
+                                    job->req) :
+            !cprowl_post_prepare(&h->body, h->curl, job->req,
+                                 job->key_first,
+                                 job->key_count ? job->key_count :
+                                 job->req->nkeys)) {
+            job->res = CURLE_OUT_OF_MEMORY;
+            engine_complete(engine, job);
+            continue;
+        }
+
+        cprowl_response_init(&h->response);
+        curl_easy_setopt(h->curl, CURLOPT_WRITEDATA, &h->response);
+        curl_easy_setopt(h->curl, CURLOPT_PRIVATE, job);
+        curl_multi_add_handle(engine->multi, h->curl);
+        engine->inflight++;
+    }
+    if (low_wait > 0) {
+        engine->wait_until = now + low_wait;
+    }
+}
+
+/* timeout_ms shortened so as not to sleep past the moment the limiter
+ * lets the next job go, nor past the next retry */
+static int
+engine_timeout(cprowl_engine_t *engine, int timeout_ms)
+{
+    long retry;
+
+    if (engine->npending > 0 && engine->wait_until > 0) {
+        long long wait = engine->wait_until - cprowl_now_ms();
+        if (wait > 0 && wait < timeout_ms) {
+            timeout_ms = (int) wait;
+        }
+    }
+    retry = cprowl_wheel_timeout(&engine->retries, cprowl_now_ms());
+    if (retry >= 0 && retry < timeout_ms) {
+        timeout_ms = (int) retry;
+    }
+    return timeout_ms;
+}
+
+static int
+engine_poll(cprowl_engine_t *engine, struct curl_waitfd *fds,
+            unsigned nfds, int timeout_ms)
+{
+    CURLMsg *msg;
+    int running = 0, left;
+
+    engine_dispatch(engine);
+    timeout_ms = engine_timeout(engine, timeout_ms);
+
+    if (engine->inflight > 0) {
+        curl_multi_perform(engine->multi, &running);
+        if (running > 0 || nfds > 0) {
+            /* finished transfers are collected below without waiting */
+            curl_multi_poll(engine->multi, fds, nfds,
+                            running > 0 ? timeout_ms : 0, NULL);
+            curl_multi_perform(engine->multi, &running);
+        }
+    } else if (((engine->npending > 0 || engine->retries.count > 0 ||
+                 engine->peers_busy) && timeout_ms > 0) || nfds > 0) {
+        /* idle, or everything is held back by the limiter, waits for
+         * a retry or is with the webhooks */
+        curl_multi_poll(engine->multi, fds, nfds, timeout_ms, NULL);
+    }
+
+    while ((msg = curl_multi_info_read(engine->multi, &left)) != NULL) {
+        cprowl_job_t *job;
+        long code = 0;
+
+        if (msg->msg != CURLMSG_DONE) {
+            continue;
+        }
+
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &job);
+        job->res = msg->data.result;
+        if (job->res == CURLE_OK) {
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &code);
+            job->http_error_code = (int) code;
+            if (engine->backend == NULL) {
+                cprowl_ratelimit_update(&engine->limiter,
+                                        &job->handle->response,
+                                        job->http_error_code,
+                                        engine->opts->debug);
+            } else if (code >= 200 && code < 300) {
+                /* webhooks answer with any 2xx */
+                job->http_error_code = 200;
+            }
+        }
+        cprowl_metrics_response(&engine->metrics, msg->easy_handle,
+                                job->res, job->http_error_code);
+        cprowl_timing_write(engine->opts->timing, msg->easy_handle,
+                            job->res, job->http_error_code);
+
+        curl_multi_remove_handle(engine->multi, msg->easy_handle);
+        engine->inflight--;
+        if (job->res == CURLE_COULDNT_CONNECT && engine->dns_pinned) {
+            /* a cached address may be stale; go again, looked up live */
+            engine->dns_pinned = FALSE;
+            cprowl_dns_drop(engine->opts->dns, msg->easy_handle,
+                            engine->opts->url);
+            engine->idle[engine->nidle++] = job->handle;
+            engine_enqueue(engine, job);
+        } else if (!engine_retry(engine, job)) {
+            engine_complete(engine, job);
+        }
+    }
+
+    cprowl_wheel_advance(&engine->retries, cprowl_now_ms(),
+                         engine_retry_fire, engine);
+
+    /* callbacks may have freed slots or submitted more work */
+    engine_dispatch(engine);
+
+    return engine->inflight + (engine->npending > 0) +
+           (engine->retries.count > 0);
+}
+
+/* make room for want entries in engine->waitfds */
+static int
+engine_waitfds_grow(cprowl_engine_t *engine, unsigned want)
+{
+    unsigned cap = engine->waitfds_cap ? engine->waitfds_cap : 64;
+    struct curl_waitfd *p;
+
+    if (want <= engine->waitfds_cap) {
+        return TRUE;
+    }
+    while (cap < want) {
+        cap *= 2;
+    }
+    if ((p = realloc(engine->waitfds, cap * sizeof(*p))) == NULL) {
+        return FALSE;
+    }
+    engine->waitfds = p;
+    engine->waitfds_cap = cap;
+    return TRUE;
+}
+
+static int
+engine_waitfd_add(cprowl_engine_t *engine, unsigned *n, curl_socket_t fd,
+                  short events)
+{
+    if (!engine_waitfds_grow(engine, *n + 1)) {
+        return FALSE;
+    }
+    engine->waitfds[*n].fd = fd;
+    engine->waitfds[*n].events = events;
+    engine->waitfds[*n].revents = 0;
+    (*n)++;
+    return TRUE;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x080800
+/* append the peer's sockets to engine->waitfds; the number added, or -1 */
+static int
+engine_peer_fds(cprowl_engine_t *engine, cprowl_engine_t *peer, unsigned *n)
+{
+    unsigned count = 0;
+    CURLMcode rc = CURLM_OUT_OF_MEMORY;
+
+    if (engine_waitfds_grow(engine, *n + 8)) {
+        rc = curl_multi_waitfds(peer->multi, engine->waitfds + *n,
+                                engine->waitfds_cap - *n, &count);
+    }
+    if (rc == CURLM_OUT_OF_MEMORY && count > 0 &&
+        engine_waitfds_grow(engine, *n + count)) {
+        rc = curl_multi_waitfds(peer->multi, engine->waitfds + *n,
+                                engine->waitfds_cap - *n, &count);
+    }
+    if (rc != CURLM_OK) {
+        return -1;
+    }
+    *n += count;
+    return (int) count;
+}
+#else
+/* curl_multi_fdset() leaves out sockets past FD_SETSIZE: once the caller
+ * has fds up there, as a daemon with many clients does, say so with -1 */
+static int
+engine_peer_fds(cprowl_engine_t *engine, cprowl_engine_t *peer, unsigned *n)
+{
+    fd_set r, w, e;
+    int fd, maxfd = -1, count = 0;
+    unsigned i;
+
+    for (i = 0; i < *n; i++) {
+        if (engine->waitfds[i].fd >= FD_SETSIZE) {
+            return -1;
+        }
+    }
+
+    FD_ZERO(&r);
+    FD_ZERO(&w);
+    FD_ZERO(&e);
+    curl_multi_fdset(peer->multi, &r, &w, &e, &maxfd);
+    for (fd = 0; fd <= maxfd; fd++) {
+        short events = (FD_ISSET(fd, &r) ? CURL_WAIT_POLLIN : 0) |
+                       (FD_ISSET(fd, &w) ? CURL_WAIT_POLLOUT : 0) |
+                       (FD_ISSET(fd, &e) ? CURL_WAIT_POLLPRI : 0);
+
+        if (events) {
+            if (!engine_waitfd_add(engine, n, fd, events)) {
+                return -1;
+            }
+            count++;
+        }
+    }
+    return count;
+}
+#endif
+
+/* add the sockets of a webhook engine to the set the Prowl engine waits
+ * on, and shorten timeout_ms to what that engine needs */
+static int
+engine_peer_wait(cprowl_engine_t *engine, cprowl_engine_t *peer, unsigned *n,
+                 int timeout_ms)
+{
+    long t = -1;
+
+    timeout_ms = engine_timeout(peer, timeout_ms);
+    if (peer->inflight == 0) {
+        return timeout_ms;
+    }
+
+    /* no sockets to wait on yet, e.g. while resolving, or not all of
+     * them known: look again soon */
+    if (engine_peer_fds(engine, peer, n) <= 0 && timeout_ms > 100) {
+        timeout_ms = 100;
+    }
+    curl_multi_timeout(peer->multi, &t);
+    if (t >= 0 && t < timeout_ms) {
+        timeout_ms = (int) t;
+    }
+    return timeout_ms;
+}
+
+/* run one round of I/O, waiting at most timeout_ms; returns non-zero while
+ * jobs are still pending or in flight */
+int
+cprowl_engine_perform(cprowl_engine_t *engine, int timeout_ms)
+{
+    return cprowl_engine_poll(engine, NULL, 0, timeout_ms);
+}
+
+/* like cprowl_engine_perform(), but also wake up when one of the caller's
+ * fds is ready; their revents are filled in */
+int
+cprowl_engine_poll(cprowl_engine_t *engine, struct curl_waitfd *fds,
+                   unsigned nfds, int timeout_ms)
+{
+    unsigned i, n = 0;
+    int busy;
+
+    if (engine->npeers == 0) {
+        return engine_poll(engine, fds, nfds, timeout_ms);
+    }
+
+    /* the Prowl engine waits for everyone: the caller's fds first, then
+     * the webhooks' sockets */
+    for (i = 0; i < nfds; i++) {
+        if (!engine_waitfd_add(engine, &n, fds[i].fd, fds[i].events)) {
+            break;
+        }
+    }
+    engine->peers_busy = FALSE;
+    for (i = 0; i < engine->npeers; i++) {
+        cprowl_engine_t *peer = &engine->peers[i];
+
+        if (engine_poll(peer, NULL, 0, 0) > 0) {
+            engine->peers_busy = TRUE;
+            timeout_ms = engine_peer_wait(engine, peer, &n, timeout_ms);
+        }
+    }
+
+    if (n >= nfds) {
+        busy = engine_poll(engine, engine->waitfds, n, timeout_ms);
+        for (i = 0; i < nfds; i++) {
+            fds[i].revents = engine->waitfds[i].revents;
+        }
+    } else {
+        /* out of memory: the webhooks are only looked at now and then */
+        busy = engine_poll(engine, fds, nfds,
+                           timeout_ms < 100 ? timeout_ms : 100);
+    }
+    for (i = 0; i < engine->npeers; i++) {
+        busy += engine_poll(&engine->peers[i], NULL, 0, 0);
+    }
+    return busy;
+}
+
+void
+cprowl_engine_run(cprowl_engine_t *engine)
+{
+    while (cprowl_engine_perform(engine, 1000) > 0)
+        ;
+}
@@ -0,0 +1,263 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * --exec runs a command, passes its stdout and stderr through to ours and
+ * keeps the last bytes it printed in a fixed ring, so memory stays flat no
+ * matter how much the command writes.  Once it exits the request gets the
+ * exit status, the run time and the last lines of output.  Every chunk is
+ * read once into a stack buffer and written out from there; the ring is
+ * the only other copy.
+ */
+
+#define EXEC_CHUNK (64 * 1024)
+#define EXEC_STATUS_MAX 128
+
+typedef struct exec_ring {
+    char data[CPROWL_MAX_LENGTH_DESC - EXEC_STATUS_MAX];
+    size_t head;        /* next byte to write */
+    int wrapped;
+} exec_ring_t;
+
+static void
+exec_ring_append(exec_ring_t *ring, const char *p, size_t len)
+{
+    size_t n;
+
+    if (len >= sizeof(ring->data)) {
+        p += len - sizeof(ring->data);
+        len = sizeof(ring->data);
+    }
+    n = sizeof(ring->data) - ring->head;
+    if (n > len) {
+        n = len;
+    }
+    memcpy(ring->data + ring->head, p, n);
+    memcpy(ring->data, p + n, len - n);
+    if (ring->head + len >= sizeof(ring->data)) {
+        ring->wrapped = TRUE;
+    }
+    ring->head = (ring->head + len) % sizeof(ring->data);
+}
+
+/* the last lines of the ring, in order, into buf; returns the length */
+static size_t
+exec_ring_tail(const exec_ring_t *ring, unsigned lines, char *buf)
+{
+    size_t size = ring->wrapped ? sizeof(ring->data) : ring->head;
+    size_t start = ring->wrapped ? ring->head : 0;
+    size_t i, len, off;
+
+    if (lines == 0) {
+        return 0;
+    }
+    for (i = 0; i < size; i++) {
+        buf[i] = ring->data[(start + i) % sizeof(ring->data)];
+    }
+    len = size;
+
+    /* the oldest line lost its start if the ring wrapped */
+    off = cprowl_desc_tail(buf, &len, lines, ring->wrapped);
+    memmove(buf, buf + off, len - off);
+    return len - off;
+}
+
+static void
+exec_write(int fd, const char *p, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;     /* keep draining the command even if we can't show it */
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+static void
+exec_duration(long long ms, char *buf, size_t len)
+{
+    long s = (long) (ms / 1000);
+
+    if (s >= 3600) {
+        snprintf(buf, len, "%ldh%02ldm%02lds", s / 3600, s / 60 % 60, s % 60);
+    } else if (s >= 60) {
+        snprintf(buf, len, "%ldm%02lds", s / 60, s % 60);
+    } else {
+        snprintf(buf, len, "%ld.%lds", s, (long) (ms % 1000) / 100);
+    }
+}
+
+int
+cprowl_exec_run(char *const argv[], unsigned lines, int set_event,
+                cprowl_add_request_t *req)
+{
+    struct sigaction ign, old_int, old_quit;
+    struct pollfd fds[2];
+    exec_ring_t *ring = NULL;
+    char *desc = NULL;
+    char chunk[EXEC_CHUNK];
+    char elapsed[32];
+    int out[2] = { -1, -1 }, err[2] = { -1, -1 };
+    int open_fds, status, n, rc = -1;
+    long long started;
+    size_t len;
+    pid_t pid;
+
+    if ((ring = calloc(1, sizeof(*ring))) == NULL ||
+        (desc = malloc(CPROWL_MAX_LENGTH_DESC + 1)) == NULL) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+    }
+    if (pipe(out) < 0 || pipe(err) < 0) {
+        perror("pipe");
+        goto done;
+    }
+
+    /* like system(3): a ^C is for the command, we still report on it */
+    memset(&ign, 0, sizeof(ign));
+    ign.sa_handler = SIG_IGN;
+    sigemptyset(&ign.sa_mask);
+    sigaction(SIGINT, &ign, &old_int);
+    sigaction(SIGQUIT, &ign, &old_quit);
+
+    started = cprowl_now_ms();
+    if ((pid = fork()) < 0) {
+        perror("fork");
+        goto restore;
+    }
+    if (pid == 0) {
+        sigaction(SIGINT, &old_int, NULL);
+        sigaction(SIGQUIT, &old_quit, NULL);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        execvp(argv[0], argv);
+        fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    close(out[1]);
+    close(err[1]);
+    out[1] = err[1] = -1;
+
+    fds[0].fd = out[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = err[0];
+    fds[1].events = POLLIN;
+    open_fds = 2;
+
+    /* stdout and stderr go into one ring, in the order they arrive */
+    while (open_fds > 0) {
+        int i;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            break;
+        }
+        for (i = 0; i < 2; i++) {
+            if (fds[i].fd < 0 || fds[i].revents == 0) {
+                continue;
+            }
+            n = read(fds[i].fd, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                fds[i].fd = -1;
+                open_fds--;
+                continue;
+            }
+            exec_write(i == 0 ? STDOUT_FILENO : STDERR_FILENO, chunk, n);
+            exec_ring_append(ring, chunk, n);
+        }
+    }
+
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            goto restore;
+        }
+    }
+    exec_duration(cprowl_now_ms() - started, elapsed, sizeof(elapsed));
+
+    if (WIFEXITED(status)) {
+        rc = WEXITSTATUS(status);
+        n = snprintf(desc, EXEC_STATUS_MAX, "exited with status %d after %s",
+                     rc, elapsed);
+    } else {
+        rc = 128 + WTERMSIG(status);
+        n = snprintf(desc, EXEC_STATUS_MAX, "killed by signal %d (%s) after %s",
+                     WTERMSIG(status), strsignal(WTERMSIG(status)), elapsed);
+    }
+    if (n >= EXEC_STATUS_MAX) {
+        n = EXEC_STATUS_MAX - 1;
+    }
+
+    len = exec_ring_tail(ring, lines, desc + n + 2);
+    if (len > 0) {
+        desc[n] = '\n';
+        desc[n + 1] = '\n';
+        n += 2 + len;
+    }
+    cprowl_request_set(req, CPROWL_FIELD_DESCRIPTION, desc, n);
+
+    if (set_event) {
+        n = snprintf(desc, CPROWL_MAX_LENGTH_EVENT, "%s %s", argv[0],
+                     rc == 0 ? "succeeded" : "failed");
+        cprowl_request_set(req, CPROWL_FIELD_EVENT, desc,
+                           n < CPROWL_MAX_LENGTH_EVENT ? n :
+                           CPROWL_MAX_LENGTH_EVENT - 1);
+    }
+
+restore:
+    sigaction(SIGINT, &old_int, NULL);
+    sigaction(SIGQUIT, &old_quit, NULL);
+done:
+    if (out[0] >= 0) {
+        close(out[0]);
+    }
+    if (out[1] >= 0) {
+        close(out[1]);
+    }
+    if (err[0] >= 0) {
+        close(err[0]);
+    }
+    if (err[1] >= 0) {
+        close(err[1]);
+    }
+    free(desc);
+    free(ring);
+    return rc;
+}
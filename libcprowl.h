@@ -0,0 +1,128 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#ifndef _LIBCPROWL_H_
+#define _LIBCPROWL_H_
+
+/*
+ * libcprowl : send Prowl notifications from a C or C++ program.
+ *
+ * Build a request, then either send it and wait for the result, or submit
+ * it with a callback and return at once:
+ *
+ *     cprowl_client_config_t config;
+ *     cprowl_client_t *client;
+ *     cprowl_add_request_t *req = cprowl_request_new();
+ *
+ *     cprowl_request_add_apikey(req, key);
+ *     cprowl_request_set(req, CPROWL_FIELD_EVENT, "disk full", 9);
+ *
+ *     cprowl_client_config_init(&config);
+ *     client = cprowl_client_new(&config);
+ *     cprowl_client_submit(client, req, done, NULL);
+ *     cprowl_request_destroy(req);
+ *     ...
+ *     cprowl_client_free(client);
+ *
+ * A client owns an I/O thread that sends everything submitted to it,
+ * concurrently, with retries and within the API's rate limit.  Requests
+ * are copied on submit.  Clients and requests may be used from any
+ * thread; a single request must not be changed from two at once.
+ * Callbacks run on the I/O thread: they may submit more requests but must
+ * not block, and must not call cprowl_client_send().
+ *
+ * cprowl_client_submit() takes no lock and allocates nothing: requests
+ * are copied into a ring of queue_size slots made with the client (2KB
+ * each; larger requests are copied to the heap instead).  When sending
+ * falls behind and the ring is full, queue_full decides: the new request
+ * is dropped, the caller waits for room, or the oldest queued request is
+ * dropped to make room.  A dropped request's callback gets CPROWL_DROPPED
+ * and a NULL request, from the submitting thread, under either policy;
+ * when it is the new one, cprowl_client_submit() also returns FALSE.
+ *
+ * Results are a CURLcode and the HTTP status: CURLE_OK with 200 is
+ * success, and cprowl_result_string() describes any other outcome.
+ */
+
+#include <curl/curl.h>
+#include <stddef.h>
+
+/* libcprowl.so is built with hidden visibility; only these are exported */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define CPROWL_API __attribute__((visibility("default")))
+#else
+#define CPROWL_API
+#endif
+
+#define CPROWL_FIELD_APP         0
+#define CPROWL_FIELD_EVENT       1
+#define CPROWL_FIELD_DESCRIPTION 2
+#define CPROWL_FIELD_PRIORITY    3
+#define CPROWL_NFIELDS           4
+
+/* what cprowl_client_submit() does when the queue is full */
+#define CPROWL_QUEUE_DROP      0        /* drop the new request */
+#define CPROWL_QUEUE_BLOCK     1        /* wait for room */
+#define CPROWL_QUEUE_OVERWRITE 2        /* drop the oldest queued one */
+
+/* the result of a request dropped from a full queue */
+#define CPROWL_DROPPED CURLE_ABORTED_BY_CALLBACK
+
+typedef struct cprowl_add_request cprowl_add_request_t;
+typedef struct cprowl_client cprowl_client_t;
+
+/* req is the client's copy and is freed once the callback returns; NULL
+ * for a request that was dropped */
+typedef void (*cprowl_client_cb)(cprowl_add_request_t *req, CURLcode res,
+                                 int http_error_code, void *arg);
+
+typedef struct {
+    const char *url;            /* endpoint, the Prowl API by default */
+    int concurrency;            /* requests in flight at once */
+    int retries;                /* after a network error, 5xx or 406 */
+    long retry_deadline_ms;     /* no retry starts later than this */
+    const char *cacert;         /* CA bundle, or NULL for curl's */
+    int debug;                  /* curl's verbose output on stderr */
+    size_t queue_size;          /* requests queued before queue_full */
+    int queue_full;             /* CPROWL_QUEUE_*, BLOCK by default */
+} cprowl_client_config_t;
+
+/* Requests */
+CPROWL_API cprowl_add_request_t* cprowl_request_new(void);
+CPROWL_API void cprowl_request_destroy(cprowl_add_request_t *req);
+CPROWL_API int  cprowl_request_add_apikey(cprowl_add_request_t *req,
+                                          const char *apikey);
+CPROWL_API int  cprowl_request_set(cprowl_add_request_t *req, int field,
+                                   const char *value, size_t len);
+CPROWL_API const char* cprowl_request_get(cprowl_add_request_t *req,
+                                          int field);
+
+/* Clients */
+CPROWL_API void cprowl_client_config_init(cprowl_client_config_t *config);
+CPROWL_API cprowl_client_t*
+           cprowl_client_new(const cprowl_client_config_t *config);
+CPROWL_API CURLcode cprowl_client_send(cprowl_client_t *client,
+                                       cprowl_add_request_t *req,
+                                       int *http_error_code);
+CPROWL_API int  cprowl_client_submit(cprowl_client_t *client,
+                                     cprowl_add_request_t *req,
+                                     cprowl_client_cb cb, void *arg);
+CPROWL_API void cprowl_client_flush(cprowl_client_t *client);
+CPROWL_API void cprowl_client_free(cprowl_client_t *client);
+
+CPROWL_API const char* cprowl_result_string(CURLcode res, int http_error_code,
+                                            char *buf, size_t len);
+
+#endif
@@ -0,0 +1,227 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "cprowl.h"
+
+/*
+ * Fixed string matching for --watch: every pattern is found in one pass
+ * with an Aho-Corasick automaton compiled to a DFA.  Bytes that occur in no
+ * pattern share one input class, which keeps the table small, and table
+ * entries are premultiplied row offsets with the top bit set on states that
+ * end a match, so the inner loop is one load and one test per byte.
+ *
+ * Log text mostly leaves the automaton in its start state.  From there
+ * only the start of some pattern can make progress, so the scanner jumps
+ * straight to the next position holding the first two bytes of a pattern,
+ * comparing 16 positions at a time with SSE2 when there are few enough
+ * distinct pairs.  Pairs are far rarer in text than single bytes.
+ */
+
+#define MATCH_FLAG 0x80000000u
+#define MATCH_PREFILTER_MAX 8
+
+int
+cprowl_matcher_init(cprowl_matcher_t *m, char *const patterns[],
+                    size_t npatterns)
+{
+    uint32_t *delta = NULL, *fail = NULL, *out = NULL, *queue = NULL;
+    uint32_t nstates = 1, max = 1, head = 0, tail = 0, s, t;
+    size_t i;
+    int c, rc = FALSE;
+
+    memset(m, 0, sizeof(*m));
+
+    for (i = 0; i < npatterns; i++) {
+        if (patterns[i][0] == '\0' || strchr(patterns[i], '\n')) {
+            fprintf(stderr, "invalid pattern \"%s\"\n", patterns[i]);
+            return FALSE;
+        }
+        max += strlen(patterns[i]);
+    }
+
+    /* the trie, with a full row per state while building */
+    if ((delta = calloc((size_t) max * 256, sizeof(*delta))) == NULL ||
+        (fail = calloc(max, sizeof(*fail))) == NULL ||
+        (out = calloc(max, sizeof(*out))) == NULL ||
+        (queue = malloc(max * sizeof(*queue))) == NULL) {
+        goto done;
+    }
+    for (i = 0; i < npatterns; i++) {
+        const unsigned char *p = (const unsigned char *) patterns[i];
+        unsigned k;
+
+        for (k = 0; k < m->npairs && k < MATCH_PREFILTER_MAX; k++) {
+            if (m->pairs[k][0] == p[0] && m->pairs[k][1] == p[1]) {
+                break;
+            }
+        }
+        if (k == m->npairs) {
+            if (k < MATCH_PREFILTER_MAX) {
+                m->pairs[k][0] = p[0];
+                m->pairs[k][1] = p[1];
+                if (p[1] == '\0') {
+                    m->pair_any |= 1 << k;
+                }
+            }
+            m->npairs++;
+        }
+
+        for (s = 0; *p; p++) {
+            if (m->cls[*p] == 0) {
+                m->cls[*p] = ++m->nclasses;
+            }
+            if (delta[s * 256 + *p] == 0) {
+                delta[s * 256 + *p] = nstates++;
+            }
+            s = delta[s * 256 + *p];
+        }
+        if (out[s] == 0) {
+            out[s] = (uint32_t) i + 1;
+        }
+    }
+    m->nclasses++;      /* class 0: bytes in no pattern */
+
+    /* breadth first: fail links, then fill in the missing transitions */
+    for (c = 0; c < 256; c++) {
+        if ((t = delta[c]) != 0) {
+            queue[tail++] = t;
+            m->start[c] = 1;
+        }
+    }
+    while (head < tail) {
+        s = queue[head++];
+        for (c = 0; c < 256; c++) {
+            if ((t = delta[s * 256 + c]) != 0) {
+                fail[t] = delta[fail[s] * 256 + c];
+                if (out[t] == 0) {
+                    out[t] = out[fail[t]];
+                }
+                queue[tail++] = t;
+            } else {
+                delta[s * 256 + c] = delta[fail[s] * 256 + c];
+            }
+        }
+    }
+
+    /* compact to one row per state and class */
+    if ((uint64_t) nstates * m->nclasses >= MATCH_FLAG) {
+        fprintf(stderr, "too many patterns\n");
+        goto done;
+    }
+    if ((m->next = malloc((size_t) nstates * m->nclasses *
+                          sizeof(*m->next))) == NULL ||
+        (m->out = malloc(nstates * sizeof(*m->out))) == NULL) {
+        goto done;
+    }
+    for (s = 0; s < nstates; s++) {
+        for (c = 0; c < 256; c++) {
+            t = delta[s * 256 + c];
+            m->next[s * m->nclasses + m->cls[c]] =
+                t * m->nclasses | (out[t] ? MATCH_FLAG : 0);
+        }
+        m->out[s] = out[s];
+    }
+    m->nstates = nstates;
+    rc = TRUE;
+
+done:
+    if (!rc) {
+        cprowl_matcher_cleanup(m);
+    }
+    free(delta);
+    free(fail);
+    free(out);
+    free(queue);
+    return rc;
+}
+
+void
+cprowl_matcher_cleanup(cprowl_matcher_t *m)
+{
+    free(m->next);
+    free(m->out);
+    m->next = NULL;
+    m->out = NULL;
+}
+
+/* index of the next position at or after i that can start a pattern */
+static size_t
+match_skip(const cprowl_matcher_t *m, const unsigned char *p, size_t i,
+           size_t len)
+{
+#ifdef __SSE2__
+    if (m->npairs <= MATCH_PREFILTER_MAX) {
+        __m128i first[MATCH_PREFILTER_MAX], second[MATCH_PREFILTER_MAX];
+        unsigned k;
+
+        for (k = 0; k < m->npairs; k++) {
+            first[k] = _mm_set1_epi8((char) m->pairs[k][0]);
+            second[k] = (m->pair_any & (1 << k)) ? _mm_set1_epi8(-1) :
+                        _mm_set1_epi8((char) m->pairs[k][1]);
+        }
+        /* the second load reads one byte past the first */
+        for (; i + 17 <= len; i += 16) {
+            __m128i b0 = _mm_loadu_si128((const __m128i *) (p + i));
+            __m128i b1 = _mm_loadu_si128((const __m128i *) (p + i + 1));
+            __m128i hit = _mm_setzero_si128();
+            int mask;
+
+            for (k = 0; k < m->npairs; k++) {
+                __m128i h0 = _mm_cmpeq_epi8(b0, first[k]);
+                __m128i h1 = (m->pair_any & (1 << k)) ? second[k] :
+                             _mm_cmpeq_epi8(b1, second[k]);
+                hit = _mm_or_si128(hit, _mm_and_si128(h0, h1));
+            }
+            if ((mask = _mm_movemask_epi8(hit)) != 0) {
+                return i + __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+    while (i < len && !m->start[p[i]]) {
+        i++;
+    }
+    return i;
+}
+
+long
+cprowl_matcher_find(const cprowl_matcher_t *m, const char *text, size_t len,
+                    unsigned *which)
+{
+    const unsigned char *p = (const unsigned char *) text;
+    const uint32_t *next = m->next;
+    const unsigned char *cls = m->cls;
+    uint32_t s = 0;
+    size_t i = 0;
+
+    while (i < len) {
+        if (s == 0 && (i = match_skip(m, p, i, len)) == len) {
+            break;
+        }
+        s = next[s + cls[p[i++]]];
+        if (s & MATCH_FLAG) {
+            s &= ~MATCH_FLAG;
+            *which = m->out[s / m->nclasses] - 1;
+            return (long) i;
+        }
+    }
+    return -1;
+}
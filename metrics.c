@@ -0,0 +1,483 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * Every engine keeps counters and two latency histograms (see cprowl.h).
+ * The hot path only ever bumps a counter and a bucket, with no locks and
+ * no allocation; the work of turning them into quantiles and text is done
+ * here, when someone asks.  Gauges (queue depth, transfers in flight,
+ * retries waiting, rate limit) are read straight from the engine, so they
+ * must be rendered on the engine's own thread, as the daemon does.
+ *
+ * Two renderings: a short human summary per backend, and the Prometheus
+ * text format, with the backend as a label and the histograms mapped onto
+ * fixed "le" buckets.
+ */
+
+#define METRICS_MAX_US ((1ULL << 36) - 1)
+
+/* le bounds of the Prometheus histograms, in seconds */
+static const double metrics_le[] = {
+    0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5,
+    1, 2.5, 5, 10, 30, 60
+};
+
+#define METRICS_NLE (sizeof(metrics_le) / sizeof(metrics_le[0]))
+
+static unsigned
+histogram_index(uint64_t us)
+{
+    unsigned e;
+
+    if (us < (1 << CPROWL_HIST_SUB_BITS)) {
+        return (unsigned) us;
+    }
+    if (us > METRICS_MAX_US) {
+        us = METRICS_MAX_US;
+    }
+    e = 63 - __builtin_clzll(us);
+    return ((e - CPROWL_HIST_SUB_BITS + 1) << CPROWL_HIST_SUB_BITS) +
+           (unsigned) ((us >> (e - CPROWL_HIST_SUB_BITS)) &
+                       ((1 << CPROWL_HIST_SUB_BITS) - 1));
+}
+
+/* smallest value that falls in bucket i */
+static uint64_t
+histogram_lower(unsigned i)
+{
+    unsigned e, sub = 1 << CPROWL_HIST_SUB_BITS;
+
+    if (i < sub) {
+        return i;
+    }
+    e = (i >> CPROWL_HIST_SUB_BITS) + CPROWL_HIST_SUB_BITS - 1;
+    return (uint64_t) (sub + (i & (sub - 1))) << (e - CPROWL_HIST_SUB_BITS);
+}
+
+void
+cprowl_histogram_record(cprowl_histogram_t *h, uint64_t us)
+{
+    CPROWL_METRICS_ADD(h->counts[histogram_index(us)], 1);
+    CPROWL_METRICS_ADD(h->count, 1);
+    CPROWL_METRICS_ADD(h->sum, us);
+    if (us > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max, us, __ATOMIC_RELAXED);
+    }
+}
+
+/* the value at quantile q, as the top of its bucket; 0 when empty */
+uint64_t
+cprowl_histogram_quantile(const cprowl_histogram_t *h, double q)
+{
+    uint64_t total = 0, seen = 0, rank, max;
+    unsigned i;
+
+    for (i = 0; i < CPROWL_HIST_BUCKETS; i++) {
+        total += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+    if (total == 0) {
+        return 0;
+    }
+    rank = (uint64_t) (q * total + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    for (i = 0; i < CPROWL_HIST_BUCKETS; i++) {
+        seen += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+        if (seen >= rank) {
+            uint64_t top = i + 1 < CPROWL_HIST_BUCKETS ?
+                           histogram_lower(i + 1) - 1 : METRICS_MAX_US;
+            return top < max ? top : max;
+        }
+    }
+    return max;
+}
+
+/* how many values were at most us; a bucket straddling us counts as
+ * below it, so the answer is off by at most one bucket's width */
+uint64_t
+cprowl_histogram_below(const cprowl_histogram_t *h, uint64_t us)
+{
+    uint64_t n = 0;
+    unsigned i, last = histogram_index(us);
+
+    for (i = 0; i <= last; i++) {
+        n += __atomic_load_n(&h->counts[i], __ATOMIC_RELAXED);
+    }
+    return n;
+}
+
+/* count what came back from one HTTP request and how long it took */
+void
+cprowl_metrics_response(cprowl_metrics_t *m, CURL *curl, CURLcode res,
+                        int http_error_code)
+{
+    curl_off_t us = 0;
+    int class;
+
+    if (res != CURLE_OK) {
+        class = 3;
+    } else if (http_error_code >= 200 && http_error_code < 300) {
+        class = 0;
+    } else if (http_error_code >= 400 && http_error_code < 500) {
+        class = 1;
+    } else {
+        class = 2;
+    }
+    CPROWL_METRICS_ADD(m->responses[class], 1);
+
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &us);
+    if (us > 0) {
+        cprowl_histogram_record(&m->request, (uint64_t) us);
+    }
+}
+
+static int
+metrics_printf(cprowl_buf_t *out, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        size_t room = out->cap > out->len ? out->cap - out->len : 0;
+
+        va_start(ap, fmt);
+        n = vsnprintf(out->data ? out->data + out->len : NULL, room, fmt, ap);
+        va_end(ap);
+        if (n < 0) {
+            return FALSE;
+        }
+        if ((size_t) n < room) {
+            out->len += n;
+            return TRUE;
+        }
+        if (!cprowl_buf_reserve(out, n)) {
+            return FALSE;
+        }
+    }
+}
+
+static uint64_t
+metrics_load(const uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+/* the Prowl engine and its webhook peers, each with its label */
+static const cprowl_engine_t*
+metrics_engine(const cprowl_engine_t *engine, size_t i, const char **name)
+{
+    if (i == 0) {
+        *name = "prowl";
+        return engine;
+    }
+    *name = engine->peers[i - 1].backend->name;
+    return &engine->peers[i - 1];
+}
+
+static int
+metrics_text_latency(cprowl_buf_t *out, const char *label,
+                     const cprowl_histogram_t *h)
+{
+    uint64_t n = metrics_load(&h->count);
+
+    if (n == 0) {
+        return metrics_printf(out, "  %-9s -\n", label);
+    }
+    return metrics_printf(out, "  %-9s p50 %.1fms  p90 %.1fms  p99 %.1fms  "
+                          "max %.1fms  mean %.1fms\n", label,
+                          cprowl_histogram_quantile(h, 0.5) / 1000.0,
+                          cprowl_histogram_quantile(h, 0.9) / 1000.0,
+                          cprowl_histogram_quantile(h, 0.99) / 1000.0,
+                          metrics_load(&h->max) / 1000.0,
+                          metrics_load(&h->sum) / 1000.0 / n);
+}
+
+static int
+metrics_text(cprowl_buf_t *out, const cprowl_engine_t *e, const char *name)
+{
+    const cprowl_metrics_t *m = &e->metrics;
+    int ok;
+
+    ok = metrics_printf(out, "%s\n", name) &&
+         metrics_printf(out, "  queued %zu  in flight %d  retrying %zu\n",
+                        e->npending, e->inflight, e->retries.count) &&
+         metrics_printf(out, "  submitted %llu  succeeded %llu  failed %llu  "
+                        "retried %llu  rejected %llu\n",
+                        (unsigned long long) metrics_load(&m->submitted),
+                        (unsigned long long) metrics_load(&m->succeeded),
+                        (unsigned long long) metrics_load(&m->failed),
+                        (unsigned long long) metrics_load(&m->retried),
+                        (unsigned long long) metrics_load(&m->rejected)) &&
+         metrics_printf(out, "  responses 2xx %llu  4xx %llu  5xx %llu  "
+                        "error %llu\n",
+                        (unsigned long long) metrics_load(&m->responses[0]),
+                        (unsigned long long) metrics_load(&m->responses[1]),
+                        (unsigned long long) metrics_load(&m->responses[2]),
+                        (unsigned long long) metrics_load(&m->responses[3]));
+    if (ok && e->limiter.known) {
+        long left = (long) (e->limiter.resetdate - time(NULL));
+
+        ok = metrics_printf(out, "  ratelimit %ld remaining, %.0f to burst, "
+                            "resets in %lds\n", e->limiter.remaining,
+                            e->limiter.tokens, left > 0 ? left : 0);
+    }
+    return ok &&
+           metrics_text_latency(out, "request", &m->request) &&
+           metrics_text_latency(out, "delivery", &m->delivery);
+}
+
+static int
+metrics_help(cprowl_buf_t *out, const char *metric, const char *type,
+             const char *help)
+{
+    return metrics_printf(out, "# HELP cprowl_%s %s\n# TYPE cprowl_%s %s\n",
+                          metric, help, metric, type);
+}
+
+/* one counter or gauge, a sample per backend; field is the offset of a
+ * uint64_t in cprowl_metrics_t */
+static int
+metrics_prom_counter(cprowl_buf_t *out, const cprowl_engine_t *engine,
+                     const char *metric, const char *help, size_t field)
+{
+    size_t i;
+
+    if (!metrics_help(out, metric, "counter", help)) {
+        return FALSE;
+    }
+    for (i = 0; i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+        const uint64_t *p = (const uint64_t *) ((const char *) &e->metrics +
+                                                field);
+
+        if (!metrics_printf(out, "cprowl_%s{backend=\"%s\"} %llu\n", metric,
+                            name, (unsigned long long) metrics_load(p))) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int
+metrics_prom_histogram(cprowl_buf_t *out, const cprowl_engine_t *engine,
+                       const char *metric, const char *help, size_t field)
+{
+    size_t i, j;
+
+    if (!metrics_help(out, metric, "histogram", help)) {
+        return FALSE;
+    }
+    for (i = 0; i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+        const cprowl_histogram_t *h = (const cprowl_histogram_t *)
+                                      ((const char *) &e->metrics + field);
+        uint64_t total = cprowl_histogram_below(h, METRICS_MAX_US);
+
+        for (j = 0; j < METRICS_NLE; j++) {
+            if (!metrics_printf(out, "cprowl_%s_bucket{backend=\"%s\","
+                                "le=\"%g\"} %llu\n", metric, name,
+                                metrics_le[j], (unsigned long long)
+                                cprowl_histogram_below(h, (uint64_t)
+                                    (metrics_le[j] * 1000000)))) {
+                return FALSE;
+            }
+        }
+        /* _count matches +Inf even while the engine is writing */
+        if (!metrics_printf(out, "cprowl_%s_bucket{backend=\"%s\","
+                            "le=\"+Inf\"} %llu\n"
+                            "cprowl_%s_sum{backend=\"%s\"} %.6f\n"
+                            "cprowl_%s_count{backend=\"%s\"} %llu\n",
+                            metric, name, (unsigned long long) total,
+                            metric, name, metrics_load(&h->sum) / 1e6,
+                            metric, name, (unsigned long long) total)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+static int
+metrics_prometheus(cprowl_buf_t *out, const cprowl_engine_t *engine)
+{
+    size_t i;
+    int ok;
+
+#define METRICS_FIELD(f) offsetof(cprowl_metrics_t, f)
+    ok = metrics_prom_counter(out, engine, "submitted_total",
+                              "Sends queued, one per shard.",
+                              METRICS_FIELD(submitted)) &&
+         metrics_prom_counter(out, engine, "succeeded_total",
+                              "Sends delivered.",
+                              METRICS_FIELD(succeeded)) &&
+         metrics_prom_counter(out, engine, "failed_total",
+                              "Sends given up on, after any retries.",
+                              METRICS_FIELD(failed)) &&
+         metrics_prom_counter(out, engine, "retried_total",
+                              "Retries scheduled after a transient failure.",
+                              METRICS_FIELD(retried)) &&
+         metrics_prom_counter(out, engine, "rejected_total",
+                              "Requests refused because the queue was full.",
+                              METRICS_FIELD(rejected)) &&
+         metrics_help(out, "responses_total", "counter",
+                      "HTTP requests by status class.");
+    for (i = 0; ok && i <= engine->npeers; i++) {
+        static const char *classes[] = { "2xx", "4xx", "5xx", "error" };
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+        int c;
+
+        for (c = 0; ok && c < 4; c++) {
+            ok = metrics_printf(out, "cprowl_responses_total{backend=\"%s\","
+                                "class=\"%s\"} %llu\n", name, classes[c],
+                                (unsigned long long)
+                                metrics_load(&e->metrics.responses[c]));
+        }
+    }
+
+    ok = ok && metrics_help(out, "queued", "gauge",
+                            "Sends waiting for a transfer slot.");
+    for (i = 0; ok && i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+
+        ok = metrics_printf(out, "cprowl_queued{backend=\"%s\"} %zu\n",
+                            name, e->npending);
+    }
+    ok = ok && metrics_help(out, "inflight", "gauge",
+                            "HTTP requests in flight.");
+    for (i = 0; ok && i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+
+        ok = metrics_printf(out, "cprowl_inflight{backend=\"%s\"} %d\n",
+                            name, e->inflight);
+    }
+    ok = ok && metrics_help(out, "retrying", "gauge",
+                            "Sends waiting to be tried again.");
+    for (i = 0; ok && i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+
+        ok = metrics_printf(out, "cprowl_retrying{backend=\"%s\"} %zu\n",
+                            name, e->retries.count);
+    }
+
+    /* only backends whose budget is known */
+    ok = ok && metrics_help(out, "ratelimit_remaining", "gauge",
+                            "Calls left before the rate limit resets.");
+    for (i = 0; ok && i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+
+        if (e->limiter.known) {
+            ok = metrics_printf(out, "cprowl_ratelimit_remaining"
+                                "{backend=\"%s\"} %ld\n", name,
+                                e->limiter.remaining);
+        }
+    }
+    ok = ok && metrics_help(out, "ratelimit_reset_seconds", "gauge",
+                            "When the rate limit resets, as a unix time.");
+    for (i = 0; ok && i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+
+        if (e->limiter.known && e->limiter.resetdate > 0) {
+            ok = metrics_printf(out, "cprowl_ratelimit_reset_seconds"
+                                "{backend=\"%s\"} %lld\n", name,
+                                (long long) e->limiter.resetdate);
+        }
+    }
+
+    return ok &&
+           metrics_prom_histogram(out, engine, "request_seconds",
+                                  "Time taken by one HTTP request.",
+                                  METRICS_FIELD(request)) &&
+           metrics_prom_histogram(out, engine, "delivery_seconds",
+                                  "Time from queueing to the final outcome.",
+                                  METRICS_FIELD(delivery));
+#undef METRICS_FIELD
+}
+
+/* append the metrics of engine and its webhook peers to out */
+int
+cprowl_metrics_render(cprowl_buf_t *out, const cprowl_engine_t *engine,
+                      int format)
+{
+    size_t i;
+
+    if (format == CPROWL_STATS_PROMETHEUS) {
+        return metrics_prometheus(out, engine);
+    }
+    for (i = 0; i <= engine->npeers; i++) {
+        const char *name;
+        const cprowl_engine_t *e = metrics_engine(engine, i, &name);
+
+        if (!metrics_text(out, e, name)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* replace path with the Prometheus rendering, so a collector reading it
+ * never sees half a file */
+int
+cprowl_metrics_write(const char *path, const cprowl_engine_t *engine)
+{
+    cprowl_buf_t buf;
+    char tmp[512];
+    FILE *fp;
+    int rc = FALSE;
+
+    cprowl_buf_init(&buf);
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+
+    if (!cprowl_metrics_render(&buf, engine, CPROWL_STATS_PROMETHEUS)) {
+        fprintf(stderr, "out of memory\n");
+        goto done;
+    }
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+        goto done;
+    }
+    rc = fwrite(buf.data, 1, buf.len, fp) == buf.len;
+    if (fclose(fp) != 0 || !rc) {
+        rc = FALSE;
+        perror(tmp);
+        unlink(tmp);
+        goto done;
+    }
+    if (rename(tmp, path) < 0) {
+        rc = FALSE;
+        perror(path);
+        unlink(tmp);
+    }
+
+done:
+    cprowl_buf_free(&buf);
+    return rc;
+}
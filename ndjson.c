@@ -0,0 +1,312 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "cprowl.h"
+
+/*
+ * Minimal decoder for the flat JSON objects accepted by batch mode:
+ *
+ *   {"app": "..", "event": "..", "description": "..", "priority": 1,
+ *    "apikeys": ["key1", "key2"]}
+ *
+ * Strings are unescaped in place, so the line buffer is modified.  Fields
+ * that are missing keep the values already present in the request; an
+ * "apikey"/"apikeys" field replaces any keys already present.
+ */
+
+typedef struct {
+    char *p;
+    char *end;
+} ndjson_t;
+
+static void
+ndjson_ws(ndjson_t *js)
+{
+    while (js->p < js->end &&
+           (*js->p == ' ' || *js->p == '\t' || *js->p == '\r' || *js->p == '\n')) {
+        js->p++;
+    }
+}
+
+static int
+ndjson_expect(ndjson_t *js, char c)
+{
+    ndjson_ws(js);
+    if (js->p < js->end && *js->p == c) {
+        js->p++;
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static int
+ndjson_hex4(const char *p, unsigned *cp)
+{
+    int i;
+
+    *cp = 0;
+    for (i = 0; i < 4; i++) {
+        char c = p[i];
+        *cp <<= 4;
+        if (c >= '0' && c <= '9') *cp |= c - '0';
+        else if (c >= 'a' && c <= 'f') *cp |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *cp |= c - 'A' + 10;
+        else return FALSE;
+    }
+    return TRUE;
+}
+
+static char*
+ndjson_utf8(char *out, unsigned cp)
+{
+    if (cp < 0x80) {
+        *out++ = (char) cp;
+    } else if (cp < 0x800) {
+        *out++ = (char) (0xc0 | (cp >> 6));
+        *out++ = (char) (0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+        *out++ = (char) (0xe0 | (cp >> 12));
+        *out++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char) (0x80 | (cp & 0x3f));
+    } else {
+        *out++ = (char) (0xf0 | (cp >> 18));
+        *out++ = (char) (0x80 | ((cp >> 12) & 0x3f));
+        *out++ = (char) (0x80 | ((cp >> 6) & 0x3f));
+        *out++ = (char) (0x80 | (cp & 0x3f));
+    }
+    return out;
+}
+
+/* parse a string, unescaping it in place; *str is nul terminated */
+static int
+ndjson_string(ndjson_t *js, char **str, size_t *len)
+{
+    char *out;
+
+    if (!ndjson_expect(js, '"')) {
+        return FALSE;
+    }
+
+    *str = out = js->p;
+    while (js->p < js->end && *js->p != '"') {
+        char c = *js->p++;
+        unsigned cp, lo;
+
+        if (c != '\\') {
+            *out++ = c;
+            continue;
+        }
+        if (js->p >= js->end) {
+            return FALSE;
+        }
+        switch ((c = *js->p++)) {
+        case 'b': *out++ = '\b'; break;
+        case 'f': *out++ = '\f'; break;
+        case 'n': *out++ = '\n'; break;
+        case 'r': *out++ = '\r'; break;
+        case 't': *out++ = '\t'; break;
+        case 'u':
+            if (js->end - js->p < 4 || !ndjson_hex4(js->p, &cp)) {
+                return FALSE;
+            }
+            js->p += 4;
+            /* surrogate pair */
+            if (cp >= 0xd800 && cp < 0xdc00 && js->end - js->p >= 6 &&
+                js->p[0] == '\\' && js->p[1] == 'u' &&
+                ndjson_hex4(js->p + 2, &lo) && lo >= 0xdc00 && lo < 0xe000) {
+                cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                js->p += 6;
+            }
+            out = ndjson_utf8(out, cp);
+            break;
+        default:
+            *out++ = c;
+            break;
+        }
+    }
+
+    if (js->p >= js->end) {
+        return FALSE;
+    }
+    js->p++;
+    *len = out - *str;
+    *out = '\0';
+    return TRUE;
+}
+
+/* skip any value; used for unknown fields */
+static int
+ndjson_skip(ndjson_t *js)
+{
+    char *str;
+    size_t len;
+    int depth = 0;
+
+    ndjson_ws(js);
+    if (js->p >= js->end) {
+        return FALSE;
+    }
+
+    if (*js->p == '"') {
+        return ndjson_string(js, &str, &len);
+    }
+
+    if (*js->p != '{' && *js->p != '[') {
+        while (js->p < js->end && *js->p != ',' && *js->p != '}' &&
+               *js->p != ']') {
+            js->p++;
+        }
+        return TRUE;
+    }
+
+    do {
+        ndjson_ws(js);
+        if (js->p >= js->end) {
+            return FALSE;
+        }
+        if (*js->p == '"') {
+            if (!ndjson_string(js, &str, &len)) {
+                return FALSE;
+            }
+            continue;
+        }
+        if (*js->p == '{' || *js->p == '[') {
+            depth++;
+        } else if (*js->p == '}' || *js->p == ']') {
+            depth--;
+        }
+        js->p++;
+    } while (depth > 0);
+
+    return TRUE;
+}
+
+static int
+ndjson_apikeys(ndjson_t *js, cprowl_add_request_t *req)
+{
+    char *str;
+    size_t len;
+
+    ndjson_ws(js);
+    if (js->p < js->end && *js->p == '"') {
+        /* a single string may hold a comma separated list */
+        char *key, *comma;
+        if (!ndjson_string(js, &str, &len)) {
+            return FALSE;
+        }
+        for (key = str; *key; key = comma + 1) {
+            if ((comma = strchr(key, ',')) == NULL) {
+                return cprowl_request_add_apikey(req, key);
+            }
+            *comma = '\0';
+            if (!cprowl_request_add_apikey(req, key)) {
+                return FALSE;
+            }
+        }
+        return TRUE;
+    }
+
+    if (!ndjson_expect(js, '[')) {
+        return FALSE;
+    }
+    if (ndjson_expect(js, ']')) {
+        return TRUE;
+    }
+    do {
+        if (!ndjson_string(js, &str, &len) ||
+            !cprowl_request_add_apikey(req, str)) {
+            return FALSE;
+        }
+    } while (ndjson_expect(js, ','));
+
+    return ndjson_expect(js, ']');
+}
+
+int
+cprowl_ndjson_decode(cprowl_add_request_t *req, char *line, size_t len)
+{
+    ndjson_t js;
+    int keys_replaced = FALSE;
+
+    js.p = line;
+    js.end = line + len;
+
+    if (!ndjson_expect(&js, '{')) {
+        return FALSE;
+    }
+    if (ndjson_expect(&js, '}')) {
+        return TRUE;
+    }
+
+    do {
+        char *name, *value;
+        size_t name_len, value_len;
+        int field;
+
+        if (!ndjson_string(&js, &name, &name_len) ||
+            !ndjson_expect(&js, ':')) {
+            return FALSE;
+        }
+
+        if (strcmp(name, "apikey") == 0 || strcmp(name, "apikeys") == 0) {
+            if (!keys_replaced) {
+                cprowl_request_clear_keys(req);
+                keys_replaced = TRUE;
+            }
+            if (!ndjson_apikeys(&js, req)) {
+                return FALSE;
+            }
+            continue;
+        }
+
+        ndjson_ws(&js);
+        if (strcmp(name, "priority") == 0 && js.p < js.end && *js.p != '"') {
+            /* bare number */
+            value = js.p;
+            while (js.p < js.end && (*js.p == '-' || *js.p == '+' ||
+                                     (*js.p >= '0' && *js.p <= '9'))) {
+                js.p++;
+            }
+            if (!cprowl_request_set(req, CPROWL_FIELD_PRIORITY,
+                                    value, js.p - value)) {
+                return FALSE;
+            }
+            continue;
+        }
+
+        if (strcmp(name, "app") == 0 || strcmp(name, "application") == 0) {
+            field = CPROWL_FIELD_APP;
+        } else if (strcmp(name, "event") == 0) {
+            field = CPROWL_FIELD_EVENT;
+        } else if (strcmp(name, "description") == 0) {
+            field = CPROWL_FIELD_DESCRIPTION;
+        } else if (strcmp(name, "priority") == 0) {
+            field = CPROWL_FIELD_PRIORITY;
+        } else {
+            if (!ndjson_skip(&js)) {
+                return FALSE;
+            }
+            continue;
+        }
+        if (!ndjson_string(&js, &value, &value_len) ||
+            !cprowl_request_set(req, field, value, value_len)) {
+            return FALSE;
+        }
+    } while (ndjson_expect(&js, ','));
+
+    return ndjson_expect(&js, '}');
+}
@@ -0,0 +1,173 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include "cprowl.h"
+
+/*
+ * Token bucket driven by the API's own accounting.  Every response reports
+ * how many calls remain and when the counter resets.  Up to a quarter of
+ * what remains may go out as a burst; the rest refills evenly until the
+ * reset, so tokens plus refill never exceed the remaining quota and the
+ * whole quota can be used without running into the limit.  Until the first
+ * response arrives nothing is known and sends are not paced.
+ *
+ * Sends below CPROWL_PRIORITY_HIGH leave a share of the bucket untouched,
+ * so a page still has budget while routine traffic is being paced.
+ */
+
+#define RATELIMIT_BURST_MIN 10.0
+#define RATELIMIT_RESERVE 0.2     /* of the bucket, for high priority */
+#define RATELIMIT_BACKOFF  60     /* seconds to pause after a 406 */
+
+void
+cprowl_ratelimit_init(cprowl_ratelimit_t *rl)
+{
+    rl->known = FALSE;
+    rl->tokens = 0;
+    rl->capacity = 0;
+    rl->rate = 0;
+    rl->last = 0;
+    rl->remaining = -1;
+    rl->resetdate = 0;
+}
+
+static void
+ratelimit_refill(cprowl_ratelimit_t *rl, long long now)
+{
+    if (rl->known && time(NULL) >= rl->resetdate) {
+        /* a new period started; wait for fresh numbers */
+        rl->known = FALSE;
+    }
+    if (!rl->known) {
+        return;
+    }
+    if (now > rl->last) {
+        rl->tokens += (now - rl->last) * rl->rate;
+        if (rl->tokens > rl->capacity) {
+            rl->tokens = rl->capacity;
+        }
+    }
+    rl->last = now;
+}
+
+void
+cprowl_ratelimit_update(cprowl_ratelimit_t *rl, cprowl_response_t *resp,
+                        int http_error_code, int debug)
+{
+    long long now = cprowl_now_ms();
+    time_t wall = time(NULL);
+    long period;
+    int was_known = rl->known;
+
+    if (http_error_code == 406) {
+        /* over the limit already; stop until the counter resets */
+        rl->known = TRUE;
+        rl->remaining = 0;
+        if (rl->resetdate <= wall) {
+            rl->resetdate = wall + RATELIMIT_BACKOFF;
+        }
+    } else if (resp->parsed && resp->remaining >= 0 && resp->resetdate > 0) {
+        rl->known = TRUE;
+        rl->remaining = resp->remaining;
+        rl->resetdate = resp->resetdate;
+    } else {
+        return;
+    }
+
+    period = (long) (rl->resetdate - wall);
+    if (period < 1) {
+        period = 1;
+    }
+
+    rl->capacity = rl->remaining / 4.0;
+    if (rl->capacity < RATELIMIT_BURST_MIN) {
+        rl->capacity = RATELIMIT_BURST_MIN;
+    }
+    if (rl->capacity > rl->remaining) {
+        rl->capacity = (double) rl->remaining;
+    }
+    if (!was_known || rl->tokens > rl->capacity) {
+        rl->tokens = rl->capacity;
+    }
+    rl->rate = (rl->remaining - rl->tokens) / (period * 1000.0);
+    rl->last = now;
+
+    if (debug) {
+        cprowl_ratelimit_print(rl);
+    }
+}
+
+/* take a token for a send of the given priority; returns 0 when the send
+ * may go, otherwise the number of milliseconds until it may */
+long
+cprowl_ratelimit_take(cprowl_ratelimit_t *rl, long long now, int priority)
+{
+    double need = 1.0, wait;
+
+    ratelimit_refill(rl, now);
+    if (!rl->known) {
+        return 0;
+    }
+    if (priority < CPROWL_PRIORITY_HIGH) {
+        need += rl->capacity * RATELIMIT_RESERVE;
+    }
+
+    if (rl->tokens >= need) {
+        rl->tokens -= 1.0;
+        if (rl->remaining > 0) {
+            rl->remaining--;
+        }
+        return 0;
+    }
+
+    if (rl->rate <= 0) {
+        /* nothing left this period */
+        wait = (double) (rl->resetdate - time(NULL)) * 1000.0;
+    } else {
+        wait = (need - rl->tokens) / rl->rate;
+    }
+    return wait < 1 ? 1 : (long) wait;
+}
+
+/* a fixed pace of per_second sends, with bursts of up to a second's
+ * worth, for endpoints that do not report a budget */
+void
+cprowl_ratelimit_fixed(cprowl_ratelimit_t *rl, double per_second)
+{
+    rl->known = TRUE;
+    rl->rate = per_second / 1000.0;
+    /* room for the reserve kept for high priority */
+    rl->capacity = per_second > 2 ? per_second : 2;
+    rl->tokens = rl->capacity;
+    rl->last = cprowl_now_ms();
+    rl->remaining = -1;
+    rl->resetdate = LONG_MAX;
+}
+
+void
+cprowl_ratelimit_print(cprowl_ratelimit_t *rl)
+{
+    if (!rl->known) {
+        fprintf(stderr, "budget: unknown\n");
+        return;
+    }
+    fprintf(stderr, "budget: %ld calls left, reset in %lds, "
+            "pacing %.2f/s, %.1f tokens\n",
+            rl->remaining, (long) (rl->resetdate - time(NULL)),
+            rl->rate * 1000.0, rl->tokens);
+}
@@ -0,0 +1,512 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cprowl.h"
+
+/*
+ * A request keeps its text in one arena: each field is a nul-terminated
+ * span, so a short notification costs its own length rather than the
+ * maximum of every field.  Setting a field appends the new value and
+ * leaves the old one behind; whenever the arena has to grow, only the live
+ * fields are carried over.  New requests point at a shared read-only arena
+ * of defaults and allocate on their first change.
+ *
+ * Keys are interned in a process wide table, so a recipient list repeated
+ * over thousands of queued requests is stored once and each request holds
+ * only pointers.  Duplicates within a request are found by pointer, with a
+ * hashed index once the list is long.  The table and the reference counts
+ * are shared by every thread of a program using libcprowl, so they are
+ * only touched under intern_lock.
+ */
+
+/* arena and keys were allocated separately and may grow in place */
+#define REQUEST_ARENA_OWNED 0x01
+#define REQUEST_KEYS_OWNED  0x02
+
+/* lists up to this long are searched linearly */
+#define KEYSET_LINEAR 16
+
+struct cprowl_keyset {
+    cprowl_key_t **slots;
+    size_t mask;
+};
+
+static const size_t field_max[CPROWL_NFIELDS] = {
+    CPROWL_MAX_LENGTH_APP,
+    CPROWL_MAX_LENGTH_EVENT,
+    CPROWL_MAX_LENGTH_DESC,
+    CPROWL_MAX_LENGTH_PRIORITY
+};
+
+static char default_arena[] = "cprowl\0event\0description\0" "0";
+
+static const cprowl_span_t default_fields[CPROWL_NFIELDS] = {
+    { 0, 6 }, { 7, 5 }, { 13, 11 }, { 25, 1 }
+};
+
+/* the intern table: open addressing, linear probing */
+static cprowl_key_t **interned;
+static size_t interned_mask;
+static size_t interned_used;
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t
+key_hash(const char *api)
+{
+    uint32_t h = 2166136261U;
+    int i;
+
+    for (i = 0; i < CPROWL_MAX_LENGTH_API; i++) {
+        h ^= (unsigned char) api[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static size_t
+intern_find(const char *api, uint32_t hash)
+{
+    size_t i = hash & interned_mask;
+
+    while (interned[i] != NULL &&
+           (interned[i]->hash != hash ||
+            memcmp(interned[i]->api, api, CPROWL_MAX_LENGTH_API) != 0)) {
+        i = (i + 1) & interned_mask;
+    }
+    return i;
+}
+
+static int
+intern_grow(void)
+{
+    cprowl_key_t **old = interned;
+    size_t i, old_size = old ? interned_mask + 1 : 0;
+    size_t size = old_size ? old_size * 2 : 64;
+
+    if ((interned = calloc(size, sizeof(cprowl_key_t *))) == NULL) {
+        interned = old;
+        return FALSE;
+    }
+    interned_mask = size - 1;
+    for (i = 0; i < old_size; i++) {
+        if (old[i]) {
+            interned[intern_find(old[i]->api, old[i]->hash)] = old[i];
+        }
+    }
+    free(old);
+    return TRUE;
+}
+
+static cprowl_key_t*
+key_intern(const char *api)
+{
+    uint32_t hash = key_hash(api);
+    cprowl_key_t *key = NULL;
+    size_t i;
+
+    pthread_mutex_lock(&intern_lock);
+    if ((interned_used + 1) * 2 > (interned ? interned_mask + 1 : 0) &&
+        !intern_grow()) {
+        goto done;
+    }
+
+    i = intern_find(api, hash);
+    if ((key = interned[i]) == NULL) {
+        if ((key = malloc(sizeof(*key))) == NULL) {
+            goto done;
+        }
+        memcpy(key->api, api, CPROWL_MAX_LENGTH_API);
+        key->api[CPROWL_MAX_LENGTH_API] = '\0';
+        key->hash = hash;
+        key->refs = 0;
+        interned[i] = key;
+        interned_used++;
+    }
+    key->refs++;
+
+done:
+    pthread_mutex_unlock(&intern_lock);
+    return key;
+}
+
+/* drop one reference; the last one removes the key, shifting later
+ * members of its probe run back */
+static void
+key_release(cprowl_key_t *key)
+{
+    size_t i, j;
+
+    pthread_mutex_lock(&intern_lock);
+    if (--key->refs > 0) {
+        pthread_mutex_unlock(&intern_lock);
+        return;
+    }
+
+    i = j = intern_find(key->api, key->hash);
+    interned[i] = NULL;
+    interned_used--;
+    free(key);
+
+    for (;;) {
+        size_t home;
+
+        j = (j + 1) & interned_mask;
+        if (interned[j] == NULL) {
+            break;
+        }
+        home = interned[j]->hash & interned_mask;
+        if (((j - home) & interned_mask) >= ((j - i) & interned_mask)) {
+            interned[i] = interned[j];
+            interned[j] = NULL;
+            i = j;
+        }
+    }
+    pthread_mutex_unlock(&intern_lock);
+}
+
+void 
+cprowl_request_add_init(cprowl_add_request_t *req)
+{
+    memset(req, 0, sizeof(*req));
+    req->arena = default_arena;
+    req->arena_len = sizeof(default_arena);
+    req->arena_cap = sizeof(default_arena);
+    memcpy(req->fields, default_fields, sizeof(req->fields));
+}
+
+const char*
+cprowl_request_get(cprowl_add_request_t *req, int field)
+{
+    return req->arena ? req->arena + req->fields[field].off : "";
+}
+
+size_t
+cprowl_request_len(cprowl_add_request_t *req, int field)
+{
+    return req->fields[field].len;
+}
+
+/* move the live fields to a new arena with room for extra more bytes */
+static int
+request_arena_grow(cprowl_add_request_t *req, size_t extra)
+{
+    size_t live = 0, cap;
+    char *arena, *p;
+    int i;
+
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        live += req->fields[i].len + 1;
+    }
+    cap = (live + extra) * 2;
+    if (cap < 256) {
+        cap = 256;
+    }
+    if ((arena = malloc(cap)) == NULL) {
+        return FALSE;
+    }
+
+    p = arena;
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        cprowl_span_t *f = &req->fields[i];
+        memcpy(p, req->arena ? req->arena + f->off : "", f->len + 1);
+        f->off = p - arena;
+        p += f->len + 1;
+    }
+
+    if (req->flags & REQUEST_ARENA_OWNED) {
+        free(req->arena);
+    }
+    req->arena = arena;
+    req->arena_len = p - arena;
+    req->arena_cap = cap;
+    req->flags |= REQUEST_ARENA_OWNED;
+    return TRUE;
+}
+
+/* set a field, truncated to its maximum length; value must not point into
+ * the request itself */
+int
+cprowl_request_set(cprowl_add_request_t *req, int field,
+                   const char *value, size_t len)
+{
+    cprowl_span_t *f = &req->fields[field];
+
+    if (len > field_max[field]) {
+        /* never end in the middle of a UTF-8 sequence */
+        len = field_max[field];
+        while (len > 0 && ((unsigned char) value[len] & 0xc0) == 0x80) {
+            len--;
+        }
+    }
+    if (!(req->flags & REQUEST_ARENA_OWNED) ||
+        req->arena_len + len + 1 > req->arena_cap) {
+        if (!request_arena_grow(req, len + 1)) {
+            return FALSE;
+        }
+    }
+
+    memcpy(req->arena + req->arena_len, value, len);
+    req->arena[req->arena_len + len] = '\0';
+    f->off = req->arena_len;
+    f->len = len;
+    req->arena_len += len + 1;
+    return TRUE;
+}
+
+static size_t
+keyset_slot(struct cprowl_keyset *set, cprowl_key_t *key)
+{
+    size_t i = key->hash & set->mask;
+
+    while (set->slots[i] != NULL && set->slots[i] != key) {
+        i = (i + 1) & set->mask;
+    }
+    return i;
+}
+
+/* index the keys at no more than half load, for nkeys keys */
+static int
+keyset_reserve(cprowl_add_request_t *req, size_t nkeys)
+{
+    struct cprowl_keyset *set = req->keyset;
+    cprowl_key_t **slots;
+    size_t i, size = set ? set->mask + 1 : 64;
+
+    while (size < nkeys * 2) {
+        size <<= 1;
+    }
+    if (set && size == set->mask + 1) {
+        return TRUE;
+    }
+
+    if (set == NULL && (set = calloc(1, sizeof(*set))) == NULL) {
+        return FALSE;
+    }
+    if ((slots = calloc(size, sizeof(cprowl_key_t *))) == NULL) {
+        if (req->keyset == NULL) {
+            free(set);
+        }
+        return FALSE;
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->mask = size - 1;
+    for (i = 0; i < req->nkeys; i++) {
+        set->slots[keyset_slot(set, req->keys[i])] = req->keys[i];
+    }
+    req->keyset = set;
+    return TRUE;
+}
+
+static int
+request_has_key(cprowl_add_request_t *req, cprowl_key_t *key)
+{
+    size_t i;
+
+    if (req->nkeys < KEYSET_LINEAR) {
+        for (i = 0; i < req->nkeys; i++) {
+            if (req->keys[i] == key) {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+    if (!keyset_reserve(req, req->nkeys + 1)) {
+        /* fall back to a scan */
+        for (i = 0; i < req->nkeys; i++) {
+            if (req->keys[i] == key) {
+                return TRUE;
+            }
+        }
+        return FALSE;
+    }
+    return req->keyset->slots[keyset_slot(req->keyset, key)] == key;
+}
+
+/* adding a key that is already present succeeds without duplicating it */
+int
+cprowl_request_add_apikey(cprowl_add_request_t *req, 
+                          const char *apikey)
+{
+    cprowl_key_t *key;
+
+    if (strlen(apikey) != CPROWL_MAX_LENGTH_API) {
+        return FALSE;
+    }
+    if ((key = key_intern(apikey)) == NULL) {
+        return FALSE;
+    }
+    if (request_has_key(req, key)) {
+        key_release(key);
+        return TRUE;
+    }
+
+    if (!(req->flags & REQUEST_KEYS_OWNED) || req->nkeys == req->keys_cap) {
+        uint32_t cap = req->keys_cap < 4 ? 8 : req->keys_cap * 2;
+        cprowl_key_t **keys = malloc(cap * sizeof(cprowl_key_t *));
+
+        if (keys == NULL) {
+            key_release(key);
+            return FALSE;
+        }
+        if (req->nkeys > 0) {
+            memcpy(keys, req->keys, req->nkeys * sizeof(cprowl_key_t *));
+        }
+        if (req->flags & REQUEST_KEYS_OWNED) {
+            free(req->keys);
+        }
+        req->keys = keys;
+        req->keys_cap = cap;
+        req->flags |= REQUEST_KEYS_OWNED;
+    }
+
+    req->keys[req->nkeys++] = key;
+    if (req->keyset) {
+        req->keyset->slots[keyset_slot(req->keyset, key)] = key;
+    }
+    return TRUE;
+}
+
+void
+cprowl_request_clear_keys(cprowl_add_request_t *req)
+{
+    uint32_t i;
+
+    for (i = 0; i < req->nkeys; i++) {
+        key_release(req->keys[i]);
+    }
+    if (req->keyset) {
+        free(req->keyset->slots);
+        free(req->keyset);
+        req->keyset = NULL;
+    }
+    req->nkeys = 0;
+}
+
+cprowl_add_request_t*
+cprowl_request_new(void)
+{
+    cprowl_add_request_t *req = malloc(sizeof(*req));
+
+    if (req) {
+        cprowl_request_add_init(req);
+    }
+    return req;
+}
+
+void
+cprowl_request_destroy(cprowl_add_request_t *req)
+{
+    if (req) {
+        cprowl_request_free(req);
+        free(req);
+    }
+}
+
+void 
+cprowl_request_free(cprowl_add_request_t *req)
+{
+    cprowl_request_clear_keys(req);
+    if (req->flags & REQUEST_KEYS_OWNED) {
+        free(req->keys);
+    }
+    if (req->flags & REQUEST_ARENA_OWNED) {
+        free(req->arena);
+    }
+    free(req->block);
+    memset(req, 0, sizeof(*req));
+}
+
+/* bytes needed to pack req: key pointers, then the live text */
+size_t
+cprowl_request_packed_size(cprowl_add_request_t *req)
+{
+    size_t size = req->nkeys * sizeof(cprowl_key_t *);
+    int i;
+
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        size += req->fields[i].len + 1;
+    }
+    return size;
+}
+
+/* copy src into dst, storing keys and text in mem, which must hold
+ * cprowl_request_packed_size(src) bytes and outlive dst */
+void
+cprowl_request_pack(cprowl_add_request_t *dst, cprowl_add_request_t *src,
+                    void *mem)
+{
+    char *p;
+    uint32_t i;
+
+    memset(dst, 0, sizeof(*dst));
+    dst->keys = mem;
+    dst->nkeys = dst->keys_cap = src->nkeys;
+    pthread_mutex_lock(&intern_lock);
+    for (i = 0; i < src->nkeys; i++) {
+        dst->keys[i] = src->keys[i];
+        dst->keys[i]->refs++;
+    }
+    pthread_mutex_unlock(&intern_lock);
+
+    dst->arena = p = (char *) mem + src->nkeys * sizeof(cprowl_key_t *);
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        dst->fields[i].off = p - dst->arena;
+        dst->fields[i].len = src->fields[i].len;
+        memcpy(p, cprowl_request_get(src, i), src->fields[i].len + 1);
+        p += src->fields[i].len + 1;
+    }
+    dst->arena_len = dst->arena_cap = p - dst->arena;
+}
+
+int
+cprowl_request_copy(cprowl_add_request_t *dst, cprowl_add_request_t *src)
+{
+    void *mem;
+
+    if ((mem = malloc(cprowl_request_packed_size(src))) == NULL) {
+        return FALSE;
+    }
+    cprowl_request_pack(dst, src, mem);
+    dst->block = mem;
+    return TRUE;
+}
+
+char* 
+cprowl_request_get_api_string(cprowl_add_request_t *req)
+{
+    char *str, *p;
+    uint32_t i;
+
+    /* every key is exactly CPROWL_MAX_LENGTH_API long */
+    if ((str = malloc(req->nkeys * (CPROWL_MAX_LENGTH_API + 1) + 1)) == NULL) {
+        return NULL;
+    }
+
+    p = str;
+    for (i = 0; i < req->nkeys; i++) {
+        if (i > 0) {
+            *p++ = ',';
+        }
+        memcpy(p, req->keys[i]->api, CPROWL_MAX_LENGTH_API);
+        p += CPROWL_MAX_LENGTH_API;
+    }
+    *p = '\0';
+
+    return str;
+}
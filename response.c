@@ -0,0 +1,173 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "cprowl.h"
+
+/*
+ * Streaming parser for the Prowl API response:
+ *
+ *   <prowl><success code="200" remaining="996" resetdate="1291404830"/></prowl>
+ *   <prowl><error code="401">Invalid API key</error></prowl>
+ *
+ * Chunks are scanned where curl delivered them.  A tag is parsed in place
+ * when it lies within one chunk; only a tag split across chunks is copied,
+ * into a small carry buffer.  Everything but the success and error
+ * elements is skipped.
+ */
+
+void
+cprowl_response_init(cprowl_response_t *resp)
+{
+    memset(resp, 0, sizeof(*resp));
+    resp->remaining = -1;
+}
+
+/* value of attribute name in the tag text [p, end), or NULL */
+static const char*
+response_attr(const char *p, const char *end, const char *name, size_t *len)
+{
+    size_t nlen = strlen(name);
+
+    while (p + nlen + 2 < end) {
+        const char *q;
+
+        if (memcmp(p, name, nlen) != 0 || p[nlen] != '=' ||
+            (p[nlen + 1] != '"' && p[nlen + 1] != '\'') ||
+            (p[-1] != ' ' && p[-1] != '\t' && p[-1] != '\n')) {
+            p++;
+            continue;
+        }
+        p += nlen + 2;
+        for (q = p; q < end && *q != '"' && *q != '\''; q++)
+            ;
+        *len = q - p;
+        return p;
+    }
+    return NULL;
+}
+
+static long
+response_number(const char *p, size_t len)
+{
+    long n = 0;
+    int neg = FALSE;
+
+    if (len > 0 && *p == '-') {
+        neg = TRUE;
+        p++;
+        len--;
+    }
+    while (len-- > 0 && *p >= '0' && *p <= '9') {
+        n = n * 10 + (*p++ - '0');
+    }
+    return neg ? -n : n;
+}
+
+/* tag text without the angle brackets */
+static void
+response_tag(cprowl_response_t *resp, const char *p, const char *end)
+{
+    const char *v;
+    size_t len;
+
+    if (end - p >= 7 && memcmp(p, "success", 7) == 0) {
+        resp->success = TRUE;
+    } else if (end - p >= 5 && memcmp(p, "error", 5) == 0) {
+        resp->in_error = TRUE;
+    } else {
+        if (end - p >= 6 && memcmp(p, "/error", 6) == 0) {
+            resp->in_error = FALSE;
+        }
+        return;
+    }
+
+    resp->parsed = TRUE;
+    if ((v = response_attr(p + 1, end, "code", &len)) != NULL) {
+        resp->code = (int) response_number(v, len);
+    }
+    if ((v = response_attr(p + 1, end, "remaining", &len)) != NULL) {
+        resp->remaining = response_number(v, len);
+    }
+    if ((v = response_attr(p + 1, end, "resetdate", &len)) != NULL) {
+        resp->resetdate = response_number(v, len);
+    }
+}
+
+static void
+response_text(cprowl_response_t *resp, const char *p, size_t len)
+{
+    size_t room = sizeof(resp->message) - 1 - resp->message_len;
+
+    if (len > room) {
+        len = room;
+    }
+    memcpy(resp->message + resp->message_len, p, len);
+    resp->message_len += len;
+    resp->message[resp->message_len] = '\0';
+}
+
+void
+cprowl_response_feed(cprowl_response_t *resp, const char *data, size_t len)
+{
+    const char *p = data, *end = data + len;
+
+    while (p < end) {
+        const char *lt, *gt;
+
+        if (resp->carry_len > 0 || resp->in_tag) {
+            /* finish a tag started in an earlier chunk */
+            if ((gt = memchr(p, '>', end - p)) == NULL) {
+                gt = end;
+            }
+            if (resp->carry_len + (gt - p) < sizeof(resp->carry)) {
+                memcpy(resp->carry + resp->carry_len, p, gt - p);
+                resp->carry_len += gt - p;
+            }
+            if (gt == end) {
+                return;
+            }
+            response_tag(resp, resp->carry, resp->carry + resp->carry_len);
+            resp->carry_len = 0;
+            resp->in_tag = FALSE;
+            p = gt + 1;
+            continue;
+        }
+
+        if ((lt = memchr(p, '<', end - p)) == NULL) {
+            lt = end;
+        }
+        if (resp->in_error) {
+            response_text(resp, p, lt - p);
+        }
+        if (lt == end) {
+            return;
+        }
+
+        p = lt + 1;
+        if ((gt = memchr(p, '>', end - p)) == NULL) {
+            /* the tag continues in the next chunk */
+            resp->in_tag = TRUE;
+            if ((size_t) (end - p) < sizeof(resp->carry)) {
+                memcpy(resp->carry, p, end - p);
+                resp->carry_len = end - p;
+            }
+            return;
+        }
+        response_tag(resp, p, gt);
+        p = gt + 1;
+    }
+}
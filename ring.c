@@ -0,0 +1,155 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "cprowl.h"
+
+/*
+ * A bounded queue of fixed size slots that producers fill in place, after
+ * D. Vyukov's bounded MPMC queue.  Every slot carries a sequence number
+ * that says whose turn it is: a slot at position pos is free for the
+ * producer that claims pos while its sequence is pos, holds a published
+ * item while it is pos + 1, and is free again for position pos + nslots
+ * once the consumer is done with it.  Claiming and taking are one
+ * compare-and-swap on the tail or head; copying the payload in and out
+ * happens outside of it, so producers never wait on each other or on the
+ * consumer, and nothing is allocated after init.
+ *
+ * There is normally one consumer, but taking is safe from any thread, so
+ * a producer may take the oldest item itself to make room.
+ */
+
+/* in front of every slot's payload */
+typedef union {
+    size_t seq;
+    char pad[16];
+} ring_header_t;
+
+#define RING_HEADER(p) ((ring_header_t *) ((char *) (p) - sizeof(ring_header_t)))
+
+int
+cprowl_ring_init(cprowl_ring_t *ring, size_t nslots, size_t size)
+{
+    size_t i;
+
+    memset(ring, 0, sizeof(*ring));
+    for (ring->mask = 1; ring->mask < nslots; ring->mask <<= 1)
+        ;
+    ring->stride = (sizeof(ring_header_t) + size + CPROWL_CACHELINE - 1) &
+                   ~(size_t) (CPROWL_CACHELINE - 1);
+    if (posix_memalign((void **) &ring->slots, CPROWL_CACHELINE,
+                       ring->mask * ring->stride) != 0) {
+        ring->slots = NULL;
+        return FALSE;
+    }
+    for (i = 0; i < ring->mask; i++) {
+        ((ring_header_t *) (ring->slots + i * ring->stride))->seq = i;
+    }
+    ring->mask--;
+    return TRUE;
+}
+
+void
+cprowl_ring_cleanup(cprowl_ring_t *ring)
+{
+    free(ring->slots);
+    ring->slots = NULL;
+}
+
+static ring_header_t*
+ring_slot(cprowl_ring_t *ring, size_t pos)
+{
+    return (ring_header_t *) (ring->slots + (pos & ring->mask) * ring->stride);
+}
+
+/* a slot to fill in and publish, or NULL when the ring is full */
+void*
+cprowl_ring_claim(cprowl_ring_t *ring)
+{
+    size_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    for (;;) {
+        ring_header_t *h = ring_slot(ring, pos);
+        size_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        long dif = (long) (seq - pos);
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                return h + 1;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* hand a claimed slot to the consumer */
+void
+cprowl_ring_publish(cprowl_ring_t *ring, void *slot)
+{
+    ring_header_t *h = RING_HEADER(slot);
+
+    __atomic_store_n(&h->seq, h->seq + 1, __ATOMIC_RELEASE);
+}
+
+/* the oldest published slot, or NULL when there is none yet; it stays
+ * the caller's until released */
+void*
+cprowl_ring_take(cprowl_ring_t *ring)
+{
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    for (;;) {
+        ring_header_t *h = ring_slot(ring, pos);
+        size_t seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        long dif = (long) (seq - (pos + 1));
+
+        if (dif == 0) {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, TRUE,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                return h + 1;
+            }
+        } else if (dif < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+/* give a taken slot back to the producers */
+void
+cprowl_ring_release(cprowl_ring_t *ring, void *slot)
+{
+    ring_header_t *h = RING_HEADER(slot);
+
+    __atomic_store_n(&h->seq, h->seq + ring->mask, __ATOMIC_RELEASE);
+}
+
+/* TRUE when the oldest slot is published, so a take would succeed */
+int
+cprowl_ring_ready(cprowl_ring_t *ring)
+{
+    size_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    return __atomic_load_n(&ring_slot(ring, pos)->seq, __ATOMIC_ACQUIRE) ==
+           pos + 1;
+}
@@ -0,0 +1,138 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <curl/curl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include "cprowl.h"
+
+long long
+cprowl_now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+const char*
+cprowl_result_string(CURLcode res, int http_error_code, char *buf, size_t len)
+{
+    if (res == CPROWL_DROPPED) {
+        return "dropped, queue full";
+    }
+    if (res != CURLE_OK) {
+        snprintf(buf, len, "error: %s", curl_easy_strerror(res));
+        return buf;
+    }
+
+    switch (http_error_code) {
+        case 200:
+            return "ok";
+        case 401:
+            return "authentication error";
+        default:
+            snprintf(buf, len, "http_error_code = %d", http_error_code);
+            return buf;
+    }
+}
+
+/* fold the result of one shard into that of the whole request; the
+ * first failure is kept */
+void
+cprowl_result_merge(CURLcode *res, int *http_error_code,
+                    CURLcode shard_res, int shard_code)
+{
+    if (*res != CURLE_OK ||
+        (*http_error_code != 0 && *http_error_code != 200)) {
+        return;
+    }
+    *res = shard_res;
+    *http_error_code = shard_res == CURLE_OK ? shard_code : 0;
+}
+
+void
+cprowl_print_result(CURLcode res, int http_error_code)
+{
+    char buf[128];
+
+    if (res != CURLE_OK) {
+        fprintf(stderr, "%s\n", curl_easy_strerror(res));
+        return;
+    }
+
+    /* error handling */
+    fprintf(stdout, "%s\n",
+            cprowl_result_string(res, http_error_code, buf, sizeof(buf)));
+}
+
+static size_t 
+curl_write_cb(void *ptr, size_t size, size_t nmemb, void *stream)
+{
+    if (stream) {
+        cprowl_response_feed(stream, ptr, size * nmemb);
+    }
+    return (size * nmemb);
+}
+
+/* bodies are small; skip the 100-continue round trip */
+static struct curl_slist *expect_headers;
+static pthread_once_t expect_once = PTHREAD_ONCE_INIT;
+
+static void
+expect_init(void)
+{
+    expect_headers = curl_slist_append(NULL, "Expect:");
+}
+
+void
+cprowl_curl_setup(CURL *curl, const cprowl_options_t *opts)
+{
+    curl_easy_setopt(curl, CURLOPT_URL, opts->url);
+    curl_easy_setopt(curl, CURLOPT_VERBOSE, (long) opts->debug);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
+    curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+    /* multiplex over one connection when the server speaks HTTP/2 */
+    curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, (long) CURL_HTTP_VERSION_2TLS);
+    curl_easy_setopt(curl, CURLOPT_PIPEWAIT, 1L);
+    /* handles may run on the library's I/O thread, where no alarm()
+     * based resolver timeout may fire */
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    pthread_once(&expect_once, expect_init);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, expect_headers);
+    if (opts->cacert) {
+        curl_easy_setopt(curl, CURLOPT_CAINFO, opts->cacert);
+    }
+    if (opts->tls_resume) {
+        cprowl_tls_setup(curl, opts);
+    }
+#ifdef WIN32
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, FALSE);
+#endif
+}
+
+/* serialize req into body and attach it to the handle */
+int
+cprowl_post_prepare(cprowl_buf_t *body, CURL *curl, cprowl_add_request_t *req,
+                    size_t key_first, size_t key_count)
+{
+    if (!cprowl_request_serialize_keys(body, req, key_first, key_count)) {
+        return FALSE;
+    }
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, (long) body->len);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body->data);
+    return TRUE;
+}
@@ -0,0 +1,735 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * The spool is a directory of fixed size, memory mapped segment files
+ * (seg-<seq>.spool).  Each segment starts with a header followed by
+ * records:
+ *
+ *   [u32 len|committed] [u32 crc32] [payload, padded to 8 bytes]
+ *
+ * The payload is a request in the line format of wire.c.  Producers
+ * reserve space by atomically bumping the shared tail in the header, so
+ * any number of processes append without a lock.  A producer stores the
+ * record's length first, then fills it in and sets the committed bit
+ * last; the drain only ever reads committed records.  A segment is only
+ * removed once every record in it is committed; a record whose producer
+ * never finishes it is stepped over after SPOOL_STALL_MS, thanks to the
+ * length stored up front.
+ *
+ * The drain acknowledges records by advancing the header's head past
+ * them, which it cannot do past one whose send failed.  Records delivered
+ * behind that one get the sent bit instead, and the next drain steps over
+ * them rather than sending them twice.
+ *
+ * Durability is group committed: a producer that needs its record on disk
+ * takes the segment's flock, and whoever holds it syncs every record
+ * committed so far in one fdatasync().  Producers that queue up on the lock
+ * meanwhile usually find their record already synced and return at once.
+ */
+
+#define SPOOL_MAGIC        0x4c575250u   /* "PRWL" */
+#define SPOOL_VERSION      1
+#define SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+#define SPOOL_HEADER_SIZE  64
+#define SPOOL_COMMITTED    0x80000000u
+#define SPOOL_SENT         0x40000000u  /* delivered, not yet acknowledged */
+#define SPOOL_END          0x7fffffffu
+#define SPOOL_ALIGN(n)     (((n) + 7) & ~(uint64_t) 7)
+#define SPOOL_STALL_MS     2000     /* before a producer is given up on */
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tail;      /* next free byte, may overshoot once sealed */
+    uint64_t synced;    /* records below this offset are on disk */
+    uint64_t head;      /* records below this offset are acknowledged */
+} spool_header_t;
+
+typedef struct {
+    uint32_t len;
+    uint32_t crc;
+} spool_record_t;
+
+typedef struct {
+    int fd;
+    char *base;
+    unsigned long long seq;
+} spool_segment_t;
+
+/* CRC-32 (IEEE 802.3) */
+static uint32_t crc_table[256];
+
+static void
+spool_crc_init(void)
+{
+    uint32_t i, j, c;
+
+    if (crc_table[1]) {
+        return;
+    }
+    for (i = 0; i < 256; i++) {
+        for (c = i, j = 0; j < 8; j++) {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t
+spool_crc32(const char *data, size_t len)
+{
+    uint32_t c = 0xffffffffu;
+
+    while (len--) {
+        c = crc_table[(c ^ (unsigned char) *data++) & 0xff] ^ (c >> 8);
+    }
+    return c ^ 0xffffffffu;
+}
+
+static void
+spool_segment_path(char *path, size_t len, const char *dir,
+                   unsigned long long seq)
+{
+    snprintf(path, len, "%s/seg-%016llu.spool", dir, seq);
+}
+
+/* collect segment sequence numbers, sorted ascending */
+static int
+spool_cmp(const void *a, const void *b)
+{
+    unsigned long long x = *(const unsigned long long *) a;
+    unsigned long long y = *(const unsigned long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+static size_t
+spool_list(const char *dir, unsigned long long **seqs)
+{
+    DIR *d;
+    struct dirent *de;
+    size_t n = 0, cap = 0;
+    unsigned long long seq, *tmp;
+
+    *seqs = NULL;
+    if ((d = opendir(dir)) == NULL) {
+        return 0;
+    }
+    while ((de = readdir(d)) != NULL) {
+        if (sscanf(de->d_name, "seg-%llu.spool", &seq) != 1) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            if ((tmp = realloc(*seqs, cap * sizeof(*tmp))) == NULL) {
+                break;
+            }
+            *seqs = tmp;
+        }
+        (*seqs)[n++] = seq;
+    }
+    closedir(d);
+
+    qsort(*seqs, n, sizeof(**seqs), spool_cmp);
+    return n;
+}
+
+static int
+spool_map(spool_segment_t *seg, const char *dir, unsigned long long seq)
+{
+    char path[512];
+    spool_header_t *hdr;
+
+    spool_segment_path(path, sizeof(path), dir, seq);
+    seg->seq = seq;
+    seg->base = NULL;
+    if ((seg->fd = open(path, O_RDWR)) < 0) {
+        return FALSE;
+    }
+    seg->base = mmap(NULL, SPOOL_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_SHARED, seg->fd, 0);
+    if (seg->base == MAP_FAILED) {
+        close(seg->fd);
+        seg->base = NULL;
+        return FALSE;
+    }
+
+    hdr = (spool_header_t *) seg->base;
+    if (hdr->magic != SPOOL_MAGIC || hdr->version != SPOOL_VERSION) {
+        fprintf(stderr, "%s: not a spool segment\n", path);
+        munmap(seg->base, SPOOL_SEGMENT_SIZE);
+        close(seg->fd);
+        seg->base = NULL;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void
+spool_unmap(spool_segment_t *seg)
+{
+    if (seg->base) {
+        munmap(seg->base, SPOOL_SEGMENT_SIZE);
+        close(seg->fd);
+        seg->base = NULL;
+    }
+}
+
+/* create segment seq unless somebody else already did; the file is fully
+ * initialized before it becomes visible under its final name */
+static int
+spool_create(const char *dir, unsigned long long seq)
+{
+    char path[512], tmp[512];
+    spool_header_t hdr;
+    int fd, rc;
+
+    spool_segment_path(path, sizeof(path), dir, seq);
+    snprintf(tmp, sizeof(tmp), "%s/.seg-%d.tmp", dir, (int) getpid());
+
+    if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+        return FALSE;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SPOOL_MAGIC;
+    hdr.version = SPOOL_VERSION;
+    hdr.tail = hdr.synced = hdr.head = SPOOL_HEADER_SIZE;
+
+    rc = ftruncate(fd, SPOOL_SEGMENT_SIZE) == 0 &&
+         pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr);
+    close(fd);
+
+    if (rc && link(tmp, path) < 0 && errno != EEXIST) {
+        rc = FALSE;
+    }
+    unlink(tmp);
+    return rc;
+}
+
+/* make sure a new segment fits under the size cap */
+static int
+spool_make_room(const cprowl_options_t *opts)
+{
+    unsigned long long *seqs;
+    size_t n, max, i;
+    char path[512];
+
+    max = opts->spool_max / SPOOL_SEGMENT_SIZE;
+    if (max < 2) {
+        max = 2;
+    }
+
+    n = spool_list(opts->spool_dir, &seqs);
+    if (n < max) {
+        free(seqs);
+        return TRUE;
+    }
+
+    if (opts->spool_policy == CPROWL_SPOOL_DROP_NEW) {
+        free(seqs);
+        return FALSE;
+    }
+
+    /* drop the oldest segments and whatever is still queued in them */
+    for (i = 0; i + max <= n; i++) {
+        spool_segment_path(path, sizeof(path), opts->spool_dir, seqs[i]);
+        unlink(path);
+        fprintf(stderr, "spool full, dropped segment %llu\n", seqs[i]);
+    }
+    free(seqs);
+    return TRUE;
+}
+
+/* offset just past the contiguous run of committed records from off */
+static uint64_t
+spool_committed_end(char *base, uint64_t off)
+{
+    uint64_t tail = __atomic_load_n(&((spool_header_t *) base)->tail,
+                                    __ATOMIC_ACQUIRE);
+
+    while (off + sizeof(spool_record_t) <= SPOOL_SEGMENT_SIZE && off < tail) {
+        spool_record_t *rec = (spool_record_t *) (base + off);
+        uint32_t len = __atomic_load_n(&rec->len, __ATOMIC_ACQUIRE);
+
+        if (!(len & SPOOL_COMMITTED)) {
+            break;
+        }
+        len &= ~SPOOL_COMMITTED;
+        if (len == SPOOL_END) {
+            return SPOOL_SEGMENT_SIZE;
+        }
+        len &= ~SPOOL_SENT;
+        off += SPOOL_ALIGN(sizeof(spool_record_t) + len);
+    }
+    return off;
+}
+
+static int
+spool_sync(spool_segment_t *seg, uint64_t end)
+{
+    spool_header_t *hdr = (spool_header_t *) seg->base;
+
+    while (__atomic_load_n(&hdr->synced, __ATOMIC_ACQUIRE) < end) {
+        uint64_t target;
+
+        if (flock(seg->fd, LOCK_EX) < 0) {
+            return FALSE;
+        }
+        /* someone may have synced us while we waited for the lock */
+        if (__atomic_load_n(&hdr->synced, __ATOMIC_ACQUIRE) < end) {
+            target = spool_committed_end(seg->base, hdr->synced);
+            if (fdatasync(seg->fd) < 0) {
+                flock(seg->fd, LOCK_UN);
+                return FALSE;
+            }
+            __atomic_store_n(&hdr->synced, target, __ATOMIC_RELEASE);
+        }
+        flock(seg->fd, LOCK_UN);
+
+        /* an earlier record is still being written */
+        if (__atomic_load_n(&hdr->synced, __ATOMIC_ACQUIRE) < end) {
+            sched_yield();
+        }
+    }
+    return TRUE;
+}
+
+/* append payload to segment; FALSE when the segment is full */
+static int
+spool_append(spool_segment_t *seg, const char *payload, uint32_t len,
+             const cprowl_options_t *opts)
+{
+    spool_header_t *hdr = (spool_header_t *) seg->base;
+    uint64_t size = SPOOL_ALIGN(sizeof(spool_record_t) + len);
+    uint64_t off = __atomic_fetch_add(&hdr->tail, size, __ATOMIC_ACQ_REL);
+    spool_record_t *rec = (spool_record_t *) (seg->base + off);
+
+    if (off + size > SPOOL_SEGMENT_SIZE) {
+        /* the writer that crosses the end seals the segment */
+        if (off + sizeof(spool_record_t) <= SPOOL_SEGMENT_SIZE) {
+            __atomic_store_n(&rec->len, SPOOL_COMMITTED | SPOOL_END,
+                             __ATOMIC_RELEASE);
+        }
+        return FALSE;
+    }
+
+    /* the length alone, so a drain can step over us should we die */
+    __atomic_store_n(&rec->len, len, __ATOMIC_RELEASE);
+    memcpy(rec + 1, payload, len);
+    rec->crc = spool_crc32(payload, len);
+    __atomic_store_n(&rec->len, SPOOL_COMMITTED | len, __ATOMIC_RELEASE);
+
+    if (opts->spool_sync) {
+        return spool_sync(seg, off + size) ? TRUE : -1;
+    }
+    return TRUE;
+}
+
+int
+cprowl_spool_enqueue(const cprowl_options_t *opts, cprowl_add_request_t *req)
+{
+    spool_segment_t seg;
+    unsigned long long *seqs, seq;
+    cprowl_buf_t buf;
+    size_t n;
+    int rc = FALSE, tries;
+
+    spool_crc_init();
+    cprowl_buf_init(&buf);
+
+    if (!cprowl_wire_encode(&buf, req)) {
+        goto done;
+    }
+    buf.len--;  /* the newline is not stored */
+
+    if (buf.len + sizeof(spool_record_t) + SPOOL_HEADER_SIZE > SPOOL_SEGMENT_SIZE) {
+        fprintf(stderr, "request too large for the spool\n");
+        goto done;
+    }
+
+    if (mkdir(opts->spool_dir, 0700) < 0 && errno != EEXIST) {
+        perror(opts->spool_dir);
+        goto done;
+    }
+
+    n = spool_list(opts->spool_dir, &seqs);
+    seq = n ? seqs[n - 1] : 1;
+    free(seqs);
+
+    for (tries = 0; tries < 16; tries++) {
+        int appended;
+
+        if (!spool_map(&seg, opts->spool_dir, seq)) {
+            if (!spool_make_room(opts)) {
+                fprintf(stderr, "spool full, request dropped\n");
+                goto done;
+            }
+            if (!spool_create(opts->spool_dir, seq)) {
+                perror(opts->spool_dir);
+                goto done;
+            }
+            continue;
+        }
+
+        appended = spool_append(&seg, buf.data, (uint32_t) buf.len, opts);
+        spool_unmap(&seg);
+
+        if (appended < 0) {
+            perror("fdatasync");
+            goto done;
+        }
+        if (appended) {
+            rc = TRUE;
+            goto done;
+        }
+        seq++;
+    }
+    fprintf(stderr, "unable to append to the spool\n");
+
+done:
+    cprowl_buf_free(&buf);
+    return rc;
+}
+
+/*
+ * Drain
+ */
+
+enum { DRAIN_FREE, DRAIN_BUSY, DRAIN_DONE };
+
+typedef struct {
+    cprowl_add_request_t req;
+    cprowl_job_t job;
+    uint64_t start;     /* offset of this record */
+    uint64_t end;       /* offset past this record */
+    int state;
+    int failed;
+    int delivered;      /* by an earlier drain */
+} drain_slot_t;
+
+typedef struct {
+    cprowl_engine_t engine;
+    spool_segment_t seg;
+    drain_slot_t *slots;
+    size_t nslots;
+    size_t head;
+    size_t count;
+    char *line;
+    unsigned long sent;
+    unsigned long dropped;
+    int stop;           /* a send failed; leave the rest for later */
+    cprowl_coalesce_t coalesce;
+    int coalescing;
+} drain_t;
+
+static void
+drain_emit(cprowl_add_request_t *req, void *arg)
+{
+    drain_t *drain = arg;
+    cprowl_engine_submit_copy(&drain->engine, req);
+}
+
+static void
+drain_job_done(cprowl_job_t *job)
+{
+    drain_slot_t *slot = job->arg;
+    char buf[128];
+
+    /* transport errors and server errors are retried on the next drain;
+     * anything else is a final answer */
+    if (job->res != CURLE_OK || job->http_error_code >= 500) {
+        slot->failed = TRUE;
+        fprintf(stderr, "%s, will retry\n",
+                cprowl_result_string(job->res, job->http_error_code,
+                                     buf, sizeof(buf)));
+    } else if (job->http_error_code != 200) {
+        fprintf(stderr, "%s, dropping request\n",
+                cprowl_result_string(job->res, job->http_error_code,
+                                     buf, sizeof(buf)));
+    }
+    cprowl_request_free(&slot->req);
+    slot->state = DRAIN_DONE;
+}
+
+/* acknowledge finished records from the front of the window */
+static void
+drain_ack(drain_t *drain)
+{
+    spool_header_t *hdr = (spool_header_t *) drain->seg.base;
+
+    while (drain->count > 0) {
+        drain_slot_t *slot = &drain->slots[drain->head];
+        if (slot->state != DRAIN_DONE) {
+            break;
+        }
+        if (slot->failed || drain->stop) {
+            /* head stays before the failure; what was delivered behind
+             * it is marked so the next drain does not send it again */
+            if (!slot->failed && !slot->delivered) {
+                spool_record_t *rec =
+                    (spool_record_t *) (drain->seg.base + slot->start);
+                __atomic_fetch_or(&rec->len, SPOOL_SENT, __ATOMIC_RELEASE);
+                drain->sent++;
+            }
+            drain->stop = TRUE;
+        } else {
+            __atomic_store_n(&hdr->head, slot->end, __ATOMIC_RELEASE);
+            drain->sent += !slot->delivered;
+        }
+        slot->state = DRAIN_FREE;
+        drain->head = (drain->head + 1) % drain->nslots;
+        drain->count--;
+    }
+}
+
+static void
+drain_wait(drain_t *drain)
+{
+    while (drain->count > 0) {
+        cprowl_engine_perform(&drain->engine, 1000);
+        drain_ack(drain);
+    }
+}
+
+/* wait for the producer of a record in an old segment, which is usually
+ * still copying it; its length as last seen */
+static uint32_t
+drain_await(drain_t *drain, spool_record_t *rec)
+{
+    long long until = cprowl_now_ms() + SPOOL_STALL_MS;
+    struct timespec ts = { 0, 1000000 };
+    uint32_t len;
+
+    while (!((len = __atomic_load_n(&rec->len, __ATOMIC_ACQUIRE)) &
+             SPOOL_COMMITTED) && cprowl_now_ms() < until) {
+        cprowl_engine_perform(&drain->engine, 0);
+        drain_ack(drain);
+        nanosleep(&ts, NULL);
+    }
+    return len;
+}
+
+/* send everything committed in the mapped segment; returns TRUE when the
+ * segment has been consumed completely and may be removed */
+static int
+drain_segment(drain_t *drain, int newest)
+{
+    spool_header_t *hdr = (spool_header_t *) drain->seg.base;
+    uint64_t off = hdr->head;
+
+    for (;;) {
+        spool_record_t *rec = (spool_record_t *) (drain->seg.base + off);
+        drain_slot_t *slot;
+        uint64_t start = off;
+        uint32_t len, sent;
+
+        if (drain->stop) {
+            break;
+        }
+        if (off + sizeof(spool_record_t) > SPOOL_SEGMENT_SIZE) {
+            drain_wait(drain);
+            return !drain->stop;
+        }
+        if (off >= __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE)) {
+            break;
+        }
+
+        len = __atomic_load_n(&rec->len, __ATOMIC_ACQUIRE);
+        if (!(len & SPOOL_COMMITTED)) {
+            if (newest) {
+                break;          /* still being written */
+            }
+            len = drain_await(drain, rec);
+        }
+        if (!(len & SPOOL_COMMITTED)) {
+            if (len == 0 || len > SPOOL_SEGMENT_SIZE) {
+                /* nothing to step over; keep the segment for next time */
+                break;
+            }
+            /* its producer died mid-write */
+            fprintf(stderr, "spool record never committed, skipping\n");
+            drain->dropped++;
+            off += SPOOL_ALIGN(sizeof(spool_record_t) + len);
+            continue;
+        }
+        len &= ~SPOOL_COMMITTED;
+        if (len == SPOOL_END) {
+            drain_wait(drain);
+            return !drain->stop;
+        }
+        sent = len & SPOOL_SENT;
+        len &= ~SPOOL_SENT;
+
+        off += SPOOL_ALIGN(sizeof(spool_record_t) + len);
+
+        if (!sent && spool_crc32((char *) (rec + 1), len) != rec->crc) {
+            fprintf(stderr, "spool record corrupt, skipping\n");
+            drain->dropped++;
+            continue;
+        }
+
+        /* wait for a free slot */
+        drain_ack(drain);
+        while (drain->count == drain->nslots) {
+            cprowl_engine_perform(&drain->engine, 1000);
+            drain_ack(drain);
+        }
+        if (drain->stop) {
+            break;
+        }
+
+        slot = &drain->slots[(drain->head + drain->count) % drain->nslots];
+        slot->start = start;
+        slot->end = off;
+        slot->failed = FALSE;
+        slot->delivered = sent != 0;
+        drain->count++;
+
+        if (slot->delivered) {
+            /* only acknowledged, in order */
+            slot->state = DRAIN_DONE;
+            continue;
+        }
+
+        memcpy(drain->line, rec + 1, len);
+        drain->line[len] = '\0';
+        cprowl_request_add_init(&slot->req);
+        if (!cprowl_wire_decode(&slot->req, drain->line, len)) {
+            fprintf(stderr, "invalid spooled request, skipping\n");
+            cprowl_request_free(&slot->req);
+            drain->dropped++;
+            slot->state = DRAIN_DONE;
+            continue;
+        }
+
+        if (drain->coalescing) {
+            if (!cprowl_coalesce_check(&drain->coalesce, &slot->req,
+                                       cprowl_now_ms())) {
+                cprowl_request_free(&slot->req);
+                slot->state = DRAIN_DONE;
+                continue;
+            }
+        }
+
+        slot->state = DRAIN_BUSY;
+        slot->job.req = &slot->req;
+        slot->job.cb = drain_job_done;
+        slot->job.arg = slot;
+        cprowl_engine_submit(&drain->engine, &slot->job);
+        cprowl_engine_perform(&drain->engine, 0);
+    }
+
+    drain_wait(drain);
+    return FALSE;
+}
+
+int
+cprowl_spool_drain(const cprowl_options_t *opts)
+{
+    drain_t drain;
+    unsigned long long *seqs = NULL;
+    char path[512];
+    size_t n, i;
+    int lock_fd = -1;
+    int rc = FALSE;
+
+    spool_crc_init();
+    memset(&drain, 0, sizeof(drain));
+    drain.nslots = opts->concurrency * 2;
+
+    /* one drain at a time */
+    snprintf(path, sizeof(path), "%s/drain.lock", opts->spool_dir);
+    if ((lock_fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+        perror(opts->spool_dir);
+        return FALSE;
+    }
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+        fprintf(stderr, "spool is already being drained\n");
+        close(lock_fd);
+        return FALSE;
+    }
+    curl_global_init(CURL_GLOBAL_ALL);
+
+    if ((drain.slots = calloc(drain.nslots, sizeof(drain_slot_t))) == NULL ||
+        (drain.line = malloc(SPOOL_SEGMENT_SIZE)) == NULL) {
+        goto done;
+    }
+
+    if (opts->coalesce_ms > 0) {
+        if (!cprowl_coalesce_init(&drain.coalesce, CPROWL_COALESCE_SLOTS,
+                                  opts->coalesce_ms, drain_emit, &drain)) {
+            goto done;
+        }
+        drain.coalescing = TRUE;
+    }
+
+    if (!cprowl_engine_init(&drain.engine, opts)) {
+        fprintf(stderr, "unable to initialize curl\n");
+        goto done;
+    }
+
+    n = spool_list(opts->spool_dir, &seqs);
+    for (i = 0; i < n && !drain.stop; i++) {
+        int newest = (i == n - 1);
+
+        if (!spool_map(&drain.seg, opts->spool_dir, seqs[i])) {
+            continue;
+        }
+        if (drain_segment(&drain, newest) && !newest) {
+            spool_segment_path(path, sizeof(path), opts->spool_dir, seqs[i]);
+            unlink(path);
+        }
+        spool_unmap(&drain.seg);
+    }
+
+    /* summaries for whatever repeated during this drain */
+    if (drain.coalescing) {
+        cprowl_coalesce_expire(&drain.coalesce, cprowl_now_ms(), TRUE);
+        cprowl_engine_run(&drain.engine);
+    }
+
+    if (opts->debug) {
+        fprintf(stderr, "drained %lu requests, %lu dropped\n",
+                drain.sent, drain.dropped);
+    }
+    rc = !drain.stop;
+
+    cprowl_engine_cleanup(&drain.engine);
+
+done:
+    curl_global_cleanup();
+    cprowl_coalesce_cleanup(&drain.coalesce);
+    free(seqs);
+    free(drain.line);
+    free(drain.slots);
+    close(lock_fd);
+    return rc;
+}
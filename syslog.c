@@ -0,0 +1,628 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#define _GNU_SOURCE     /* recvmmsg */
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * Syslog mode receives log messages like a syslog daemon would, on a unix
+ * datagram socket (such as /dev/log, or one rsyslog forwards to) or a UDP
+ * port, and sends a notification for each one that passes the severity,
+ * facility and program filters.  The host becomes the application, the
+ * program and severity the event, the text the description, and the
+ * severity picks the priority: emerg 2, alert and crit 1, err and warning
+ * 0, notice and info -1, debug -2.
+ *
+ * Most of what arrives is dropped, so that path is kept cheap: datagrams
+ * are read up to SYSLOG_BATCH at a time with recvmmsg() into one fixed
+ * buffer and parsed in place, the parser only recording where each part
+ * starts and how long it is.  Only a message that is forwarded is copied,
+ * into its request.
+ *
+ * Both RFC 3164 ("<PRI>Mmm dd hh:mm:ss host tag[pid]: text", with the
+ * host or even the timestamp left out by local senders) and RFC 5424
+ * ("<PRI>1 timestamp host app procid msgid [sd] text") are understood.
+ */
+
+#define SYSLOG_MAX          8192    /* longer datagrams are cut */
+#define SYSLOG_BATCH        64
+#define SYSLOG_ROUNDS       16      /* batches before the engine runs */
+#define SYSLOG_RCVBUF       (4 * 1024 * 1024)
+#define SYSLOG_POLL_MS      1000
+#define SYSLOG_MAX_PROGRAM  48
+
+static const char *syslog_facilities[] = {
+    "kern", "user", "mail", "daemon", "auth", "syslog", "lpr", "news",
+    "uucp", "cron", "authpriv", "ftp", "ntp", "security", "console",
+    "solaris-cron", "local0", "local1", "local2", "local3", "local4",
+    "local5", "local6", "local7"
+};
+
+static const char *syslog_severities[] = {
+    "emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"
+};
+
+static const int syslog_priority[] = { 2, 1, 1, 0, 0, -1, -1, -2 };
+
+typedef struct {
+    const cprowl_syslog_t *sl;
+    cprowl_add_request_t *defaults;
+    const cprowl_options_t *opts;
+    cprowl_engine_t engine;
+    cprowl_coalesce_t coalesce;
+    int coalescing;
+    int fd;
+    char *buf;                  /* SYSLOG_BATCH datagrams */
+    struct mmsghdr msgs[SYSLOG_BATCH];
+    struct iovec iov[SYSLOG_BATCH];
+    char hostname[256];
+    unsigned long long received;
+    unsigned long long forwarded;
+    unsigned long long invalid;
+} syslog_t;
+
+static volatile sig_atomic_t syslog_stop = 0;
+
+static void
+syslog_signal(int sig)
+{
+    (void) sig;
+    syslog_stop = 1;
+}
+
+/* the facility number for a name or number, -1 if unknown */
+int
+cprowl_syslog_facility(const char *name)
+{
+    char *end;
+    long n = strtol(name, &end, 10);
+    size_t i;
+
+    if (*name && *end == '\0') {
+        return n >= 0 && n < CPROWL_SYSLOG_NFACILITIES ? (int) n : -1;
+    }
+    for (i = 0; i < CPROWL_SYSLOG_NFACILITIES; i++) {
+        if (strcasecmp(name, syslog_facilities[i]) == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/* the severity number for a name or number, -1 if unknown */
+int
+cprowl_syslog_severity(const char *name)
+{
+    char *end;
+    long n = strtol(name, &end, 10);
+    size_t i;
+
+    if (*name && *end == '\0') {
+        return n >= 0 && n < 8 ? (int) n : -1;
+    }
+    if (strcasecmp(name, "panic") == 0) {
+        return 0;
+    }
+    if (strcasecmp(name, "error") == 0) {
+        return 3;
+    }
+    if (strcasecmp(name, "warn") == 0) {
+        return 4;
+    }
+    for (i = 0; i < 8; i++) {
+        if (strcasecmp(name, syslog_severities[i]) == 0) {
+            return (int) i;
+        }
+    }
+    return -1;
+}
+
+/* the next space separated field of an RFC 5424 header, NULL when the
+ * header ends early; "-" is an empty field */
+static const char*
+syslog_field(const char *p, const char *end, const char **field, size_t *len)
+{
+    const char *sp = memchr(p, ' ', end - p);
+
+    if (sp == NULL) {
+        return NULL;
+    }
+    *field = p;
+    *len = sp - p;
+    if (*len == 1 && *p == '-') {
+        *len = 0;
+    }
+    return sp + 1;
+}
+
+static int
+syslog_parse_5424(cprowl_syslog_msg_t *m, const char *p, const char *end)
+{
+    const char *skip;
+    size_t skip_len;
+
+    /* version, timestamp, host, app, procid, msgid */
+    if ((p = syslog_field(p, end, &skip, &skip_len)) == NULL ||
+        (p = syslog_field(p, end, &skip, &skip_len)) == NULL ||
+        (p = syslog_field(p, end, &m->host, &m->host_len)) == NULL ||
+        (p = syslog_field(p, end, &m->program, &m->program_len)) == NULL ||
+        (p = syslog_field(p, end, &skip, &skip_len)) == NULL ||
+        (p = syslog_field(p, end, &skip, &skip_len)) == NULL) {
+        return FALSE;
+    }
+
+    /* structured data: "-" or one or more [id param="value" ...] */
+    if (p < end && *p == '-') {
+        p++;
+    } else {
+        while (p < end && *p == '[') {
+            int quoted = FALSE;
+
+            for (p++; p < end; p++) {
+                if (quoted && *p == '\\') {
+                    p++;
+                } else if (*p == '"') {
+                    quoted = !quoted;
+                } else if (!quoted && *p == ']') {
+                    break;
+                }
+            }
+            if (p >= end) {
+                return FALSE;
+            }
+            p++;
+        }
+    }
+    if (p < end && *p == ' ') {
+        p++;
+    }
+
+    /* UTF-8 text is marked with a byte order mark */
+    if (end - p >= 3 && memcmp(p, "\xef\xbb\xbf", 3) == 0) {
+        p += 3;
+    }
+    m->msg = p;
+    m->msg_len = end - p;
+    return TRUE;
+}
+
+/* length of the program in a tag such as "sshd[42]:" or "cron:", or 0
+ * when word is not a tag */
+static size_t
+syslog_tag(const char *word, size_t len)
+{
+    const char *bracket;
+
+    if (len == 0 || len > SYSLOG_MAX_PROGRAM + 16) {
+        return 0;
+    }
+    if ((bracket = memchr(word, '[', len)) != NULL) {
+        return word[len - 1] == ']' || word[len - 1] == ':' ?
+               (size_t) (bracket - word) : 0;
+    }
+    return word[len - 1] == ':' ? len - 1 : 0;
+}
+
+static int
+syslog_parse_3164(cprowl_syslog_msg_t *m, const char *p, const char *end)
+{
+    const char *word, *sp;
+    size_t len, tag;
+    int stamped;
+
+    /* "Mmm dd hh:mm:ss "; local senders may leave out what follows it */
+    stamped = end - p >= 16 && p[3] == ' ' && p[6] == ' ' && p[9] == ':' &&
+              p[12] == ':' && p[15] == ' ';
+    if (stamped) {
+        p += 16;
+    }
+
+    word = p;
+    sp = memchr(p, ' ', end - p);
+    len = (sp ? sp : end) - p;
+    tag = syslog_tag(word, len);
+
+    if (tag == 0 && stamped && sp) {
+        /* not a tag, so the host; the tag comes next */
+        const char *next = sp + 1, *sp2 = memchr(next, ' ', end - next);
+        size_t next_len = (sp2 ? sp2 : end) - next;
+
+        m->host = word;
+        m->host_len = len;
+        word = next;
+        sp = sp2;
+        len = next_len;
+        tag = syslog_tag(word, len);
+        p = next;
+    }
+
+    if (tag > 0) {
+        m->program = word;
+        m->program_len = tag;
+        p = sp ? sp + 1 : end;
+    }
+    m->msg = p;
+    m->msg_len = end - p;
+    return TRUE;
+}
+
+/* split a datagram into its parts, in place; FALSE when it does not start
+ * with a valid <PRI> */
+int
+cprowl_syslog_parse(cprowl_syslog_msg_t *m, const char *buf, size_t len)
+{
+    const char *p = buf + 1, *end = buf + len;
+    unsigned pri = 0;
+    int digits = 0;
+
+    if (len < 3 || buf[0] != '<') {
+        return FALSE;
+    }
+    for (; p < end && *p >= '0' && *p <= '9' && digits < 3; p++, digits++) {
+        pri = pri * 10 + (*p - '0');
+    }
+    if (digits == 0 || p == end || *p != '>' ||
+        pri >= CPROWL_SYSLOG_NFACILITIES * 8) {
+        return FALSE;
+    }
+    p++;
+
+    m->facility = pri >> 3;
+    m->severity = pri & 7;
+    m->host = m->program = NULL;
+    m->host_len = m->program_len = 0;
+
+    /* senders often end with a newline or a NUL */
+    while (end > p && (end[-1] == '\n' || end[-1] == '\r' || end[-1] == '\0')) {
+        end--;
+    }
+
+    if (end - p >= 2 && p[0] >= '1' && p[0] <= '9' && p[1] == ' ') {
+        return syslog_parse_5424(m, p, end);
+    }
+    return syslog_parse_3164(m, p, end);
+}
+
+static int
+syslog_wanted(syslog_t *s, const cprowl_syslog_msg_t *m)
+{
+    const cprowl_syslog_t *sl = s->sl;
+    size_t i;
+
+    if (m->severity > sl->severity ||
+        (sl->facilities && !(sl->facilities & (1u << m->facility)))) {
+        return FALSE;
+    }
+    if (sl->nprograms == 0) {
+        return TRUE;
+    }
+    for (i = 0; i < sl->nprograms; i++) {
+        if (strlen(sl->programs[i]) == m->program_len &&
+            memcmp(sl->programs[i], m->program, m->program_len) == 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/* summaries of coalesced repeats are sent like any other message */
+static void
+syslog_emit(cprowl_add_request_t *req, void *arg)
+{
+    syslog_t *s = arg;
+    cprowl_engine_submit_copy(&s->engine, req);
+}
+
+static void
+syslog_notify(syslog_t *s, const cprowl_syslog_msg_t *m)
+{
+    cprowl_add_request_t req;
+    char event[SYSLOG_MAX_PROGRAM + 32];
+    char priority[4];
+    long long now = cprowl_now_ms();
+    int n;
+
+    /* a flood must not grow the queue without bound; pages still go */
+    if (cprowl_engine_pending(&s->engine) >= CPROWL_DAEMON_MAX_QUEUED &&
+        syslog_priority[m->severity] < CPROWL_PRIORITY_HIGH) {
+        CPROWL_METRICS_ADD(s->engine.metrics.rejected, 1);
+        return;
+    }
+    if (!cprowl_request_copy(&req, s->defaults)) {
+        return;
+    }
+
+    if (s->sl->set_app) {
+        if (m->host_len > 0) {
+            cprowl_request_set(&req, CPROWL_FIELD_APP, m->host, m->host_len);
+        } else {
+            cprowl_request_set(&req, CPROWL_FIELD_APP, s->hostname,
+                               strlen(s->hostname));
+        }
+    }
+    if (m->program_len > 0) {
+        n = snprintf(event, sizeof(event), "%.*s: %s",
+                     (int) (m->program_len < SYSLOG_MAX_PROGRAM ?
+                            m->program_len : SYSLOG_MAX_PROGRAM),
+                     m->program, syslog_severities[m->severity]);
+    } else {
+        n = snprintf(event, sizeof(event), "%s",
+                     syslog_severities[m->severity]);
+    }
+    cprowl_request_set(&req, CPROWL_FIELD_EVENT, event, n);
+    cprowl_request_set(&req, CPROWL_FIELD_DESCRIPTION, m->msg, m->msg_len);
+    n = snprintf(priority, sizeof(priority), "%d",
+                 syslog_priority[m->severity]);
+    cprowl_request_set(&req, CPROWL_FIELD_PRIORITY, priority, n);
+
+    if (s->opts->debug) {
+        fprintf(stderr, "syslog: %s.%s %s\n", syslog_facilities[m->facility],
+                syslog_severities[m->severity], event);
+    }
+
+    s->forwarded++;
+    if (s->coalescing) {
+        if (!cprowl_coalesce_check(&s->coalesce, &req, now)) {
+            cprowl_request_free(&req);
+            return;
+        }
+    }
+    cprowl_engine_submit_copy(&s->engine, &req);
+    cprowl_request_free(&req);
+}
+
+/* read and filter what has arrived; TRUE when more may be waiting */
+static int
+syslog_receive(syslog_t *s)
+{
+    int round, i, n;
+
+    for (round = 0; round < SYSLOG_ROUNDS; round++) {
+        for (i = 0; i < SYSLOG_BATCH; i++) {
+            s->msgs[i].msg_hdr.msg_iov = &s->iov[i];
+            s->msgs[i].msg_hdr.msg_iovlen = 1;
+            s->msgs[i].msg_hdr.msg_name = NULL;
+            s->msgs[i].msg_hdr.msg_namelen = 0;
+            s->msgs[i].msg_hdr.msg_control = NULL;
+            s->msgs[i].msg_hdr.msg_controllen = 0;
+        }
+        do {
+            n = recvmmsg(s->fd, s->msgs, SYSLOG_BATCH, 0, NULL);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            if (n < 0 && errno != EAGAIN) {
+                perror("recvmmsg");
+            }
+            return FALSE;
+        }
+
+        for (i = 0; i < n; i++) {
+            cprowl_syslog_msg_t m;
+            size_t len = s->msgs[i].msg_len;
+
+            if (len > SYSLOG_MAX) {
+                len = SYSLOG_MAX;
+            }
+            s->received++;
+            if (!cprowl_syslog_parse(&m, s->iov[i].iov_base, len)) {
+                s->invalid++;
+                continue;
+            }
+            if (syslog_wanted(s, &m)) {
+                syslog_notify(s, &m);
+            }
+        }
+        if (n < SYSLOG_BATCH) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* a unix datagram socket at a path, or udp:[host:]port */
+static int
+syslog_open(const char *listen)
+{
+    int fd = -1, size = SYSLOG_RCVBUF;
+
+    if (strncmp(listen, "udp:", 4) == 0) {
+        struct addrinfo hints, *res, *ai;
+        char host[256];
+        const char *port = strrchr(listen + 4, ':');
+        int err;
+
+        if (port) {
+            snprintf(host, sizeof(host), "%.*s", (int) (port - listen - 4),
+                     listen + 4);
+            port++;
+        } else {
+            host[0] = '\0';
+            port = listen + 4;
+        }
+        /* [::1]:514 */
+        if (host[0] == '[' && host[strlen(host) - 1] == ']') {
+            memmove(host, host + 1, strlen(host));
+            host[strlen(host) - 1] = '\0';
+        }
+
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_DGRAM;
+        hints.ai_flags = AI_PASSIVE;
+        if ((err = getaddrinfo(host[0] ? host : NULL, port, &hints,
+                               &res)) != 0) {
+            fprintf(stderr, "%s: %s\n", listen, gai_strerror(err));
+            return -1;
+        }
+        for (ai = res; ai; ai = ai->ai_next) {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                             ai->ai_protocol)) < 0) {
+                continue;
+            }
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(res);
+        if (fd < 0) {
+            perror(listen);
+            return -1;
+        }
+    } else {
+        struct sockaddr_un addr;
+
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(listen) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "socket path too long (%s)\n", listen);
+            return -1;
+        }
+        strcpy(addr.sun_path, listen);
+
+        if ((fd = socket(AF_UNIX, SOCK_DGRAM, 0)) < 0) {
+            perror("socket");
+            return -1;
+        }
+        unlink(listen);
+        if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+            perror(listen);
+            close(fd);
+            return -1;
+        }
+        /* anyone may log, as with /dev/log */
+        chmod(listen, 0666);
+    }
+
+    /* room for a burst while the engine has its turn */
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+int
+cprowl_syslog_run(const cprowl_syslog_t *sl, cprowl_add_request_t *defaults,
+                  const cprowl_options_t *opts)
+{
+    struct curl_waitfd wfd;
+    struct sigaction sa;
+    syslog_t *s;
+    int i, more = FALSE;
+    int rc = FALSE;
+
+    if ((s = calloc(1, sizeof(*s))) == NULL) {
+        return FALSE;
+    }
+    s->sl = sl;
+    s->defaults = defaults;
+    s->opts = opts;
+    s->fd = -1;
+    if (gethostname(s->hostname, sizeof(s->hostname) - 1) < 0) {
+        strcpy(s->hostname, "syslog");
+    }
+
+    if ((s->buf = malloc((size_t) SYSLOG_BATCH * SYSLOG_MAX)) == NULL) {
+        free(s);
+        return FALSE;
+    }
+    for (i = 0; i < SYSLOG_BATCH; i++) {
+        s->iov[i].iov_base = s->buf + (size_t) i * SYSLOG_MAX;
+        s->iov[i].iov_len = SYSLOG_MAX;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (!cprowl_engine_init(&s->engine, opts)) {
+        fprintf(stderr, "unable to initialize curl\n");
+        goto done;
+    }
+    if (opts->coalesce_ms > 0) {
+        if (!cprowl_coalesce_init(&s->coalesce, CPROWL_COALESCE_SLOTS,
+                                  opts->coalesce_ms, syslog_emit, s)) {
+            goto done;
+        }
+        s->coalescing = TRUE;
+    }
+    if ((s->fd = syslog_open(sl->listen)) < 0) {
+        goto done;
+    }
+    if (opts->debug) {
+        fprintf(stderr, "syslog: listening on %s\n", sl->listen);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = syslog_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    while (!syslog_stop) {
+        int timeout = more ? 0 : SYSLOG_POLL_MS;
+
+        wfd.fd = s->fd;
+        wfd.events = CURL_WAIT_POLLIN;
+        wfd.revents = 0;
+
+        if (s->coalescing) {
+            long t = cprowl_coalesce_timeout(&s->coalesce, cprowl_now_ms());
+            if (t >= 0 && t < timeout) {
+                timeout = (int) t;
+            }
+        }
+        cprowl_engine_poll(&s->engine, &wfd, 1, timeout);
+
+        more = (wfd.revents || more) ? syslog_receive(s) : FALSE;
+        if (s->coalescing) {
+            cprowl_coalesce_expire(&s->coalesce, cprowl_now_ms(), FALSE);
+        }
+    }
+
+    /* everything forwarded so far is still sent before exiting */
+    if (s->coalescing) {
+        cprowl_coalesce_expire(&s->coalesce, cprowl_now_ms(), TRUE);
+    }
+    cprowl_engine_run(&s->engine);
+    if (opts->debug) {
+        fprintf(stderr, "syslog: %llu received, %llu forwarded, "
+                "%llu invalid\n", s->received, s->forwarded, s->invalid);
+    }
+    rc = TRUE;
+
+done:
+    if (s->fd >= 0) {
+        close(s->fd);
+        if (strncmp(sl->listen, "udp:", 4) != 0) {
+            unlink(sl->listen);
+        }
+    }
+    cprowl_coalesce_cleanup(&s->coalesce);
+    cprowl_engine_cleanup(&s->engine);
+    free(s->buf);
+    free(s);
+    curl_global_cleanup();
+    return rc;
+}
@@ -0,0 +1,96 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdio.h>
+#include <sys/time.h>
+#include "cprowl.h"
+
+/*
+ * --timing writes one JSON object per HTTP request with curl's phase
+ * timers, so slow sends can be pinned on DNS, connect, TLS or the server
+ * and connection reuse can be checked across a fleet.  Times are in
+ * milliseconds since the start of the transfer.
+ */
+
+static double
+timing_ms(CURL *curl, CURLINFO info)
+{
+    curl_off_t us = 0;
+
+    curl_easy_getinfo(curl, info, &us);
+    return us / 1000.0;
+}
+
+/* url as a JSON string body, cut short rather than overflow */
+static const char*
+timing_escape(const char *s, char *buf, size_t len)
+{
+    size_t i = 0;
+
+    for (; s && *s && i + 7 < len; s++) {
+        unsigned char ch = (unsigned char) *s;
+        if (ch == '"' || ch == '\\') {
+            buf[i++] = '\\';
+            buf[i++] = ch;
+        } else if (ch < 0x20) {
+            i += snprintf(buf + i, len - i, "\\u%04x", ch);
+        } else {
+            buf[i++] = ch;
+        }
+    }
+    buf[i] = '\0';
+    return buf;
+}
+
+void
+cprowl_timing_write(FILE *out, CURL *curl, CURLcode res, int http_error_code)
+{
+    curl_off_t up = 0, down = 0;
+    long request_size = 0, header_size = 0, connects = 0;
+    struct timeval tv;
+    char *url = NULL, escaped[512];
+
+    if (out == NULL) {
+        return;
+    }
+
+    gettimeofday(&tv, NULL);
+    curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &url);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &up);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &down);
+    curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &request_size);
+    curl_easy_getinfo(curl, CURLINFO_HEADER_SIZE, &header_size);
+    curl_easy_getinfo(curl, CURLINFO_NUM_CONNECTS, &connects);
+
+    fprintf(out, "{\"time\":%lld.%03d,\"url\":\"%s\",\"result\":%d,"
+            "\"http_code\":%d,\"namelookup\":%.3f,\"connect\":%.3f,"
+            "\"appconnect\":%.3f,\"pretransfer\":%.3f,"
+            "\"starttransfer\":%.3f,\"total\":%.3f,\"bytes_sent\":%lld,"
+            "\"bytes_received\":%lld,\"reused\":%s}\n",
+            (long long) tv.tv_sec, (int) (tv.tv_usec / 1000),
+            timing_escape(url, escaped, sizeof(escaped)), (int) res, http_error_code,
+            timing_ms(curl, CURLINFO_NAMELOOKUP_TIME_T),
+            timing_ms(curl, CURLINFO_CONNECT_TIME_T),
+            timing_ms(curl, CURLINFO_APPCONNECT_TIME_T),
+            timing_ms(curl, CURLINFO_PRETRANSFER_TIME_T),
+            timing_ms(curl, CURLINFO_STARTTRANSFER_TIME_T),
+            timing_ms(curl, CURLINFO_TOTAL_TIME_T),
+            /* a body sent with the headers is in request_size already */
+            (long long) (request_size >= up ? request_size :
+                         request_size + up),
+            (long long) (header_size + down),
+            res == CURLE_OK && connects == 0 ? "true" : "false");
+    fflush(out);
+}
@@ -0,0 +1,234 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "cprowl.h"
+#include "cprowl_config.h"
+
+#ifdef HAVE_OPENSSL
+#include <openssl/opensslv.h>
+#include <openssl/ssl.h>
+#endif
+
+/*
+ * Connections are reused within a run, but every new run used to start
+ * with a full TLS handshake.  The session (or TLS 1.3 ticket) the server
+ * hands out is saved under <spool>/tls/<host>, and the next run offers it
+ * back, so its handshake is the abbreviated one.
+ *
+ * curl has no API to import or export sessions, so this works on the
+ * OpenSSL objects it exposes through CURLOPT_SSL_CTX_FUNCTION: a
+ * new-session callback (chained to curl's own, which keeps the in-process
+ * cache working) writes each session out, and an info callback sets the
+ * saved one on the connection just before its ClientHello is built.  It
+ * is only enabled when curl runs on the same OpenSSL cprowl is built
+ * against; otherwise every run does a full handshake, as before.
+ *
+ * Session files hold resumption secrets: the directory is 0700 and the
+ * files 0600, written to a temporary name and renamed into place.
+ */
+
+#ifdef HAVE_OPENSSL
+
+#define TLS_DIR "tls"
+#define TLS_MAX_SESSION (16 * 1024)
+
+static int tls_index = -1;
+static int (*tls_curl_new_session)(SSL *, SSL_SESSION *);
+
+/* the file for host; only plain host names map to one */
+static int
+tls_path(const cprowl_options_t *opts, const char *host, char *path,
+         size_t len)
+{
+    const char *p;
+
+    if (host == NULL || host[0] == '\0' || host[0] == '.') {
+        return FALSE;
+    }
+    for (p = host; *p; p++) {
+        if (!isalnum((unsigned char) *p) && *p != '.' && *p != '-') {
+            return FALSE;
+        }
+    }
+    return snprintf(path, len, "%s/%s/%s", opts->spool_dir, TLS_DIR,
+                    host) < (int) len;
+}
+
+static void
+tls_save(const cprowl_options_t *opts, const char *host, SSL_SESSION *sess)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    unsigned char buf[TLS_MAX_SESSION], *p = buf;
+    int len, fd;
+
+    if (!tls_path(opts, host, path, sizeof(path)) ||
+        (len = i2d_SSL_SESSION(sess, NULL)) <= 0 || len > (int) sizeof(buf)) {
+        return;
+    }
+    i2d_SSL_SESSION(sess, &p);
+
+    snprintf(tmp, sizeof(tmp), "%s/%s", opts->spool_dir, TLS_DIR);
+    mkdir(opts->spool_dir, 0700);
+    if (mkdir(tmp, 0700) < 0 && errno != EEXIST) {
+        return;
+    }
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) getpid());
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+              0600);
+    if (fd < 0) {
+        return;
+    }
+    if (write(fd, buf, len) != len || close(fd) < 0 || rename(tmp, path) < 0) {
+        unlink(tmp);
+    }
+    if (opts->debug) {
+        fprintf(stderr, "tls: saved session for %s\n", host);
+    }
+}
+
+static SSL_SESSION*
+tls_load(const cprowl_options_t *opts, const char *host)
+{
+    char path[PATH_MAX];
+    unsigned char buf[TLS_MAX_SESSION];
+    const unsigned char *p = buf;
+    SSL_SESSION *sess;
+    ssize_t len;
+    int fd;
+
+    if (!tls_path(opts, host, path, sizeof(path)) ||
+        (fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) < 0) {
+        return NULL;
+    }
+    len = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (len <= 0 || (sess = d2i_SSL_SESSION(NULL, &p, len)) == NULL) {
+        unlink(path);
+        return NULL;
+    }
+    if (!SSL_SESSION_is_resumable(sess) ||
+        SSL_SESSION_get_time(sess) + SSL_SESSION_get_timeout(sess) <=
+        time(NULL)) {
+        SSL_SESSION_free(sess);
+        unlink(path);
+        return NULL;
+    }
+    return sess;
+}
+
+static int
+tls_new_session(SSL *ssl, SSL_SESSION *sess)
+{
+    const cprowl_options_t *opts;
+    int rc = 0;
+
+    /* curl's callback keeps the session for connections in this run */
+    if (tls_curl_new_session) {
+        rc = tls_curl_new_session(ssl, sess);
+    }
+    opts = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_index);
+    if (opts && SSL_SESSION_is_resumable(sess)) {
+        tls_save(opts, SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name),
+                 sess);
+    }
+    return rc;
+}
+
+/* runs as the handshake starts, before the ClientHello is built */
+static void
+tls_info(const SSL *ssl, int where, int ret)
+{
+    const cprowl_options_t *opts;
+    const char *host;
+    SSL_SESSION *sess;
+
+    opts = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), tls_index);
+    host = SSL_get_servername(ssl, TLSEXT_NAMETYPE_host_name);
+    if ((where & SSL_CB_HANDSHAKE_DONE) && opts && opts->debug) {
+        fprintf(stderr, "tls: %s handshake with %s\n",
+                SSL_session_reused((SSL *) ssl) ? "resumed" : "full",
+                host ? host : "?");
+    }
+    /* curl found one in its own cache; nothing to do */
+    if (!(where & SSL_CB_HANDSHAKE_START) || SSL_get_session(ssl) != NULL ||
+        SSL_is_init_finished(ssl)) {
+        return;
+    }
+    if (opts && host && (sess = tls_load(opts, host)) != NULL) {
+        SSL_set_session((SSL *) ssl, sess);
+        SSL_SESSION_free(sess);
+        if (opts->debug) {
+            fprintf(stderr, "tls: offering saved session for %s\n", host);
+        }
+    }
+}
+
+static CURLcode
+tls_ctx(CURL *curl, void *sslctx, void *arg)
+{
+    SSL_CTX *ctx = sslctx;
+    int (*cb)(SSL *, SSL_SESSION *) = SSL_CTX_sess_get_new_cb(ctx);
+
+    if (tls_index < 0) {
+        tls_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+    }
+    if (cb != tls_new_session) {
+        tls_curl_new_session = cb;
+    }
+    SSL_CTX_set_ex_data(ctx, tls_index, arg);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_CTX_get_session_cache_mode(ctx) |
+                                   SSL_SESS_CACHE_CLIENT);
+    SSL_CTX_sess_set_new_cb(ctx, tls_new_session);
+    SSL_CTX_set_info_callback(ctx, tls_info);
+    return CURLE_OK;
+}
+
+/* TRUE when curl's SSL_CTX is one our OpenSSL can work with */
+static int
+tls_usable(void)
+{
+    static int usable = -1;
+    const char *v;
+
+    if (usable < 0) {
+        v = curl_version_info(CURLVERSION_NOW)->ssl_version;
+        usable = v && strncmp(v, "OpenSSL/", 8) == 0 &&
+                 atoi(v + 8) == OPENSSL_VERSION_MAJOR;
+    }
+    return usable;
+}
+
+#endif /* HAVE_OPENSSL */
+
+/* save TLS sessions of this handle's connections and resume from them */
+void
+cprowl_tls_setup(CURL *curl, const cprowl_options_t *opts)
+{
+#ifdef HAVE_OPENSSL
+    if (tls_usable()) {
+        curl_easy_setopt(curl, CURLOPT_SSL_CTX_FUNCTION, tls_ctx);
+        curl_easy_setopt(curl, CURLOPT_SSL_CTX_DATA, (void *) opts);
+    }
+#endif
+}
@@ -0,0 +1,556 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#define _GNU_SOURCE     /* memrchr */
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "cprowl.h"
+
+/*
+ * Watch mode follows log files and sends a notification for every line
+ * that contains one of the --match patterns, with the lines before it as
+ * context.  Files are followed through inotify watches on their
+ * directories, so a file that is rotated away and recreated, or that does
+ * not exist yet, is picked up when it appears; a file that shrinks was
+ * truncated and is read again from the start.  A one second poll catches
+ * changes inotify misses, such as on network filesystems.
+ *
+ * Offsets are saved to a state file, so a restart continues where the
+ * last run stopped instead of sending old matches again.  Files the state
+ * knows nothing about are followed from their current end, like tail -f.
+ *
+ * Each file is read through its own fixed buffer and scanned in place by
+ * the matcher (match.c); only complete lines are scanned.  The last
+ * --context lines already scanned stay at the front of the buffer, so a
+ * match has its context even when the lines before it came in earlier
+ * reads.
+ */
+
+#define WATCH_BUF (256 * 1024)
+#define WATCH_READ_MAX (16 * 1024 * 1024)   /* per file between polls */
+#define WATCH_POLL_MS 1000
+#define WATCH_EVENTS (IN_MODIFY | IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE)
+
+typedef struct {
+    const char *path;
+    const char *name;       /* last path component, as inotify reports it */
+    int wd;                 /* watch on the directory */
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    off_t offset;           /* file offset of buf[0] */
+    char *buf;
+    size_t len;             /* bytes in buf, at most one incomplete line */
+    size_t kept;            /* scanned lines kept in front for context */
+} watch_file_t;
+
+typedef struct {
+    const cprowl_watch_t *watch;
+    cprowl_add_request_t *defaults;
+    const cprowl_options_t *opts;
+    const char *state;
+    cprowl_engine_t engine;
+    cprowl_coalesce_t coalesce;
+    int coalescing;
+    cprowl_matcher_t matcher;
+    watch_file_t *files;
+    int inotify;
+    int dirty;              /* offsets changed since the last save */
+} watch_t;
+
+static volatile sig_atomic_t watch_stop = 0;
+
+static void
+watch_signal(int sig)
+{
+    (void) sig;
+    watch_stop = 1;
+}
+
+const char*
+cprowl_watch_default_state(const char *spool_dir)
+{
+    static char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/watch.state", spool_dir);
+    return path;
+}
+
+/* summaries of coalesced repeats are sent like any other match */
+static void
+watch_emit(cprowl_add_request_t *req, void *arg)
+{
+    watch_t *w = arg;
+    cprowl_engine_submit_copy(&w->engine, req);
+}
+
+static void
+watch_notify(watch_t *w, watch_file_t *f, unsigned which,
+             const char *text, size_t len)
+{
+    cprowl_add_request_t req;
+    long long now = cprowl_now_ms();
+
+    if (!cprowl_request_copy(&req, w->defaults)) {
+        return;
+    }
+    if (w->watch->set_event) {
+        char event[CPROWL_MAX_LENGTH_EVENT];
+        int n = snprintf(event, sizeof(event), "%s: %s", f->name,
+                         w->watch->patterns[which]);
+        cprowl_request_set(&req, CPROWL_FIELD_EVENT, event,
+                           n < (int) sizeof(event) ? (size_t) n :
+                           sizeof(event) - 1);
+    }
+    /* the matching line is last; context goes first when it is too long */
+    if (len > CPROWL_MAX_LENGTH_DESC) {
+        text += len - CPROWL_MAX_LENGTH_DESC;
+        len = CPROWL_MAX_LENGTH_DESC;
+    }
+    cprowl_request_set(&req, CPROWL_FIELD_DESCRIPTION, text, len);
+
+    if (w->opts->debug) {
+        fprintf(stderr, "%s: match \"%s\" at offset %lld\n", f->path,
+                w->watch->patterns[which],
+                (long long) f->offset + (text - f->buf));
+    }
+
+    if (w->coalescing) {
+        if (!cprowl_coalesce_check(&w->coalesce, &req, now)) {
+            cprowl_request_free(&req);
+            return;
+        }
+    }
+    cprowl_engine_submit_copy(&w->engine, &req);
+    cprowl_request_free(&req);
+}
+
+/* scan the complete lines in the buffer and drop them; force treats an
+ * unterminated tail as a line too */
+static void
+watch_scan(watch_t *w, watch_file_t *f, int force)
+{
+    char *buf = f->buf, *nl;
+    size_t end, used, keep, pos = f->kept;
+    unsigned which, lines;
+    long m;
+
+    if ((nl = memrchr(buf + f->kept, '\n', f->len - f->kept)) != NULL) {
+        end = nl - buf;
+        used = end + 1;
+    } else if (force || f->len == WATCH_BUF) {
+        end = used = f->len;    /* a line longer than the buffer is cut */
+    } else {
+        return;
+    }
+
+    while (pos < end &&
+           (m = cprowl_matcher_find(&w->matcher, buf + pos, end - pos,
+                                    &which)) >= 0) {
+        size_t match = pos + m, first, last;
+
+        lines = w->watch->context;
+        /* the matching line, and the lines before it within the buffer */
+        nl = memrchr(buf, '\n', match);
+        first = nl ? (size_t) (nl - buf) + 1 : 0;
+        for (; lines > 0 && first > 0; lines--) {
+            nl = memrchr(buf, '\n', first - 1);
+            first = nl ? (size_t) (nl - buf) + 1 : 0;
+        }
+        nl = memchr(buf + match, '\n', end - match);
+        last = nl ? (size_t) (nl - buf) : end;
+
+        watch_notify(w, f, which, buf + first, last - first);
+        pos = last + 1;
+    }
+
+    /* keep the last lines for the context of a later match, unless they
+     * would crowd out the next read or leave no room for it at all, as
+     * with a short line followed by one longer than the buffer */
+    keep = used;
+    for (lines = w->watch->context; lines > 0 && keep > 0; lines--) {
+        nl = memrchr(buf, '\n', keep - 1);
+        keep = nl ? (size_t) (nl - buf) + 1 : 0;
+    }
+    if (used - keep > WATCH_BUF / 2 || f->len - keep == WATCH_BUF) {
+        keep = used;
+    }
+
+    memmove(buf, buf + keep, f->len - keep);
+    f->len -= keep;
+    f->offset += keep;
+    f->kept = used - keep;
+    w->dirty = TRUE;
+}
+
+static int
+watch_open(watch_t *w, watch_file_t *f, off_t offset, int at_end)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(f->path, O_RDONLY | O_CLOEXEC)) < 0) {
+        return FALSE;
+    }
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return FALSE;
+    }
+    if (at_end || offset > st.st_size) {
+        offset = at_end ? st.st_size : 0;
+    }
+    lseek(fd, offset, SEEK_SET);
+
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->offset = offset;
+    f->len = 0;
+    f->kept = 0;
+    w->dirty = TRUE;
+    if (w->opts->debug) {
+        fprintf(stderr, "%s: following from offset %lld\n", f->path,
+                (long long) offset);
+    }
+    return TRUE;
+}
+
+static void
+watch_close(watch_file_t *f)
+{
+    if (f->fd >= 0) {
+        close(f->fd);
+        f->fd = -1;
+    }
+    f->len = 0;
+    f->kept = 0;
+}
+
+/* read what was appended; TRUE when more may be waiting */
+static int
+watch_read(watch_t *w, watch_file_t *f)
+{
+    struct stat st;
+    size_t total = 0;
+    ssize_t n;
+
+    if (f->fd < 0 && !watch_open(w, f, 0, FALSE)) {
+        return FALSE;
+    }
+
+    for (;;) {
+        while (total < WATCH_READ_MAX) {
+            /* a read into a full buffer would look like the end */
+            if (f->len == WATCH_BUF) {
+                watch_scan(w, f, TRUE);
+            }
+            if ((n = read(f->fd, f->buf + f->len, WATCH_BUF - f->len)) <= 0) {
+                break;
+            }
+            f->len += n;
+            total += n;
+            watch_scan(w, f, FALSE);
+        }
+        if (total >= WATCH_READ_MAX) {
+            return TRUE;
+        }
+
+        if (stat(f->path, &st) == 0 &&
+            (st.st_ino != f->ino || st.st_dev != f->dev)) {
+            /* rotated: the old file is drained, follow the new one from
+             * its start */
+            watch_scan(w, f, TRUE);
+            watch_close(f);
+            if (!watch_open(w, f, 0, FALSE)) {
+                return FALSE;
+            }
+            continue;
+        }
+        if (fstat(f->fd, &st) == 0 && st.st_size < f->offset + (off_t) f->len) {
+            /* truncated in place */
+            if (w->opts->debug) {
+                fprintf(stderr, "%s: truncated\n", f->path);
+            }
+            lseek(f->fd, 0, SEEK_SET);
+            f->offset = 0;
+            f->len = 0;
+            f->kept = 0;
+            w->dirty = TRUE;
+            continue;
+        }
+        return FALSE;
+    }
+}
+
+/* "dev ino offset path" per line */
+static void
+watch_load(watch_t *w)
+{
+    char line[PATH_MAX + 64];
+    FILE *fp;
+    size_t i;
+
+    fp = fopen(w->state, "r");
+
+    for (i = 0; i < w->watch->nfiles; i++) {
+        watch_file_t *f = &w->files[i];
+        int found = FALSE;
+
+        if (fp) {
+            rewind(fp);
+            while (!found && fgets(line, sizeof(line), fp)) {
+                unsigned long long dev, ino;
+                long long offset;
+                int n = 0;
+
+                line[strcspn(line, "\n")] = '\0';
+                if (sscanf(line, "%llu %llu %lld %n", &dev, &ino, &offset,
+                           &n) != 3 || n == 0 || strcmp(line + n, f->path)) {
+                    continue;
+                }
+                found = TRUE;
+                if (watch_open(w, f, 0, FALSE) &&
+                    f->dev == (dev_t) dev && f->ino == (ino_t) ino) {
+                    watch_close(f);
+                    watch_open(w, f, (off_t) offset, FALSE);
+                }
+                /* otherwise it was rotated while we were away */
+            }
+        }
+        if (!found) {
+            watch_open(w, f, 0, TRUE);
+        }
+    }
+
+    if (fp) {
+        fclose(fp);
+    }
+}
+
+static void
+watch_save(watch_t *w)
+{
+    char tmp[PATH_MAX];
+    FILE *fp;
+    size_t i;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", w->state);
+    if ((fp = fopen(tmp, "w")) == NULL) {
+        perror(tmp);
+        return;
+    }
+    for (i = 0; i < w->watch->nfiles; i++) {
+        watch_file_t *f = &w->files[i];
+        if (f->fd >= 0) {
+            fprintf(fp, "%llu %llu %lld %s\n", (unsigned long long) f->dev,
+                    (unsigned long long) f->ino,
+                    (long long) (f->offset + f->kept),
+                    f->path);
+        }
+    }
+    if (fclose(fp) != 0 || rename(tmp, w->state) < 0) {
+        perror(w->state);
+        unlink(tmp);
+        return;
+    }
+    w->dirty = FALSE;
+}
+
+/* TRUE when some file may have more to read right away */
+static int
+watch_events(watch_t *w)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int more = FALSE;
+    ssize_t n;
+    size_t i;
+
+    while ((n = read(w->inotify, events, sizeof(events))) > 0) {
+        char *p = events;
+
+        while (p < events + n) {
+            struct inotify_event *ev = (struct inotify_event *) p;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                more = TRUE;    /* events were lost; read everything */
+            }
+
+            for (i = 0; i < w->watch->nfiles; i++) {
+                watch_file_t *f = &w->files[i];
+                if (ev->wd == f->wd && ev->len > 0 &&
+                    strcmp(ev->name, f->name) == 0) {
+                    more |= watch_read(w, f);
+                }
+            }
+            p += sizeof(*ev) + ev->len;
+        }
+    }
+    return more;
+}
+
+int
+cprowl_watch_run(const cprowl_watch_t *watch, cprowl_add_request_t *defaults,
+                 const cprowl_options_t *opts)
+{
+    struct curl_waitfd wfd;
+    struct sigaction sa;
+    long long last_poll, last_save;
+    watch_t *w;
+    size_t i;
+    int more = FALSE;
+    int rc = FALSE;
+
+    if ((w = calloc(1, sizeof(*w))) == NULL) {
+        return FALSE;
+    }
+    w->watch = watch;
+    w->defaults = defaults;
+    w->opts = opts;
+    w->state = watch->state ? watch->state : cprowl_watch_default_state(opts->spool_dir);
+    w->inotify = -1;
+
+    if (!cprowl_matcher_init(&w->matcher, watch->patterns,
+                             watch->npatterns)) {
+        free(w);
+        return FALSE;
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    if (!cprowl_engine_init(&w->engine, opts)) {
+        fprintf(stderr, "unable to initialize curl\n");
+        goto done;
+    }
+    if (opts->coalesce_ms > 0) {
+        if (!cprowl_coalesce_init(&w->coalesce, CPROWL_COALESCE_SLOTS,
+                                  opts->coalesce_ms, watch_emit, w)) {
+            goto done;
+        }
+        w->coalescing = TRUE;
+    }
+
+    if ((w->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        perror("inotify");
+        goto done;
+    }
+    if ((w->files = calloc(watch->nfiles, sizeof(*w->files))) == NULL) {
+        goto done;
+    }
+    for (i = 0; i < watch->nfiles; i++) {
+        watch_file_t *f = &w->files[i];
+        char dir[PATH_MAX];
+        const char *slash = strrchr(watch->files[i], '/');
+
+        f->path = watch->files[i];
+        f->name = slash ? slash + 1 : f->path;
+        f->fd = -1;
+        if (slash == f->path) {
+            strcpy(dir, "/");
+        } else if (slash) {
+            snprintf(dir, sizeof(dir), "%.*s", (int) (slash - f->path),
+                     f->path);
+        } else {
+            strcpy(dir, ".");
+        }
+        if ((f->wd = inotify_add_watch(w->inotify, dir, WATCH_EVENTS)) < 0) {
+            perror(dir);
+            goto done;
+        }
+        if ((f->buf = malloc(WATCH_BUF)) == NULL) {
+            goto done;
+        }
+    }
+
+    /* the default state file lives next to the spool */
+    if (!watch->state && mkdir(opts->spool_dir, 0700) < 0 &&
+        errno != EEXIST) {
+        perror(opts->spool_dir);
+    }
+    watch_load(w);
+    for (i = 0; i < watch->nfiles; i++) {
+        more |= watch_read(w, &w->files[i]);
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = watch_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    last_poll = last_save = cprowl_now_ms();
+    while (!watch_stop) {
+        int timeout = more ? 0 : WATCH_POLL_MS;
+        long long now;
+
+        wfd.fd = w->inotify;
+        wfd.events = CURL_WAIT_POLLIN;
+        wfd.revents = 0;
+
+        if (w->coalescing) {
+            long t = cprowl_coalesce_timeout(&w->coalesce, cprowl_now_ms());
+            if (t >= 0 && t < timeout) {
+                timeout = (int) t;
+            }
+        }
+        cprowl_engine_poll(&w->engine, &wfd, 1, timeout);
+
+        more = wfd.revents ? watch_events(w) : FALSE;
+        now = cprowl_now_ms();
+        if (more || now - last_poll >= WATCH_POLL_MS) {
+            more = FALSE;
+            for (i = 0; i < watch->nfiles; i++) {
+                more |= watch_read(w, &w->files[i]);
+            }
+            last_poll = now;
+        }
+        if (w->coalescing) {
+            cprowl_coalesce_expire(&w->coalesce, now, FALSE);
+        }
+        if (w->dirty && now - last_save >= WATCH_POLL_MS) {
+            watch_save(w);
+            last_save = now;
+        }
+    }
+
+    /* everything matched so far is still sent before exiting */
+    if (w->coalescing) {
+        cprowl_coalesce_expire(&w->coalesce, cprowl_now_ms(), TRUE);
+    }
+    cprowl_engine_run(&w->engine);
+    watch_save(w);
+    rc = TRUE;
+
+done:
+    for (i = 0; w->files && i < watch->nfiles; i++) {
+        watch_close(&w->files[i]);
+        free(w->files[i].buf);
+    }
+    free(w->files);
+    if (w->inotify >= 0) {
+        close(w->inotify);
+    }
+    cprowl_coalesce_cleanup(&w->coalesce);
+    cprowl_engine_cleanup(&w->engine);
+    cprowl_matcher_cleanup(&w->matcher);
+    free(w);
+    curl_global_cleanup();
+    return rc;
+}
@@ -0,0 +1,122 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdlib.h>
+#include "cprowl.h"
+
+/*
+ * A hashed timing wheel.  Time is cut into ticks and each tick hashes to a
+ * slot; a timer further away than one turn of the wheel also records how
+ * many full turns it has to wait.  Adding and cancelling a timer are O(1)
+ * and each tick only looks at the timers in its own slot, so thousands of
+ * pending timers cost nothing until they are due.
+ */
+
+int
+cprowl_wheel_init(cprowl_wheel_t *wheel, size_t nslots, long tick_ms,
+                  long long now)
+{
+    size_t size = 1, i;
+
+    while (size < nslots) {
+        size <<= 1;
+    }
+    if ((wheel->slots = malloc(size * sizeof(*wheel->slots))) == NULL) {
+        return FALSE;
+    }
+    for (i = 0; i < size; i++) {
+        LIST_INIT(&wheel->slots[i]);
+    }
+    wheel->mask = size - 1;
+    wheel->tick_ms = tick_ms;
+    wheel->tick = now / tick_ms;
+    wheel->count = 0;
+    return TRUE;
+}
+
+void
+cprowl_wheel_cleanup(cprowl_wheel_t *wheel)
+{
+    free(wheel->slots);
+    wheel->slots = NULL;
+    wheel->count = 0;
+}
+
+/* arm timer to fire at due (ms, the clock of cprowl_now_ms()) */
+void
+cprowl_wheel_add(cprowl_wheel_t *wheel, cprowl_timer_t *timer, long long due)
+{
+    long long tick = (due + wheel->tick_ms - 1) / wheel->tick_ms;
+    long long ahead;
+
+    /* a timer already due fires on the next tick */
+    if (tick <= wheel->tick) {
+        tick = wheel->tick + 1;
+    }
+    ahead = tick - wheel->tick - 1;
+    timer->rounds = (unsigned) (ahead / (wheel->mask + 1));
+    LIST_INSERT_HEAD(&wheel->slots[tick & wheel->mask], timer, entries);
+    wheel->count++;
+}
+
+void
+cprowl_wheel_cancel(cprowl_wheel_t *wheel, cprowl_timer_t *timer)
+{
+    LIST_REMOVE(timer, entries);
+    wheel->count--;
+}
+
+/* fire every timer due by now; fire may add new timers */
+void
+cprowl_wheel_advance(cprowl_wheel_t *wheel, long long now,
+                     void (*fire)(cprowl_timer_t *timer, void *arg),
+                     void *arg)
+{
+    long long target = now / wheel->tick_ms;
+
+    while (wheel->tick < target && wheel->count > 0) {
+        struct cprowl_timer_head *slot;
+        cprowl_timer_t *timer, *next;
+
+        wheel->tick++;
+        slot = &wheel->slots[wheel->tick & wheel->mask];
+        for (timer = LIST_FIRST(slot); timer != NULL; timer = next) {
+            next = LIST_NEXT(timer, entries);
+            if (timer->rounds > 0) {
+                timer->rounds--;
+                continue;
+            }
+            LIST_REMOVE(timer, entries);
+            wheel->count--;
+            fire(timer, arg);
+        }
+    }
+    /* nothing pending: skip the empty ticks in one step */
+    if (wheel->tick < target) {
+        wheel->tick = target;
+    }
+}
+
+/* milliseconds until the next tick, -1 when no timer is armed */
+long
+cprowl_wheel_timeout(cprowl_wheel_t *wheel, long long now)
+{
+    long long next = (wheel->tick + 1) * wheel->tick_ms;
+
+    if (wheel->count == 0) {
+        return -1;
+    }
+    return next > now ? (long) (next - now) : 0;
+}
@@ -0,0 +1,608 @@
+/*
+   Copyright 2010 Ryan Phillips
+
+   Licensed under the Apache License, Version 2.0 (the "License");
+   you may not use this file except in compliance with the License.
+   You may obtain a copy of the License at
+
+       http://www.apache.org/licenses/LICENSE-2.0
+
+   Unless required by applicable law or agreed to in writing, software
+   distributed under the License is distributed on an "AS IS" BASIS,
+   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+   See the License for the specific language governing permissions and
+   limitations under the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "cprowl.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define WIRE_AVX2
+#endif
+
+/*
+ * A request is serialized once as an application/x-www-form-urlencoded
+ * body:
+ *
+ *   apikey=k1%2Ck2&application=..&event=..&description=..&priority=..
+ *
+ * The same text is the HTTP POST body, the line sent from client to daemon
+ * (with a trailing '\n') and the payload of spool records.
+ */
+
+/* "%XX" for every byte, written as one 4-byte store */
+#define HEX(n) ((n) < 10 ? '0' + (n) : 'A' + (n) - 10)
+#define PCT(b) { '%', HEX((b) >> 4), HEX((b) & 15), 0 }
+#define PCT16(h) PCT(h * 16 + 0), PCT(h * 16 + 1), PCT(h * 16 + 2), \
+    PCT(h * 16 + 3), PCT(h * 16 + 4), PCT(h * 16 + 5), PCT(h * 16 + 6), \
+    PCT(h * 16 + 7), PCT(h * 16 + 8), PCT(h * 16 + 9), PCT(h * 16 + 10), \
+    PCT(h * 16 + 11), PCT(h * 16 + 12), PCT(h * 16 + 13), \
+    PCT(h * 16 + 14), PCT(h * 16 + 15)
+static const char pct[256][4] = {
+    PCT16(0), PCT16(1), PCT16(2), PCT16(3), PCT16(4), PCT16(5), PCT16(6),
+    PCT16(7), PCT16(8), PCT16(9), PCT16(10), PCT16(11), PCT16(12),
+    PCT16(13), PCT16(14), PCT16(15)
+};
+#undef PCT16
+#undef PCT
+#undef HEX
+
+/* bytes that are copied unescaped; space becomes '+' */
+#define U 1
+static const unsigned char unreserved[256] = {
+    ['a'] = U, ['b'] = U, ['c'] = U, ['d'] = U, ['e'] = U, ['f'] = U,
+    ['g'] = U, ['h'] = U, ['i'] = U, ['j'] = U, ['k'] = U, ['l'] = U,
+    ['m'] = U, ['n'] = U, ['o'] = U, ['p'] = U, ['q'] = U, ['r'] = U,
+    ['s'] = U, ['t'] = U, ['u'] = U, ['v'] = U, ['w'] = U, ['x'] = U,
+    ['y'] = U, ['z'] = U,
+    ['A'] = U, ['B'] = U, ['C'] = U, ['D'] = U, ['E'] = U, ['F'] = U,
+    ['G'] = U, ['H'] = U, ['I'] = U, ['J'] = U, ['K'] = U, ['L'] = U,
+    ['M'] = U, ['N'] = U, ['O'] = U, ['P'] = U, ['Q'] = U, ['R'] = U,
+    ['S'] = U, ['T'] = U, ['U'] = U, ['V'] = U, ['W'] = U, ['X'] = U,
+    ['Y'] = U, ['Z'] = U,
+    ['0'] = U, ['1'] = U, ['2'] = U, ['3'] = U, ['4'] = U, ['5'] = U,
+    ['6'] = U, ['7'] = U, ['8'] = U, ['9'] = U,
+    ['-'] = U, ['.'] = U, ['_'] = U, ['~'] = U
+};
+#undef U
+
+static char*
+wire_literal(char *out, const char *s)
+{
+    while (*s) {
+        *out++ = *s++;
+    }
+    return out;
+}
+
+/* the UTF-8 sequence at p, checked on the way; a byte that starts no
+ * valid sequence becomes U+FFFD */
+static char*
+wire_escape_utf8(char *out, const unsigned char **pp, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+    size_t i, n;
+    unsigned char lo = 0x80, hi = 0xbf;
+
+    /* the second byte's range rules out overlongs, surrogates and
+     * code points past U+10FFFF */
+    if (*p >= 0xc2 && *p <= 0xdf) {
+        n = 2;
+    } else if (*p >= 0xe0 && *p <= 0xef) {
+        n = 3;
+        lo = *p == 0xe0 ? 0xa0 : 0x80;
+        hi = *p == 0xed ? 0x9f : 0xbf;
+    } else if (*p >= 0xf0 && *p <= 0xf4) {
+        n = 4;
+        lo = *p == 0xf0 ? 0x90 : 0x80;
+        hi = *p == 0xf4 ? 0x8f : 0xbf;
+    } else {
+        n = 0;
+    }
+    if (n == 0 || (size_t) (end - p) < n || p[1] < lo || p[1] > hi) {
+        goto invalid;
+    }
+    for (i = 2; i < n; i++) {
+        if ((p[i] & 0xc0) != 0x80) {
+            goto invalid;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        memcpy(out, pct[p[i]], 4);
+        out += 3;
+    }
+    *pp = p + n;
+    return out;
+
+invalid:
+    *pp = p + 1;
+    return wire_literal(out, "%EF%BF%BD");
+}
+
+/* escape from *pp until limit; a UTF-8 sequence may run on to end */
+static inline char*
+wire_escape_run(char *out, const unsigned char **pp,
+                const unsigned char *limit, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+
+    while (p < limit) {
+        if (unreserved[*p]) {
+            *out++ = *p++;
+        } else if (*p == ' ') {
+            *out++ = '+';
+            p++;
+        } else if (*p < 0x80) {
+            memcpy(out, pct[*p++], 4);
+            out += 3;
+        } else {
+            out = wire_escape_utf8(out, &p, end);
+        }
+    }
+    *pp = p;
+    return out;
+}
+
+static char*
+wire_escape_scalar(char *out, const unsigned char *p, size_t len)
+{
+    return wire_escape_run(out, &p, p + len, p + len);
+}
+
+/* a block of w bytes at *pp, the bytes to escape at the bits of mask; tx
+ * holds the block with spaces turned into '+' and room to read 32 bytes
+ * past any of them.  Runs between escapes are copied whole. */
+static inline char*
+wire_escape_block(char *out, const unsigned char **pp, const unsigned char *tx,
+                  unsigned mask, unsigned w, const unsigned char *end)
+{
+    const unsigned char *p = *pp;
+    unsigned n, q = 0;
+
+    while (mask) {
+        n = __builtin_ctz(mask);
+        memcpy(out, tx + q, 32);
+        out += n - q;
+        if (p[n] >= 0x80) {
+            /* UTF-8 is checked byte by byte */
+            p += n;
+            out = wire_escape_run(out, &p, *pp + w, end);
+            *pp = p;
+            return out;
+        }
+        memcpy(out, pct[p[n]], 4);
+        out += 3;
+        q = n + 1;
+        mask &= mask - 1;
+    }
+    memcpy(out, tx + q, 32);
+    *pp = p + w;
+    return out + (w - q);
+}
+
+/*
+ * The vector kernels classify a block of bytes at once.  A block of
+ * unreserved bytes and spaces is stored in one go, spaces turned into
+ * '+'; otherwise the runs between the bytes that need escaping are
+ * copied from the translated block.  Stores may run past what is kept,
+ * which CPROWL_WIRE_ESCAPE_SIZE() leaves room for.
+ */
+#ifdef __SSE2__
+static char*
+wire_escape_sse2(char *out, const unsigned char *p, size_t len)
+{
+    const unsigned char *end = p + len;
+    unsigned char tx[64] __attribute__((aligned(16)));
+    const __m128i space = _mm_set1_epi8(' '), plus = _mm_set1_epi8('+');
+
+    while (end - p >= 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *) p);
+        __m128i l = _mm_or_si128(x, _mm_set1_epi8(0x20));
+        __m128i sp = _mm_cmpeq_epi8(x, space);
+        __m128i ok;
+        unsigned mask;
+
+        /* bytes >= 0x80 are negative, so fail both ranges */
+        ok = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)),
+                           _mm_cmpgt_epi8(_mm_set1_epi8('z' + 1), l));
+        ok = _mm_or_si128(ok, _mm_and_si128(
+                 _mm_cmpgt_epi8(x, _mm_set1_epi8('0' - 1)),
+                 _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), x)));
+        ok = _mm_or_si128(ok, _mm_or_si128(
+                 _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('-')),
+                              _mm_cmpeq_epi8(x, _mm_set1_epi8('.'))),
+                 _mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8('_')),
+                              _mm_cmpeq_epi8(x, _mm_set1_epi8('~')))));
+        ok = _mm_or_si128(ok, sp);
+
+        x = _mm_or_si128(_mm_andnot_si128(sp, x), _mm_and_si128(sp, plus));
+        mask = ~_mm_movemask_epi8(ok) & 0xffff;
+        if (mask == 0) {
+            _mm_storeu_si128((__m128i *) out, x);
+            p += 16;
+            out += 16;
+            continue;
+        }
+        _mm_store_si128((__m128i *) tx, x);
+        out = wire_escape_block(out, &p, tx, mask, 16, end);
+    }
+    return wire_escape_scalar(out, p, end - p);
+}
+#endif
+
+#ifdef WIRE_AVX2
+__attribute__((target("avx2")))
+static char*
+wire_escape_avx2(char *out, const unsigned char *p, size_t len)
+{
+    const unsigned char *end = p + len;
+    unsigned char tx[64] __attribute__((aligned(32)));
+    const __m256i space = _mm256_set1_epi8(' '), plus = _mm256_set1_epi8('+');
+
+    while (end - p >= 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *) p);
+        __m256i l = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+        __m256i sp = _mm256_cmpeq_epi8(x, space);
+        __m256i ok;
+        unsigned mask;
+
+        ok = _mm256_and_si256(_mm256_cmpgt_epi8(l, _mm256_set1_epi8('a' - 1)),
+                              _mm256_cmpgt_epi8(_mm256_set1_epi8('z' + 1), l));
+        ok = _mm256_or_si256(ok, _mm256_and_si256(
+                 _mm256_cmpgt_epi8(x, _mm256_set1_epi8('0' - 1)),
+                 _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), x)));
+        ok = _mm256_or_si256(ok, _mm256_or_si256(
+                 _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('-')),
+                                 _mm256_cmpeq_epi8(x, _mm256_set1_epi8('.'))),
+                 _mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')),
+                                 _mm256_cmpeq_epi8(x, _mm256_set1_epi8('~')))));
+        ok = _mm256_or_si256(ok, sp);
+
+        x = _mm256_blendv_epi8(x, plus, sp);
+        mask = ~(unsigned) _mm256_movemask_epi8(ok);
+        if (mask == 0) {
+            _mm256_storeu_si256((__m256i *) out, x);
+            p += 32;
+            out += 32;
+            continue;
+        }
+        _mm256_store_si256((__m256i *) tx, x);
+        out = wire_escape_block(out, &p, tx, mask, 32, end);
+    }
+    return wire_escape_sse2(out, p, end - p);
+}
+#endif
+
+typedef char *(*wire_escape_fn)(char *, const unsigned char *, size_t);
+
+static char *wire_escape_resolve(char *out, const unsigned char *p,
+                                 size_t len);
+
+static wire_escape_fn wire_escape_impl = wire_escape_resolve;
+
+/* pick a kernel by name, or NULL for the best the CPU runs; FALSE when
+ * that kernel is not available */
+int
+cprowl_wire_escape_select(const char *name)
+{
+    wire_escape_fn fn = wire_escape_scalar;
+
+#ifdef __SSE2__
+    if (name == NULL || strcmp(name, "sse2") == 0) {
+        fn = wire_escape_sse2;
+    }
+#endif
+#ifdef WIRE_AVX2
+    if ((name == NULL || strcmp(name, "avx2") == 0) &&
+        __builtin_cpu_supports("avx2")) {
+        fn = wire_escape_avx2;
+    }
+#endif
+    if (name && fn == wire_escape_scalar && strcmp(name, "scalar") != 0) {
+        return FALSE;
+    }
+    /* racing threads all store the same pointer */
+    wire_escape_impl = fn;
+    return TRUE;
+}
+
+static char*
+wire_escape_resolve(char *out, const unsigned char *p, size_t len)
+{
+    cprowl_wire_escape_select(NULL);
+    return wire_escape_impl(out, p, len);
+}
+
+/* urlencode len bytes of value into out, which must have room for
+ * CPROWL_WIRE_ESCAPE_SIZE(len) bytes; invalid UTF-8 is replaced by
+ * U+FFFD.  Returns the end. */
+char*
+cprowl_wire_escape(char *out, const char *value, size_t len)
+{
+    return wire_escape_impl(out, (const unsigned char *) value, len);
+}
+
+/* upper bound of the serialized size */
+static size_t
+wire_size(cprowl_add_request_t *req, size_t nkeys)
+{
+    size_t size = sizeof("apikey=&application=&event=&description=&priority=");
+    int i;
+
+    size += nkeys * (3 + CPROWL_WIRE_ESCAPE_SIZE(CPROWL_MAX_LENGTH_API));
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        size += CPROWL_WIRE_ESCAPE_SIZE(cprowl_request_len(req, i));
+    }
+    return size;
+}
+
+static char*
+wire_escape_field(char *out, cprowl_add_request_t *req, int field)
+{
+    return cprowl_wire_escape(out, cprowl_request_get(req, field),
+                              cprowl_request_len(req, field));
+}
+
+/* serialize req into buf, replacing its contents; buf keeps its memory, so
+ * a buffer reused across requests stops allocating once it is big enough */
+int
+cprowl_request_serialize(cprowl_buf_t *buf, cprowl_add_request_t *req)
+{
+    return cprowl_request_serialize_keys(buf, req, 0, req->nkeys);
+}
+
+/* serialize req addressed only to key_count keys from key_first on */
+int
+cprowl_request_serialize_keys(cprowl_buf_t *buf, cprowl_add_request_t *req,
+                              size_t key_first, size_t key_count)
+{
+    size_t i;
+    char *out;
+
+    if (key_first > req->nkeys) {
+        key_first = req->nkeys;
+    }
+    if (key_count > req->nkeys - key_first) {
+        key_count = req->nkeys - key_first;
+    }
+
+    cprowl_buf_reset(buf);
+    if (!cprowl_buf_reserve(buf, wire_size(req, key_count))) {
+        return FALSE;
+    }
+
+    out = wire_literal(buf->data, "apikey=");
+    for (i = 0; i < key_count; i++) {
+        if (i > 0) {
+            out = wire_literal(out, "%2C");
+        }
+        out = cprowl_wire_escape(out, req->keys[key_first + i]->api,
+                                 strlen(req->keys[key_first + i]->api));
+    }
+    out = wire_escape_field(wire_literal(out, "&application="), req,
+                            CPROWL_FIELD_APP);
+    out = wire_escape_field(wire_literal(out, "&event="), req,
+                            CPROWL_FIELD_EVENT);
+    out = wire_escape_field(wire_literal(out, "&description="), req,
+                            CPROWL_FIELD_DESCRIPTION);
+    out = wire_escape_field(wire_literal(out, "&priority="), req,
+                            CPROWL_FIELD_PRIORITY);
+
+    buf->len = out - buf->data;
+    buf->data[buf->len] = '\0';
+    return TRUE;
+}
+
+int
+cprowl_wire_encode(cprowl_buf_t *buf, cprowl_add_request_t *req)
+{
+    return cprowl_request_serialize(buf, req) &&
+           cprowl_buf_append(buf, "\n", 1);
+}
+
+static int
+hexval(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* decode a urlencoded value in place, returns the decoded length */
+static size_t
+wire_unescape(char *s, size_t len)
+{
+    char *in = s, *out = s, *end = s + len;
+    int hi, lo;
+
+    while (in < end) {
+        if (*in == '+') {
+            *out++ = ' ';
+            in++;
+        } else if (*in == '%' && end - in >= 3 &&
+                   (hi = hexval(in[1])) >= 0 && (lo = hexval(in[2])) >= 0) {
+            *out++ = (char) ((hi << 4) | lo);
+            in += 3;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    return out - s;
+}
+
+static int
+wire_field(const char *name, size_t len)
+{
+    if (len == 11 && memcmp(name, "application", 11) == 0) {
+        return CPROWL_FIELD_APP;
+    } else if (len == 5 && memcmp(name, "event", 5) == 0) {
+        return CPROWL_FIELD_EVENT;
+    } else if (len == 11 && memcmp(name, "description", 11) == 0) {
+        return CPROWL_FIELD_DESCRIPTION;
+    } else if (len == 8 && memcmp(name, "priority", 8) == 0) {
+        return CPROWL_FIELD_PRIORITY;
+    }
+    return -1;
+}
+
+/* parse one line into req; the line buffer is modified */
+int
+cprowl_wire_decode(cprowl_add_request_t *req, char *line, size_t len)
+{
+    char *p = line, *end = line + len;
+
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+        end = line + --len;
+    }
+
+    while (p < end) {
+        char *amp, *eq, *value;
+        size_t name_len, value_len;
+        int field;
+
+        if ((amp = memchr(p, '&', end - p)) == NULL) {
+            amp = end;
+        }
+        if ((eq = memchr(p, '=', amp - p)) == NULL) {
+            return FALSE;
+        }
+
+        name_len = eq - p;
+        value = eq + 1;
+        value_len = wire_unescape(value, amp - value);
+
+        if (name_len == 6 && memcmp(p, "apikey", 6) == 0) {
+            char *key = value, *vend = value + value_len;
+            while (key < vend) {
+                char *comma = memchr(key, ',', vend - key);
+                if (comma == NULL) {
+                    comma = vend;
+                }
+                *comma = '\0';
+                if (!cprowl_request_add_apikey(req, key)) {
+                    return FALSE;
+                }
+                key = comma + 1;
+            }
+        } else if ((field = wire_field(p, name_len)) >= 0) {
+            if (!cprowl_request_set(req, field, value, value_len)) {
+                return FALSE;
+            }
+        }
+
+        p = amp + 1;
+    }
+
+    return req->nkeys > 0;
+}
+
+static char*
+wire_put16(char *out, size_t v)
+{
+    *out++ = (char) (v >> 8);
+    *out++ = (char) v;
+    return out;
+}
+
+static char*
+wire_put_field(char *out, int type, const char *value, size_t len)
+{
+    *out++ = (char) type;
+    out = wire_put16(out, len);
+    memcpy(out, value, len);
+    return out + len;
+}
+
+/* encode req as one binary frame, header included */
+int
+cprowl_wire_encode_frame(cprowl_buf_t *buf, cprowl_add_request_t *req)
+{
+    size_t size = CPROWL_FRAME_HEADER + req->nkeys * (3 + CPROWL_MAX_LENGTH_API);
+    size_t payload;
+    uint32_t i;
+    char *out;
+
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        size += 3 + cprowl_request_len(req, i);
+    }
+
+    cprowl_buf_reset(buf);
+    if (!cprowl_buf_reserve(buf, size)) {
+        return FALSE;
+    }
+
+    out = buf->data + CPROWL_FRAME_HEADER;
+    for (i = 0; i < req->nkeys; i++) {
+        out = wire_put_field(out, CPROWL_FRAME_APIKEY, req->keys[i]->api,
+                             CPROWL_MAX_LENGTH_API);
+    }
+    for (i = 0; i < CPROWL_NFIELDS; i++) {
+        out = wire_put_field(out, CPROWL_FRAME_FIELD + i,
+                             cprowl_request_get(req, i),
+                             cprowl_request_len(req, i));
+    }
+
+    payload = out - buf->data - CPROWL_FRAME_HEADER;
+    buf->data[0] = (char) CPROWL_FRAME_MAGIC;
+    buf->data[1] = CPROWL_FRAME_VERSION;
+    buf->data[2] = buf->data[3] = 0;
+    buf->data[4] = (char) (payload >> 24);
+    buf->data[5] = (char) (payload >> 16);
+    buf->data[6] = (char) (payload >> 8);
+    buf->data[7] = (char) payload;
+    buf->len = out - buf->data;
+    return TRUE;
+}
+
+/* decode the payload of a binary frame into req; unknown field types are
+ * skipped */
+int
+cprowl_wire_decode_frame(cprowl_add_request_t *req, const char *payload,
+                         size_t len)
+{
+    const unsigned char *p = (const unsigned char *) payload;
+    const unsigned char *end = p + len;
+
+    while (p < end) {
+        int type;
+        size_t flen;
+
+        if (end - p < 3) {
+            return FALSE;
+        }
+        type = p[0];
+        flen = (p[1] << 8) | p[2];
+        p += 3;
+        if ((size_t) (end - p) < flen) {
+            return FALSE;
+        }
+
+        if (type == CPROWL_FRAME_APIKEY) {
+            char key[CPROWL_MAX_LENGTH_API + 1];
+
+            if (flen != CPROWL_MAX_LENGTH_API) {
+                return FALSE;
+            }
+            memcpy(key, p, flen);
+            key[flen] = '\0';
+            if (!cprowl_request_add_apikey(req, key)) {
+                return FALSE;
+            }
+        } else if (type >= CPROWL_FRAME_FIELD &&
+                   type < CPROWL_FRAME_FIELD + CPROWL_NFIELDS) {
+            if (!cprowl_request_set(req, type - CPROWL_FRAME_FIELD,
+                                    (const char *) p, flen)) {
+                return FALSE;
+            }
+        }
+        p += flen;
+    }
+
+    return req->nkeys > 0;
+}